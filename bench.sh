@@ -0,0 +1,104 @@
+#!/bin/sh
+# Loopback benchmark of the client against the in-tree server, run by
+# "make bench". Every combination of operation, mode, file size, block
+# size and window size is one run and one line of output, in a fixed
+# format that can be diffed between releases:
+#
+#   op mode size blksize window MB/s packets/s cpu_s
+#
+# MB/s and packets/s are over the transfer itself, from the client's
+# statistics. cpu_s is the user and system time of the client. What
+# is run can be narrowed down or widened with the variables below,
+# e.g. "make bench BENCH_SIZES=1G BENCH_MODES=octet".
+
+SIZES=${BENCH_SIZES:-1K 1M 64M 1G}
+MODES=${BENCH_MODES:-octet netascii}
+BLKSIZES=${BENCH_BLKSIZES:-512 1468 65464}
+WINDOWS=${BENCH_WINDOWS:-1 8}
+HOST=127.0.0.1
+
+TFTP=$(pwd)/tftp
+TFTPD=$(pwd)/tftpd
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/tftp-bench.XXXXXX") || exit 1
+
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir "$DIR/root" "$DIR/client"
+
+# Bytes in a size such as 64K or 1G
+bytes() {
+    case $1 in
+    *K) echo $((${1%K} * 1024)) ;;
+    *M) echo $((${1%M} * 1024 * 1024)) ;;
+    *G) echo $((${1%G} * 1024 * 1024 * 1024)) ;;
+    *) echo "$1" ;;
+    esac
+}
+
+# Value of a number in the client's JSON statistics
+field() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2"
+}
+
+# Text with lines of ordinary length, so netascii has newlines to
+# translate
+for size in $SIZES; do
+    base64 -w 76 /dev/urandom | head -c "$(bytes "$size")" > "$DIR/root/$size"
+done
+
+"$TFTPD" "$DIR/root" &
+SERVER=$!
+sleep 0.2
+
+if ! kill -0 "$SERVER" 2>/dev/null; then
+    echo "Could not start the server" >&2
+    exit 1
+fi
+
+cd "$DIR/client" || exit 1
+
+printf "%-4s %-8s %5s %7s %6s %10s %10s %8s\n" \
+    "# op" mode size blksize window MB/s packets/s cpu_s
+
+for op in get put; do
+for mode in $MODES; do
+for size in $SIZES; do
+for blksize in $BLKSIZES; do
+for window in $WINDOWS; do
+    flags="-q --stats=json -b $blksize -w $window"
+    [ "$mode" = netascii ] && flags="$flags -a"
+
+    rm -f "$size" "$DIR/root/put-$size" stats
+    if [ "$op" = get ]; then
+        "$TFTP" $flags -g "$size" $HOST > stats
+        cmp -s "$size" "$DIR/root/$size"
+    else
+        ln -s "$DIR/root/$size" "put-$size"
+        "$TFTP" $flags -p "put-$size" $HOST > stats
+        rm -f "put-$size"
+        # The server's copy is complete once the final block is acked
+        cmp -s "$DIR/root/put-$size" "$DIR/root/$size"
+    fi
+
+    if [ $? -ne 0 ] || [ "$(field failed stats)" != 0 ]; then
+        printf "%-4s %-8s %5s %7s %6s %10s %10s %8s\n" \
+            "$op" "$mode" "$size" "$blksize" "$window" FAILED - -
+        continue
+    fi
+
+    awk -v op="$op" -v mode="$mode" -v size="$size" -v blksize="$blksize" \
+        -v window="$window" -v rate="$(field bytes_per_sec stats)" \
+        -v pps="$(field packets_per_sec stats)" \
+        -v user="$(field cpu_user_s stats)" -v sys="$(field cpu_sys_s stats)" \
+        'BEGIN { printf "%-4s %-8s %5s %7s %6s %10.2f %10.0f %8.3f\n",
+                 op, mode, size, blksize, window, rate / 1e6, pps, user + sys }'
+done
+done
+done
+done
+done
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Recovery benchmark, run by "make bench-loss". The client talks to
+# the in-tree server through tftproxy, which drops a given share of
+# the datagrams in both directions. The proxy is restarted with the
+# same seed for every run, so every run loses the same datagrams for
+# as long as client and server behave the same. One line per run:
+#
+#   op loss% window seconds MB/s retransmissions timeouts
+#
+# seconds is the time to complete the transfer and MB/s the goodput,
+# both from the client's statistics. Tune with the variables below,
+# e.g. "make bench-loss BENCH_LOSSES=20 BENCH_JITTER=10".
+
+LOSSES=${BENCH_LOSSES:-1 5 20}
+WINDOWS=${BENCH_WINDOWS:-1 8}
+SIZE=${BENCH_SIZE:-262144}
+BLKSIZE=${BENCH_BLKSIZE:-1468}
+SEED=${BENCH_SEED:-1}
+DUP=${BENCH_DUP:-0}
+REORDER=${BENCH_REORDER:-0}
+DELAY=${BENCH_DELAY:-0}
+JITTER=${BENCH_JITTER:-0}
+HOST=127.0.0.1
+SERVER_PORT=6970
+
+TFTP=$(pwd)/tftp
+TFTPD=$(pwd)/tftpd
+TFTPROXY=$(pwd)/tftproxy
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/tftp-bench.XXXXXX") || exit 1
+
+cleanup() {
+    [ -n "$PROXY" ] && kill "$PROXY" 2>/dev/null
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir "$DIR/root" "$DIR/client"
+
+field() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2"
+}
+
+head -c "$SIZE" /dev/urandom > "$DIR/root/file"
+
+"$TFTPD" -p $SERVER_PORT "$DIR/root" &
+SERVER=$!
+sleep 0.2
+
+if ! kill -0 "$SERVER" 2>/dev/null; then
+    echo "Could not start the server" >&2
+    exit 1
+fi
+
+cd "$DIR/client" || exit 1
+
+printf "%-4s %6s %6s %9s %8s %8s %8s\n" \
+    "# op" loss% window seconds MB/s retrans timeouts
+
+for op in get put; do
+for loss in $LOSSES; do
+for window in $WINDOWS; do
+    "$TFTPROXY" -p $SERVER_PORT -S "$SEED" -L "$loss" -D "$DUP" \
+        -R "$REORDER" -d "$DELAY" -j "$JITTER" 2> /dev/null &
+    PROXY=$!
+    sleep 0.1
+
+    if ! kill -0 "$PROXY" 2>/dev/null; then
+        echo "Could not start the proxy" >&2
+        exit 1
+    fi
+
+    flags="-q --stats=json -b $BLKSIZE -w $window"
+
+    rm -f file "$DIR/root/put" stats
+    if [ "$op" = get ]; then
+        "$TFTP" $flags -g file $HOST > stats
+        cmp -s file "$DIR/root/file"
+    else
+        ln -s "$DIR/root/file" put
+        "$TFTP" $flags -p put $HOST > stats
+        rm -f put
+        cmp -s "$DIR/root/put" "$DIR/root/file"
+    fi
+    ok=$?
+
+    kill "$PROXY"
+    wait "$PROXY" 2>/dev/null
+    PROXY=
+
+    if [ $ok -ne 0 ] || [ "$(field failed stats)" != 0 ]; then
+        printf "%-4s %6s %6s %9s %8s %8s %8s\n" "$op" "$loss" "$window" FAILED - - -
+        continue
+    fi
+
+    awk -v op="$op" -v loss="$loss" -v window="$window" \
+        -v secs="$(field seconds stats)" -v rate="$(field bytes_per_sec stats)" \
+        -v retrans="$(field retransmissions stats)" -v timeouts="$(field timeouts stats)" \
+        'BEGIN { printf "%-4s %6s %6s %9.3f %8.2f %8d %8d\n",
+                 op, loss, window, secs, rate / 1e6, retrans, timeouts }'
+done
+done
+done
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Multicast benchmark, run by "make bench-mcast". BENCH_CLIENTS client
+# processes get the same image from the server, started BENCH_STAGGER
+# ms apart so the later ones join a transfer under way, once over
+# unicast and once over loopback multicast (RFC 2090). One line per
+# run:
+#
+#   mode clients seconds MB_sent packets
+#
+# MB_sent and packets are what the server sent and received for all
+# clients together, seconds the time until the last client had the
+# whole image. Every client's copy is compared with the image. Tune
+# with the variables below, e.g. "make bench-mcast BENCH_CLIENTS=32".
+
+CLIENTS=${BENCH_CLIENTS:-8}
+SIZE=${BENCH_SIZE:-16777216}
+BLKSIZE=${BENCH_BLKSIZE:-1468}
+WINDOW=${BENCH_WINDOW:-8}
+STAGGER=${BENCH_STAGGER:-20}
+GROUP=${BENCH_GROUP:-239.255.42.1}
+HOST=127.0.0.1
+
+TFTP=$(pwd)/tftp
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/tftp-bench.XXXXXX") || exit 1
+
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir "$DIR/root"
+
+field() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2"
+}
+
+head -c "$SIZE" /dev/urandom > "$DIR/root/image"
+
+printf "%-9s %7s %9s %9s %9s\n" "# mode" clients seconds MB_sent packets
+
+for mode in unicast multicast; do
+    # One worker, so all clients end up in the same group
+    flags="-q --stats=json -t 1"
+    cflags="-q -b $BLKSIZE -w $WINDOW"
+    if [ "$mode" = multicast ]; then
+        flags="$flags -G $GROUP"
+        cflags="$cflags -M"
+    fi
+
+    "$TFTP" $flags -s "$DIR/root" > "$DIR/stats" &
+    SERVER=$!
+    sleep 0.2
+
+    if ! kill -0 "$SERVER" 2>/dev/null; then
+        echo "Could not start the server" >&2
+        exit 1
+    fi
+
+    start=$(date +%s%N)
+    c=1
+    pids=
+    while [ $c -le "$CLIENTS" ]; do
+        rm -rf "$DIR/client$c"
+        mkdir "$DIR/client$c"
+        (cd "$DIR/client$c" && "$TFTP" $cflags -g image $HOST) &
+        pids="$pids $!"
+        sleep "$(awk -v ms="$STAGGER" 'BEGIN { print ms / 1000 }')"
+        c=$((c + 1))
+    done
+    wait $pids
+    end=$(date +%s%N)
+
+    kill -INT "$SERVER"
+    wait "$SERVER"
+    SERVER=
+
+    ok=0
+    c=1
+    while [ $c -le "$CLIENTS" ]; do
+        cmp -s "$DIR/client$c/image" "$DIR/root/image" || ok=1
+        c=$((c + 1))
+    done
+
+    if [ $ok -ne 0 ] || [ "$(field failed "$DIR/stats")" != 0 ]; then
+        printf "%-9s %7s %9s %9s %9s\n" "$mode" "$CLIENTS" FAILED - -
+        continue
+    fi
+
+    awk -v mode="$mode" -v clients="$CLIENTS" -v ns="$((end - start))" \
+        -v bytes="$(field bytes "$DIR/stats")" -v packets="$(field packets "$DIR/stats")" \
+        'BEGIN { printf "%-9s %7d %9.3f %9.2f %9d\n",
+                 mode, clients, ns / 1e9, bytes / 1e6, packets }'
+done
@@ -0,0 +1,106 @@
+#!/bin/sh
+# Server scaling benchmark, run by "make bench-serve". The server is
+# started with a given number of worker threads, then BENCH_CLIENTS
+# client processes each get BENCH_REQUESTS small files from it,
+# BENCH_CONCURRENCY at a time, as in a boot storm. One line per
+# thread count:
+#
+#   threads requests seconds requests/s MB/s
+#
+# All numbers are from the server's statistics, seconds being the
+# time from the first request to the last session done. With
+# BENCH_PIN=1 worker i is pinned to CPU i. Tune with the variables
+# below, e.g. "make bench-serve BENCH_THREADS='1 8' BENCH_CLIENTS=8".
+
+NPROC=$(getconf _NPROCESSORS_ONLN 2>/dev/null || echo 1)
+CLIENTS=${BENCH_CLIENTS:-4}
+REQUESTS=${BENCH_REQUESTS:-2000}
+CONCURRENCY=${BENCH_CONCURRENCY:-128}
+SIZE=${BENCH_SIZE:-16384}
+PIN=${BENCH_PIN:-0}
+HOST=127.0.0.1
+
+# 1, 2, 4, ... up to the number of cores, and all of them
+if [ -z "$BENCH_THREADS" ]; then
+    t=1
+    while [ $t -lt "$NPROC" ]; do
+        BENCH_THREADS="$BENCH_THREADS $t"
+        t=$((t * 2))
+    done
+    BENCH_THREADS="$BENCH_THREADS $NPROC"
+fi
+
+TFTP=$(pwd)/tftp
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/tftp-bench.XXXXXX") || exit 1
+
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir "$DIR/root"
+
+field() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2"
+}
+
+# Many names for one file, every request is for a file of its own
+head -c "$SIZE" /dev/urandom > "$DIR/root/image"
+i=1
+while [ $i -le "$REQUESTS" ]; do
+    ln "$DIR/root/image" "$DIR/root/f$i"
+    echo "get f$i $HOST"
+    i=$((i + 1))
+done > "$DIR/list"
+
+printf "%-9s %9s %9s %11s %8s\n" "# threads" requests seconds requests/s MB/s
+
+for threads in $BENCH_THREADS; do
+    flags="-q --stats=json -t $threads"
+
+    if [ "$PIN" = 1 ]; then
+        cpus=0
+        c=1
+        while [ $c -lt "$threads" ]; do
+            cpus="$cpus,$c"
+            c=$((c + 1))
+        done
+        flags="$flags -A $cpus"
+    fi
+
+    "$TFTP" $flags -s "$DIR/root" > "$DIR/stats" &
+    SERVER=$!
+    sleep 0.2
+
+    if ! kill -0 "$SERVER" 2>/dev/null; then
+        echo "Could not start the server" >&2
+        exit 1
+    fi
+
+    c=1
+    pids=
+    while [ $c -le "$CLIENTS" ]; do
+        rm -rf "$DIR/client$c"
+        mkdir "$DIR/client$c"
+        (cd "$DIR/client$c" && "$TFTP" -q -c "$CONCURRENCY" -l "$DIR/list" > /dev/null) &
+        pids="$pids $!"
+        c=$((c + 1))
+    done
+    wait $pids
+
+    kill -INT "$SERVER"
+    wait "$SERVER"
+    SERVER=
+
+    if [ "$(field failed "$DIR/stats")" != 0 ]; then
+        printf "%-9s %9s %9s %11s %8s\n" "$threads" FAILED - - -
+        continue
+    fi
+
+    awk -v threads="$threads" -v reqs="$(field transfers "$DIR/stats")" \
+        -v secs="$(field seconds "$DIR/stats")" -v rate="$(field bytes_per_sec "$DIR/stats")" \
+        'BEGIN { printf "%-9s %9d %9.3f %11.0f %8.2f\n",
+                 threads, reqs, secs, (secs > 0 ? reqs / secs : 0), rate / 1e6 }'
+done
@@ -0,0 +1,222 @@
+/* Read-only in-memory file cache for server mode. */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "cache.h"
+
+/* FNV-1a */
+static unsigned int cache_hash(const char *path)
+{
+    unsigned int h = 2166136261u;
+
+    while (*path)
+        h = (h ^ (unsigned char) *path++) * 16777619u;
+
+    return h & (CACHE_BUCKETS - 1);
+}
+
+static void cache_unlink_lru(struct cache *c, struct cache_file *f)
+{
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        c->head = f->next;
+
+    if (f->next)
+        f->next->prev = f->prev;
+    else
+        c->tail = f->prev;
+
+    f->prev = f->next = NULL;
+}
+
+static void cache_push_lru(struct cache *c, struct cache_file *f)
+{
+    f->prev = NULL;
+    f->next = c->head;
+
+    if (c->head)
+        c->head->prev = f;
+    else
+        c->tail = f;
+
+    c->head = f;
+}
+
+static void cache_free_file(struct cache *c, struct cache_file *f)
+{
+    c->used -= f->size;
+    free(f->data);
+    free(f->path);
+    free(f);
+}
+
+/* Take a file out of the cache. Sessions still sending it keep it
+ * until they are done. */
+static void cache_remove(struct cache *c, struct cache_file *f)
+{
+    struct cache_file **pp = &c->table[cache_hash(f->path)];
+
+    while (*pp != f)
+        pp = &(*pp)->hnext;
+    *pp = f->hnext;
+
+    cache_unlink_lru(c, f);
+
+    if (f->refs > 0)
+        f->stale = 1;
+    else
+        cache_free_file(c, f);
+}
+
+/* Make room for 'size' more bytes. Returns negative if there is not
+ * enough to evict. */
+static int cache_evict(struct cache *c, size_t size)
+{
+    struct cache_file *f = c->tail;
+
+    if (size > c->budget)
+        return -1;
+
+    while (c->used + size > c->budget && f) {
+        struct cache_file *prev = f->prev;
+
+        if (f->refs == 0) {
+            cache_remove(c, f);
+            c->evictions++;
+        }
+
+        f = prev;
+    }
+
+    return c->used + size > c->budget ? -1 : 0;
+}
+
+/* Read all of 'size' bytes from 'fd' */
+static int cache_read(int fd, char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+
+        buf += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+void cache_init(struct cache *c, size_t budget)
+{
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->lock, NULL);
+    c->budget = budget;
+}
+
+void cache_free(struct cache *c)
+{
+    while (c->head)
+        cache_remove(c, c->head);
+
+    pthread_mutex_destroy(&c->lock);
+}
+
+/* Called with the lock held */
+static struct cache_file *cache_get_locked(struct cache *c, const char *path)
+{
+    unsigned int h = cache_hash(path);
+    struct cache_file *f;
+    struct stat st;
+    int fd;
+
+    if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    for (f = c->table[h]; f; f = f->hnext) {
+        if (strcmp(f->path, path))
+            continue;
+
+        /* Changed on disk, e.g. by a put */
+        if (f->ino != st.st_ino || f->size != (size_t) st.st_size ||
+            f->mtime.tv_sec != st.st_mtim.tv_sec ||
+            f->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            cache_remove(c, f);
+            break;
+        }
+
+        c->hits++;
+        f->refs++;
+        cache_unlink_lru(c, f);
+        cache_push_lru(c, f);
+
+        return f;
+    }
+
+    c->misses++;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    /* What is read is what the key must describe */
+    if (fstat(fd, &st) < 0 || cache_evict(c, st.st_size) < 0 ||
+        !(f = calloc(1, sizeof(*f)))) {
+        close(fd);
+        return NULL;
+    }
+
+    f->path = strdup(path);
+    f->size = st.st_size;
+    f->ino = st.st_ino;
+    f->mtime = st.st_mtim;
+
+    /* Read rather than mapped, a file truncated under a mapping
+     * would kill us with SIGBUS */
+    if (!f->path || (f->size > 0 && !(f->data = malloc(f->size))) ||
+        cache_read(fd, f->data, f->size) < 0) {
+        close(fd);
+        free(f->data);
+        free(f->path);
+        free(f);
+        return NULL;
+    }
+
+    close(fd);
+
+    f->refs = 1;
+    f->hnext = c->table[h];
+    c->table[h] = f;
+    c->used += f->size;
+    cache_push_lru(c, f);
+
+    return f;
+}
+
+struct cache_file *cache_get(struct cache *c, const char *path)
+{
+    struct cache_file *f;
+
+    /* Held while a missing file is read, so that a boot storm reads
+     * it only once */
+    pthread_mutex_lock(&c->lock);
+    f = cache_get_locked(c, path);
+    pthread_mutex_unlock(&c->lock);
+
+    return f;
+}
+
+void cache_put(struct cache *c, struct cache_file *f)
+{
+    pthread_mutex_lock(&c->lock);
+    if (--f->refs == 0 && f->stale)
+        cache_free_file(c, f);
+    pthread_mutex_unlock(&c->lock);
+}
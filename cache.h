@@ -0,0 +1,64 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Hash buckets, a power of two */
+#define CACHE_BUCKETS 256
+
+/*
+  A file held in memory. Stays valid for as long as it is referenced,
+  even if the file on disk changes or it is evicted meanwhile.
+ */
+struct cache_file {
+	char *path;
+	char *data; /* The contents, NULL if the file is empty */
+	size_t size;
+	ino_t ino; /* What the contents were read from, see cache_get() */
+	struct timespec mtime;
+	int refs; /* Sessions sending from it */
+	int stale; /* No longer in the cache, freed when unreferenced */
+	struct cache_file *prev; /* LRU list, most recently used first */
+	struct cache_file *next;
+	struct cache_file *hnext; /* Hash chain */
+};
+
+/*
+  A read-only cache of whole files, keyed by path and modification
+  time. Files are read once and then shared by every session sending
+  them. The least recently used files that nobody is sending are
+  evicted to stay within the budget. Safe to share between threads,
+  which only contend for it when a session starts or ends.
+ */
+struct cache {
+	pthread_mutex_t lock;
+	size_t budget; /* Most bytes of file contents to hold */
+	size_t used; /* Bytes held, stale files included */
+	unsigned long hits;
+	unsigned long misses; /* Files read, or too large to cache */
+	unsigned long evictions;
+	struct cache_file *head; /* LRU list */
+	struct cache_file *tail;
+	struct cache_file *table[CACHE_BUCKETS];
+};
+
+void cache_init(struct cache *c, size_t budget);
+
+/* Drop all unreferenced files */
+void cache_free(struct cache *c);
+
+/*
+  Get the contents of the file at 'path', reading it if it is not
+  cached or has changed since. Returns NULL if the file can't be
+  read or does not fit the budget, in which case it is to be read
+  the usual way. Every file returned must be given back with
+  cache_put().
+ */
+struct cache_file *cache_get(struct cache *c, const char *path);
+
+void cache_put(struct cache *c, struct cache_file *f);
+
+#endif /* _CACHE_H */
@@ -0,0 +1,339 @@
+/* Streaming CRC32C and SHA-256.
+
+   On x86-64 the CRC is done 8 bytes at a time with the SSE4.2 crc32
+   instruction and SHA-256 a block at a time with the SHA extensions,
+   if cpuid says the CPU has them. Both are compiled in whatever the
+   build flags, as only those functions are built for the newer CPU.
+*/
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define DIGEST_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "digest.h"
+
+#define CRC32C_POLY 0x82f63b78 /* Castagnoli, reflected */
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const u_int32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const u_int32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static u_int32_t crc32c_table[256];
+
+static u_int32_t crc32c_sw(u_int32_t crc, const unsigned char *p, size_t len)
+{
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+static void sha256_blocks_sw(u_int32_t h[8], const unsigned char *p, size_t nblocks)
+{
+    u_int32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+    int i;
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+        for (i = 0; i < 16; i++)
+            w[i] = (u_int32_t) p[4 * i] << 24 | (u_int32_t) p[4 * i + 1] << 16 |
+                (u_int32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+
+        for (i = 16; i < 64; i++)
+            w[i] = w[i - 16] + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                w[i - 7] + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3];
+        e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+        for (i = 0; i < 64; i++) {
+            t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+                sha256_k[i] + w[i];
+            t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            k = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+    }
+}
+
+#ifdef DIGEST_X86
+__attribute__((target("sse4.2")))
+static u_int32_t crc32c_hw(u_int32_t crc, const unsigned char *p, size_t len)
+{
+    u_int64_t crc64 = crc;
+
+    for (; len > 0 && ((uintptr_t) p & 7); len--)
+        crc64 = _mm_crc32_u8(crc64, *p++);
+
+    for (; len >= 8; len -= 8, p += 8)
+        crc64 = _mm_crc32_u64(crc64, *(const u_int64_t *) p);
+
+    for (; len > 0; len--)
+        crc64 = _mm_crc32_u8(crc64, *p++);
+
+    return crc64;
+}
+
+/*
+  Four rounds at a time, the state kept as ABEF and CDGH as the
+  instructions want it. The message schedule is a ring of the last
+  four groups of four words.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_hw(u_int32_t h[8], const unsigned char *p, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i abef, cdgh, abef_save, cdgh_save, tmp, msg, w[4];
+    int i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xb1); /* CDAB */
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1b); /* EFGH */
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+        abef_save = abef;
+        cdgh_save = cdgh;
+
+#pragma GCC unroll 16
+        for (i = 0; i < 16; i++) {
+            if (i < 4)
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), bswap);
+            else
+                w[i & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]),
+                                  _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4)),
+                    w[(i + 3) & 3]);
+
+            msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(abef, 0x1b); /* FEBA */
+    cdgh = _mm_shuffle_epi32(cdgh, 0xb1); /* DCHG */
+    _mm_storeu_si128((__m128i *) &h[0], _mm_blend_epi16(tmp, cdgh, 0xf0)); /* DCBA */
+    _mm_storeu_si128((__m128i *) &h[4], _mm_alignr_epi8(cdgh, tmp, 8)); /* HGFE */
+}
+#endif
+
+static u_int32_t (*crc32c_update)(u_int32_t, const unsigned char *, size_t);
+static void (*sha256_blocks)(u_int32_t *, const unsigned char *, size_t);
+
+/* Pick the kernels once. Racing threads pick the same ones. */
+static void digest_setup(void)
+{
+    u_int32_t crc;
+    int i, j;
+
+    if (crc32c_update)
+        return;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+
+    sha256_blocks = sha256_blocks_sw;
+    crc32c_update = crc32c_sw;
+
+#ifdef DIGEST_X86
+    {
+        unsigned int eax, ebx, ecx, edx;
+        int sse41 = 0;
+
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            sse41 = (ecx & bit_SSE4_1) != 0;
+            if (ecx & bit_SSE4_2)
+                crc32c_update = crc32c_hw;
+        }
+        if (sse41 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA))
+            sha256_blocks = sha256_blocks_hw;
+    }
+#endif
+}
+
+int digest_parse_alg(const char *name)
+{
+    if (strcmp(name, "crc32c") == 0)
+        return DIGEST_CRC32C;
+    if (strcmp(name, "sha256") == 0)
+        return DIGEST_SHA256;
+
+    return -1;
+}
+
+const char *digest_name(int alg)
+{
+    switch (alg) {
+    case DIGEST_CRC32C:
+        return "crc32c";
+    case DIGEST_SHA256:
+        return "sha256";
+    }
+
+    return "none";
+}
+
+size_t digest_len(int alg)
+{
+    switch (alg) {
+    case DIGEST_CRC32C:
+        return 4;
+    case DIGEST_SHA256:
+        return 32;
+    }
+
+    return 0;
+}
+
+void digest_init(struct digest *d, int alg)
+{
+    digest_setup();
+
+    memset(d, 0, sizeof(*d));
+    d->alg = alg;
+    d->crc = 0xffffffff;
+    memcpy(d->h, sha256_init, sizeof(d->h));
+}
+
+void digest_update(struct digest *d, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t n;
+
+    d->len += len;
+
+    if (d->alg == DIGEST_CRC32C) {
+        d->crc = crc32c_update(d->crc, p, len);
+        return;
+    }
+
+    if (d->alg != DIGEST_SHA256)
+        return;
+
+    if (d->buflen > 0) {
+        n = 64 - d->buflen < len ? 64 - d->buflen : len;
+        memcpy(d->buf + d->buflen, p, n);
+        d->buflen += n;
+        p += n;
+        len -= n;
+
+        if (d->buflen < 64)
+            return;
+
+        sha256_blocks(d->h, d->buf, 1);
+        d->buflen = 0;
+    }
+
+    /* Whole blocks straight from the caller's buffer */
+    if (len >= 64) {
+        sha256_blocks(d->h, p, len / 64);
+        p += len & ~(size_t) 63;
+        len &= 63;
+    }
+
+    memcpy(d->buf, p, len);
+    d->buflen = len;
+}
+
+void digest_final(struct digest *d, unsigned char *md)
+{
+    u_int64_t bits = d->len * 8;
+    u_int32_t crc;
+    int i;
+
+    if (d->alg == DIGEST_CRC32C) {
+        crc = ~d->crc;
+        for (i = 0; i < 4; i++)
+            md[i] = crc >> (24 - 8 * i);
+        return;
+    }
+
+    if (d->alg != DIGEST_SHA256)
+        return;
+
+    /* Pad with 0x80, zeros and the length in bits to a whole block */
+    d->buf[d->buflen++] = 0x80;
+    if (d->buflen > 56) {
+        memset(d->buf + d->buflen, 0, 64 - d->buflen);
+        sha256_blocks(d->h, d->buf, 1);
+        d->buflen = 0;
+    }
+    memset(d->buf + d->buflen, 0, 56 - d->buflen);
+    for (i = 0; i < 8; i++)
+        d->buf[56 + i] = bits >> (56 - 8 * i);
+    sha256_blocks(d->h, d->buf, 1);
+
+    for (i = 0; i < 32; i++)
+        md[i] = d->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void digest_hex(const unsigned char *md, size_t len, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hex[2 * i] = digits[md[i] >> 4];
+        hex[2 * i + 1] = digits[md[i] & 0xf];
+    }
+    hex[2 * len] = '\0';
+}
+
+static int digest_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+int digest_unhex(const char *hex, unsigned char *md)
+{
+    size_t len = strlen(hex), i;
+    int hi, lo;
+
+    if (len == 0 || len % 2 || len / 2 > DIGEST_MAX_LEN)
+        return -1;
+
+    for (i = 0; i < len / 2; i++) {
+        hi = digest_nibble(hex[2 * i]);
+        lo = digest_nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return -1;
+        md[i] = hi << 4 | lo;
+    }
+
+    return len / 2;
+}
@@ -0,0 +1,55 @@
+#ifndef _DIGEST_H
+#define _DIGEST_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+  Streaming CRC32C and SHA-256 of the data of a transfer, fed a block
+  at a time as it is read or written. Both use the CPU's instructions
+  for them (SSE4.2 crc32, SHA-NI) where the CPU has them, checked once
+  at run time, and portable C otherwise.
+ */
+#define DIGEST_NONE   0
+#define DIGEST_CRC32C 1
+#define DIGEST_SHA256 2
+
+#define DIGEST_MAX_LEN 32 /* Bytes of the longest digest */
+
+struct digest {
+	int alg; /* DIGEST_* */
+	u_int32_t crc; /* CRC32C so far, inverted */
+	u_int32_t h[8]; /* SHA-256 state */
+	u_int64_t len; /* Bytes hashed */
+	unsigned char buf[64]; /* SHA-256: start of a block not yet hashed */
+	size_t buflen;
+};
+
+/* DIGEST_* for "crc32c" or "sha256", or -1 */
+int digest_parse_alg(const char *name);
+
+const char *digest_name(int alg);
+
+/* Bytes of an 'alg' digest */
+size_t digest_len(int alg);
+
+void digest_init(struct digest *d, int alg);
+
+void digest_update(struct digest *d, const void *data, size_t len);
+
+/*
+  The digest of everything fed, digest_len() bytes to 'md'. Nothing
+  more can be fed after it.
+ */
+void digest_final(struct digest *d, unsigned char *md);
+
+/* 'len' bytes of 'md' as lower case hex to 'hex', NUL terminated */
+void digest_hex(const unsigned char *md, size_t len, char *hex);
+
+/*
+  Hex in 'hex' to at most DIGEST_MAX_LEN bytes in 'md'. Returns the
+  number of bytes, or -1 if it is not hex.
+ */
+int digest_unhex(const char *hex, unsigned char *md);
+
+#endif /* _DIGEST_H */
@@ -0,0 +1,256 @@
+/* Read-ahead and write-behind thread for the file of a transfer. */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ioq.h"
+
+#define ioq_slot(q, i) ((q)->buf + (size_t) (i) * (q)->slot_size)
+
+/* Wake the transfer if it waits for the thread */
+static void ioq_wake_xfer(struct ioq *q)
+{
+    if (q->xfer_waiting)
+        pthread_cond_signal(&q->xfer_cv);
+}
+
+/*
+  Wake the thread if it has enough to do. It is left alone until the
+  queue is half full when writing, or half empty when reading, so it
+  does a run of I/O per wakeup rather than a block.
+ */
+static void ioq_wake_thread(struct ioq *q)
+{
+    if (q->thread_idle &&
+        (q->stop || (q->writing ? q->count >= (q->depth + 1) / 2 : q->count <= q->depth / 2)))
+        pthread_cond_signal(&q->thread_cv);
+}
+
+static void *ioq_thread(void *arg)
+{
+    struct ioq *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+
+    for (;;) {
+        int busy = q->writing ? q->count > 0 : q->count < q->depth;
+        int slot, ok;
+        size_t n;
+
+        /* Only what was queued for writing outlives a stop */
+        if (q->err || (!q->writing && (q->eof || q->stop)) || (q->stop && !busy))
+            break;
+
+        if (!busy) {
+            q->thread_idle = 1;
+            pthread_cond_wait(&q->thread_cv, &q->lock);
+            q->thread_idle = 0;
+            continue;
+        }
+
+        if (q->writing) {
+            slot = q->out;
+            n = q->len[slot];
+
+            pthread_mutex_unlock(&q->lock);
+            ok = (!q->skip[slot] || fseeko(q->fp, q->skip[slot], SEEK_CUR) == 0) &&
+                fwrite(ioq_slot(q, slot), 1, n, q->fp) == n;
+            pthread_mutex_lock(&q->lock);
+
+            if (!ok) {
+                q->err = 1;
+            } else {
+                q->out = (q->out + 1) % q->depth;
+                q->count--;
+            }
+        } else {
+            /* The slot is ours until it is counted */
+            slot = q->in;
+
+            pthread_mutex_unlock(&q->lock);
+            n = fread(ioq_slot(q, slot), 1, q->slot_size, q->fp);
+            ok = !ferror(q->fp);
+            pthread_mutex_lock(&q->lock);
+
+            if (!ok) {
+                q->err = 1;
+            } else {
+                if (n < q->slot_size)
+                    q->eof = 1;
+                if (n > 0) {
+                    q->len[slot] = n;
+                    q->in = (q->in + 1) % q->depth;
+                    q->count++;
+                }
+            }
+        }
+
+        ioq_wake_xfer(q);
+    }
+
+    /* Nothing more is coming */
+    ioq_wake_xfer(q);
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+int ioq_init(struct ioq *q, FILE *fp, int writing, int depth, size_t slot_size)
+{
+    memset(q, 0, sizeof(*q));
+    q->fp = fp;
+    q->writing = writing;
+    q->depth = depth;
+    q->slot_size = slot_size;
+    q->buf = malloc((size_t) depth * slot_size);
+    q->len = calloc(depth, sizeof(size_t));
+    q->skip = calloc(depth, sizeof(off_t));
+
+    if (!q->buf || !q->len || !q->skip) {
+        free(q->buf);
+        free(q->len);
+        free(q->skip);
+        return -1;
+    }
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->thread_cv, NULL);
+    pthread_cond_init(&q->xfer_cv, NULL);
+
+    if (pthread_create(&q->thread, NULL, ioq_thread, q) != 0) {
+        pthread_cond_destroy(&q->xfer_cv);
+        pthread_cond_destroy(&q->thread_cv);
+        pthread_mutex_destroy(&q->lock);
+        free(q->buf);
+        free(q->len);
+        free(q->skip);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ioq_free(struct ioq *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    ioq_wake_thread(q);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_join(q->thread, NULL);
+
+    pthread_cond_destroy(&q->xfer_cv);
+    pthread_cond_destroy(&q->thread_cv);
+    pthread_mutex_destroy(&q->lock);
+    free(q->buf);
+    free(q->len);
+    free(q->skip);
+
+    return q->err ? -1 : 0;
+}
+
+int ioq_read(struct ioq *q, char *buf, size_t len)
+{
+    size_t done = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (done < len) {
+        size_t n;
+
+        if (q->count == 0) {
+            if (q->err) {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+            if (q->eof)
+                break;
+
+            q->waits++;
+            q->xfer_waiting = 1;
+            pthread_cond_wait(&q->xfer_cv, &q->lock);
+            q->xfer_waiting = 0;
+            continue;
+        }
+
+        n = q->len[q->out] - q->pos;
+        if (n > len - done)
+            n = len - done;
+
+        memcpy(buf + done, ioq_slot(q, q->out) + q->pos, n);
+        done += n;
+        q->pos += n;
+
+        if (q->pos == q->len[q->out]) {
+            q->pos = 0;
+            q->out = (q->out + 1) % q->depth;
+            q->count--;
+            ioq_wake_thread(q);
+        }
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return done;
+}
+
+int ioq_write(struct ioq *q, const char *buf, size_t len)
+{
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (len > 0 && !q->err) {
+        size_t n = len < q->slot_size ? len : q->slot_size;
+
+        if (q->count == q->depth) {
+            q->waits++;
+            q->xfer_waiting = 1;
+            pthread_cond_wait(&q->xfer_cv, &q->lock);
+            q->xfer_waiting = 0;
+            continue;
+        }
+
+        memcpy(ioq_slot(q, q->in), buf, n);
+        q->len[q->in] = n;
+        q->skip[q->in] = 0;
+        q->in = (q->in + 1) % q->depth;
+        q->count++;
+        buf += n;
+        len -= n;
+
+        ioq_wake_thread(q);
+    }
+
+    ret = q->err ? -1 : 0;
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+int ioq_skip(struct ioq *q, off_t len)
+{
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (q->count == q->depth && !q->err) {
+        q->waits++;
+        q->xfer_waiting = 1;
+        pthread_cond_wait(&q->xfer_cv, &q->lock);
+        q->xfer_waiting = 0;
+    }
+
+    if (!q->err) {
+        /* A slot with nothing to write after the seek */
+        q->len[q->in] = 0;
+        q->skip[q->in] = len;
+        q->in = (q->in + 1) % q->depth;
+        q->count++;
+        ioq_wake_thread(q);
+    }
+
+    ret = q->err ? -1 : 0;
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
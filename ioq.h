@@ -0,0 +1,67 @@
+#ifndef _IOQ_H
+#define _IOQ_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+  A bounded queue of file data between a transfer and a thread doing
+  its disk I/O, so a slow disk does not hold up the network side. The
+  thread either reads the file ahead into the queue, for putting, or
+  writes behind what the transfer queues, for getting. The transfer
+  only waits if the queue is empty or full. The file is the thread's
+  until ioq_free().
+ */
+struct ioq {
+	FILE *fp;
+	int writing; /* Writing behind rather than reading ahead? */
+	int depth; /* Slots in the queue */
+	size_t slot_size; /* Bytes each slot holds */
+	char *buf; /* The slots, slot_size bytes each */
+	size_t *len; /* Bytes in each full slot */
+	off_t *skip; /* Writing: bytes to seek over before the data of each full slot */
+	int in; /* Next slot to fill */
+	int out; /* Next slot to drain */
+	int count; /* Full slots */
+	size_t pos; /* Bytes of slot 'out' already read by the transfer */
+	int eof; /* Read the whole file? */
+	int err; /* A read or write failed, the queue is of no more use */
+	int stop; /* Tell the thread to finish */
+	int thread_idle; /* Thread waiting for room or data */
+	int xfer_waiting; /* Transfer waiting for room or data */
+	unsigned long waits; /* Times the transfer had to wait */
+	pthread_mutex_t lock;
+	pthread_cond_t thread_cv;
+	pthread_cond_t xfer_cv;
+	pthread_t thread;
+};
+
+/*
+  Start a thread reading 'fp' ahead, or writing behind into it if
+  'writing' is set, through 'depth' slots of 'slot_size' bytes.
+  Returns negative on error.
+ */
+int ioq_init(struct ioq *q, FILE *fp, int writing, int depth, size_t slot_size);
+
+/*
+  Write everything still queued and stop the thread. Returns negative
+  if a write failed.
+ */
+int ioq_free(struct ioq *q);
+
+/*
+  Take the next 'len' bytes of the file, as fread() would. Returns
+  fewer only at the end of the file, or negative if a read failed.
+ */
+int ioq_read(struct ioq *q, char *buf, size_t len);
+
+/* Queue 'len' bytes for writing. Returns negative if a write failed. */
+int ioq_write(struct ioq *q, const char *buf, size_t len);
+
+/* Queue a seek 'len' bytes ahead, leaving a hole. Returns negative if
+ * a write failed. */
+int ioq_skip(struct ioq *q, off_t len);
+
+#endif /* _IOQ_H */
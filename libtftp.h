@@ -0,0 +1,222 @@
+#ifndef _LIBTFTP_H
+#define _LIBTFTP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/*
+  The TFTP client and server as a library, libtftp.a. A transfer is a
+  struct tftp_conn, set up with tftp_connect() for a local file or
+  with tftp_connect_io() for data the caller provides or takes, e.g.
+  a buffer in memory with tftp_mem_io(). It is then either run to
+  the end with tftp_transfer(), or started with tftp_start() and
+  stepped along from the caller's own event loop with tftp_step().
+  Errors and warnings are reported on stderr, nothing else is printed
+  but by tftp_stats_print().
+ */
+
+#define TFTP_TYPE_GET 0
+#define TFTP_TYPE_PUT 1
+
+/* Multicast groups handed out at once in server mode, on consecutive
+ * ports from tftp_params.mcast_group */
+#define TFTP_MCAST_GROUPS 64
+
+/* RTT histogram buckets: exact below 8 us, then 8 per doubling */
+#define TFTP_RTT_BUCKETS 512
+
+/* Formats for tftp_stats_print() */
+#define TFTP_STATS_NONE 0
+#define TFTP_STATS_TEXT 1
+#define TFTP_STATS_JSON 2
+
+/* Digests of the data for tftp_params.digest */
+#define TFTP_DIGEST_NONE   0
+#define TFTP_DIGEST_CRC32C 1
+#define TFTP_DIGEST_SHA256 2
+
+struct tftp_conn;
+
+/* Tunables for a transfer, see tftp_params_init() */
+struct tftp_params {
+	int blksize; /* Block size to ask for */
+	int windowsize; /* Window size to ask for */
+	int batch; /* Max datagrams per send or receive syscall */
+	int gso; /* Try UDP GSO/GRO offload? */
+	int events; /* Packet events to keep for a failed transfer, or 0 */
+	int ioq; /* Blocks read ahead or written behind by a thread, or 0 */
+	int port; /* Server port to send requests to, or to listen on */
+	int uring; /* Transfer with io_uring if the kernel has it? */
+	int multicast; /* Ask for multicast (RFC 2090) when getting, with tftp_transfer() only */
+	int resume; /* Get only what an existing local file is missing? */
+	int digest; /* Hash the data as it goes, TFTP_DIGEST_*, see tftp_expect_digest() */
+	int compress; /* Ask for compressed data blocks, a tftp extension of ours? */
+	int sparse; /* Leave holes for blocks of zeros in a file got? */
+	struct sockaddr_in mcast_group; /* First group handed out when serving, port 0 for none */
+};
+
+/* Counters for one transfer, or for a batch of them added up */
+struct tftp_stats {
+	unsigned long transfers; /* Transfers counted */
+	unsigned long failed; /* Of which failed */
+	u_int64_t bytes; /* Payload bytes sent or received */
+	u_int64_t blocks; /* Data blocks sent or received, resends not counted */
+	unsigned long retrans; /* Messages sent again */
+	unsigned long dups; /* Duplicate or out of order messages received */
+	unsigned long dup_acks; /* Of which repeated acks not answered with data */
+	unsigned long stale_data; /* Of which data blocks we already had */
+	unsigned long foreign; /* Datagrams from other TIDs, refused with error 5 */
+	unsigned long drops; /* Datagrams the kernel dropped on our sockets (SO_RXQ_OVFL) */
+	u_int64_t lz_bytes; /* Of 'bytes', those of compressed transfers */
+	u_int64_t lz_file_bytes; /* The file bytes they stood for */
+	unsigned long timeouts; /* Retransmission timer expiries */
+	unsigned long packets; /* Datagrams sent and received */
+	unsigned long rtt_count; /* RTT samples */
+	u_int64_t rtt_sum; /* Sum of the samples (us) */
+	u_int64_t rtt_min; /* Smallest sample (us) */
+	unsigned long rtt_hist[TFTP_RTT_BUCKETS]; /* Samples per bucket */
+	u_int64_t start; /* When the first transfer started, monotonic (us) */
+	u_int64_t end; /* When the last transfer finished */
+	u_int64_t cpu_user; /* CPU time of the whole process (us), see tftp_stats_cpu() */
+	u_int64_t cpu_sys;
+};
+
+/* A transfer to run in batch mode */
+struct tftp_job {
+	int type; /* TFTP_TYPE_GET or TFTP_TYPE_PUT */
+	char *fname; /* File to get or put */
+	char *hostname; /* Server to get it from or put it to */
+	char *digest; /* Digest the data must have in hex, see tftp_expect_digest(), or NULL */
+};
+
+/* Where the data of a transfer comes from or goes to, instead of a
+ * local file */
+struct tftp_io {
+	/* Fill 'buf' with up to 'len' bytes to put. Returns the number
+	 * of bytes, fewer only at the end, or negative on error. */
+	int (*read)(void *arg, char *buf, int len);
+	/* Take 'len' bytes got. Returns negative on error. */
+	int (*write)(void *arg, const char *buf, int len);
+	void *arg;
+};
+
+/* A buffer in memory to put from or get into, see tftp_mem_io() */
+struct tftp_mem {
+	char *data; /* Getting: malloc()ed as the data comes, the caller frees it */
+	size_t len; /* Bytes in 'data' */
+	size_t size; /* Getting: bytes allocated */
+	size_t pos; /* Putting: bytes sent so far */
+};
+
+/* Called once a transfer is complete, with 0 or negative if it failed */
+typedef void (*tftp_done_fn)(struct tftp_conn *tc, int status, void *arg);
+
+/* The defaults of the command line */
+void tftp_params_init(struct tftp_params *params);
+
+/*
+  Set up a transfer of the local file 'fname' to or from 'hostname',
+  depending on 'type'. 'fname' and 'mode' must stay valid for as long
+  as the transfer. Returns NULL on error.
+ */
+struct tftp_conn *tftp_connect(int type, char *fname, char *mode,
+			       const char *hostname,
+			       const struct tftp_params *params);
+
+/*
+  The same for the remote file 'fname' with the data read from or
+  written to the callbacks in 'io'. Neither multicast nor resuming
+  are done, as both need a file.
+ */
+struct tftp_conn *tftp_connect_io(int type, char *fname, char *mode,
+				  const char *hostname, const struct tftp_io *io,
+				  const struct tftp_params *params);
+
+/* Callbacks putting from or getting into 'mem' */
+void tftp_mem_io(struct tftp_mem *mem, struct tftp_io *io);
+
+/*
+  Have 'done' called once the transfer is complete. A get is complete
+  once the last block is written, though tftp_step() may then still
+  answer the server for a while in case our last ack was lost. The
+  callback must not close the transfer.
+ */
+void tftp_set_done(struct tftp_conn *tc, tftp_done_fn done, void *arg);
+
+/* TFTP_DIGEST_* for "crc32c" or "sha256", or negative */
+int tftp_digest_parse(const char *name);
+
+/*
+  Have the transfer fail unless its data comes to the digest 'hex'.
+  The data is hashed with tftp_params.digest or, if that is
+  TFTP_DIGEST_NONE, with the digest the length of 'hex' says: 8
+  digits for CRC32C, 64 for SHA-256. Call it before tftp_start().
+  Returns negative if 'hex' is no such digest.
+ */
+int tftp_expect_digest(struct tftp_conn *tc, const char *hex);
+
+/* The digest of the data in hex once the transfer is complete, or
+ * NULL if none was kept */
+const char *tftp_get_digest(const struct tftp_conn *tc);
+
+/* Send the request. Returns negative on error. */
+int tftp_start(struct tftp_conn *tc);
+
+/* The socket to wait on for tftp_step() */
+int tftp_fd(const struct tftp_conn *tc);
+
+/* Milliseconds until tftp_step() is due even if nothing arrives, or
+ * -1 once the transfer is done */
+int tftp_timeout_ms(const struct tftp_conn *tc);
+
+/*
+  Take whatever arrived and retransmit if the timer expired, without
+  blocking. Returns 1 while the transfer goes on, 0 once it is done,
+  or negative if it failed.
+ */
+int tftp_step(struct tftp_conn *tc);
+
+/* Start the transfer and block until it is done. Returns negative if
+ * it failed. */
+int tftp_transfer(struct tftp_conn *tc);
+
+#ifdef __linux__
+/* The same with io_uring, falling back to tftp_transfer() without it */
+int tftp_transfer_uring(struct tftp_conn *tc);
+#endif
+
+void tftp_close(struct tftp_conn *tc);
+
+/* The counters of a transfer */
+const struct tftp_stats *tftp_get_stats(const struct tftp_conn *tc);
+
+/* Add the counters of 'st' to 'total' */
+void tftp_stats_add(struct tftp_stats *total, const struct tftp_stats *st);
+
+/* Record the CPU time used by the process so far */
+void tftp_stats_cpu(struct tftp_stats *st);
+
+/* Print the counters to stdout in one of the TFTP_STATS_* formats */
+void tftp_stats_print(const struct tftp_stats *st, int format);
+
+/*
+  Run 'njobs' transfers, at most 'concurrency' of them at once, in
+  'mode'. Their counters are added to 'stats'. Returns the number of
+  failed transfers.
+ */
+int tftp_batch(struct tftp_job *jobs, int njobs, int concurrency,
+	       char *mode, const struct tftp_params *params,
+	       struct tftp_stats *stats);
+
+/*
+  Serve the files below 'root' until SIGINT or SIGTERM, with
+  'nworkers' threads, pinned to 'cpus' if given, and 'cache_size'
+  bytes of file cache. Counters go to 'stats'. Returns negative on
+  error.
+ */
+int tftp_serve(const char *root, size_t cache_size, int nworkers,
+	       const int *cpus, int ncpus, const struct tftp_params *params,
+	       struct tftp_stats *stats);
+
+#endif /* _LIBTFTP_H */
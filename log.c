@@ -0,0 +1,80 @@
+/* Leveled logging and packet event rings. */
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include "tftp.h"
+#include "log.h"
+
+/* Quiet by default, programs using the library have their own say.
+ * The command line raises it. */
+int log_level = LOG_LEVEL_WARN;
+
+void log_printf(int level, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(level <= LOG_LEVEL_WARN ? stderr : stdout, fmt, ap);
+    va_end(ap);
+}
+
+int log_ring_init(struct log_ring *ring, unsigned long size)
+{
+    unsigned long n = 1;
+
+    while (n < size)
+        n <<= 1;
+
+    ring->events = calloc(n, sizeof(struct log_event));
+    ring->mask = n - 1;
+    ring->head = 0;
+
+    return ring->events ? 0 : -1;
+}
+
+void log_ring_free(struct log_ring *ring)
+{
+    free(ring->events);
+    ring->events = NULL;
+}
+
+static const char *log_opcode_name(int opcode)
+{
+    static const char *names[] = {
+        "?", "RRQ", "WRQ", "DATA", "ACK", "ERR", "OACK"
+    };
+
+    return opcode > 0 && opcode <= OPCODE_OACK ? names[opcode] : "?";
+}
+
+void log_ring_dump(struct log_ring *ring, FILE *f, const char *name)
+{
+    unsigned long i = 0;
+    u_int64_t start;
+
+    if (!ring->events || ring->head == 0)
+        return;
+
+    if (ring->head > ring->mask + 1)
+        i = ring->head - (ring->mask + 1);
+
+    start = ring->events[i & ring->mask].usec;
+
+    fprintf(f, "Last %lu packet events of %s:\n", ring->head - i, name);
+
+    for (; i < ring->head; i++) {
+        struct log_event *ev = &ring->events[i & ring->mask];
+
+        fprintf(f, "  %10.3f ms %s %-4s",
+                (ev->usec - start) / 1000.0,
+                ev->dir == LOG_EV_SENT ? "sent" : "recv",
+                log_opcode_name(ev->opcode));
+
+        if (ev->opcode == OPCODE_DATA || ev->opcode == OPCODE_ACK)
+            fprintf(f, " block %5hu", ev->blocknr);
+        else if (ev->opcode == OPCODE_ERR)
+            fprintf(f, " code  %5hu", ev->blocknr);
+
+        fprintf(f, " len %u\n", ev->len);
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+  Leveled logging. Errors and warnings go to stderr, the rest to
+  stdout. Messages above the current level are dropped before any
+  formatting is done.
+ */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+#define LOG_LEVEL_TRACE 4
+
+extern int log_level;
+
+void log_printf(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+#define log_at(level, ...) do {					\
+		if (log_level >= (level))			\
+			log_printf((level), __VA_ARGS__);	\
+	} while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/*
+  Per-packet tracing is only built in with -DTFTP_TRACE (make
+  TRACE=1). Otherwise it compiles to nothing, arguments included.
+ */
+#ifdef TFTP_TRACE
+#define log_trace(...) log_at(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define log_trace(...) do { } while (0)
+#endif
+
+#define LOG_EV_SENT 0
+#define LOG_EV_RECV 1
+
+/*
+  One packet event in a ring. Fixed size and binary, nothing is
+  formatted until the ring is dumped.
+ */
+struct log_event {
+	u_int64_t usec; /* Timestamp in microseconds */
+	u_int32_t len; /* Datagram length */
+	u_int16_t opcode;
+	u_int16_t blocknr; /* Block number of DATA and ACK, else 0 */
+	u_int8_t dir; /* LOG_EV_SENT or LOG_EV_RECV */
+};
+
+/*
+  A ring of the most recent packet events. 'events' is NULL while
+  no ring is kept.
+ */
+struct log_ring {
+	struct log_event *events;
+	unsigned long mask; /* Ring size - 1, the size is a power of two */
+	unsigned long head; /* Events recorded so far */
+};
+
+/* Allocate room for at least 'size' events. Returns -1 on failure. */
+int log_ring_init(struct log_ring *ring, unsigned long size);
+void log_ring_free(struct log_ring *ring);
+
+/* Print the events in the ring, oldest first */
+void log_ring_dump(struct log_ring *ring, FILE *f, const char *name);
+
+/* Record a TFTP packet in an allocated ring. 'pkt' points to at
+   least 'len' bytes. */
+static inline void log_ring_add(struct log_ring *ring, int dir, u_int64_t usec,
+				const void *pkt, int len)
+{
+	const unsigned char *p = pkt;
+	struct log_event *ev = &ring->events[ring->head++ & ring->mask];
+
+	ev->usec = usec;
+	ev->len = len;
+	ev->dir = dir;
+	ev->opcode = len >= 2 ? (p[0] << 8) | p[1] : 0;
+	ev->blocknr = len >= 4 ? (p[2] << 8) | p[3] : 0;
+}
+
+#endif /* _LOG_H */
@@ -0,0 +1,232 @@
+/* LZ77 compression of a chunk at a time.
+
+   Matches are found through a hash table of the last position each
+   4 byte sequence was seen at, greedily and without looking back.
+   Where nothing matches the search speeds up, so data that does not
+   compress costs little time.
+*/
+#include <string.h>
+#include <sys/types.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+/* Don't look for matches this close to the end */
+#define LZ_TAIL 8
+
+static u_int32_t lz_read32(const unsigned char *p)
+{
+    u_int32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static u_int64_t lz_read64(const unsigned char *p)
+{
+    u_int64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int lz_hash(u_int32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* The length bytes after a nibble of 15 */
+static unsigned char *lz_put_len(unsigned char *op, int n)
+{
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+
+    return op;
+}
+
+/*
+  A sequence of the literals from 'lit' up to 'ip' and a match of
+  'mlen' bytes 'offset' back, or no match if 'mlen' is 0. Returns
+  where the next one goes, or NULL if it does not fit before 'oend'.
+ */
+static unsigned char *lz_put_seq(unsigned char *op, unsigned char *oend,
+                                 const unsigned char *lit, const unsigned char *ip,
+                                 int offset, int mlen)
+{
+    int nlit = ip - lit;
+    int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    unsigned char *token = op;
+
+    /* Token, literals and offset, with all the length bytes they
+     * might need */
+    if (oend - op < 1 + nlit + nlit / 255 + 1 + 2 + ml / 255 + 1)
+        return NULL;
+
+    op++;
+    if (nlit >= 15) {
+        *token = 15 << 4;
+        op = lz_put_len(op, nlit - 15);
+    } else {
+        *token = nlit << 4;
+    }
+
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (!mlen)
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    if (ml >= 15) {
+        *token |= 15;
+        op = lz_put_len(op, ml - 15);
+    } else {
+        *token |= ml;
+    }
+
+    return op;
+}
+
+int lz_compress(const char *src, int len, char *dst, int cap)
+{
+    u_int32_t table[1 << LZ_HASH_BITS];
+    const unsigned char *base = (const unsigned char *) src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *end = base + len;
+    unsigned char *op = (unsigned char *) dst;
+    unsigned char *oend = op + cap;
+
+    if (len > LZ_MAX_LEN)
+        return 0;
+
+    /* Position 0 for sequences not seen yet, a match is checked
+     * before it is taken anyway */
+    memset(table, 0, sizeof(table));
+
+    while (len > LZ_TAIL && ip < end - LZ_TAIL) {
+        u_int32_t seq = lz_read32(ip);
+        unsigned int h = lz_hash(seq);
+        const unsigned char *ref = base + table[h];
+        const unsigned char *m, *r;
+
+        table[h] = ip - base;
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+            /* One step further for every 64 bytes without a match */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        m = ip + LZ_MIN_MATCH;
+        r = ref + LZ_MIN_MATCH;
+        while (m + 8 <= end && lz_read64(m) == lz_read64(r)) {
+            m += 8;
+            r += 8;
+        }
+        while (m < end && *m == *r) {
+            m++;
+            r++;
+        }
+
+        if (!(op = lz_put_seq(op, oend, anchor, ip, ip - ref, m - ip)))
+            return 0;
+
+        ip = anchor = m;
+
+        /* What follows a match often repeats it */
+        if (ip < end - LZ_TAIL)
+            table[lz_hash(lz_read32(ip - 2))] = ip - 2 - base;
+    }
+
+    if (!(op = lz_put_seq(op, oend, anchor, end, 0, 0)))
+        return 0;
+
+    return op - (unsigned char *) dst;
+}
+
+/* A length continued in length bytes, or -1 if they run past 'iend' */
+static int lz_get_len(const unsigned char **ip, const unsigned char *iend, int n)
+{
+    unsigned char b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        n += b;
+    } while (b == 255 && n < (1 << 24));
+
+    return n;
+}
+
+int lz_decompress(const char *src, int len, char *dst, int cap)
+{
+    const unsigned char *ip = (const unsigned char *) src;
+    const unsigned char *iend = ip + len;
+    unsigned char *base = (unsigned char *) dst;
+    unsigned char *op = base;
+    unsigned char *oend = base + cap;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int nlit = token >> 4;
+        int mlen = token & 15;
+        int offset;
+        const unsigned char *ref;
+
+        if (nlit == 15 && (nlit = lz_get_len(&ip, iend, nlit)) < 0)
+            return -1;
+        if (nlit > iend - ip || nlit > oend - op)
+            return -1;
+
+        /* Short runs 16 bytes at once where there is room to
+         * overshoot */
+        if (nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        /* The last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        if (mlen == 15 && (mlen = lz_get_len(&ip, iend, mlen)) < 0)
+            return -1;
+        mlen += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op - base || mlen > oend - op)
+            return -1;
+
+        /* The match may overlap what it makes. What is copied
+         * repeats every 'offset' bytes, so each copy can take twice
+         * as much as the one before. */
+        ref = op - offset;
+        if (offset >= 16 && mlen <= 16 && oend - op >= 16) {
+            memcpy(op, ref, 16);
+            op += mlen;
+            continue;
+        }
+        while (mlen > 0) {
+            int n = op - ref < mlen ? op - ref : mlen;
+
+            memcpy(op, ref, n);
+            op += n;
+            mlen -= n;
+        }
+    }
+
+    return op - base;
+}
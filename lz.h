@@ -0,0 +1,32 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+/*
+  A fast LZ77 codec for compressing the data of a transfer a chunk at
+  a time, each chunk on its own. A chunk is a run of sequences, each
+  a token byte with a literal length in its high nibble and a match
+  length less LZ_MIN_MATCH in its low one, more length bytes if a
+  nibble is 15, the literals, and a 16 bit little endian offset back
+  to the match. The last sequence has literals only. There is no
+  entropy coding, decompressing is little more than copying.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_LEN 65536 /* Largest chunk, so every offset fits 16 bits */
+
+/*
+  Compress 'len' bytes, at most LZ_MAX_LEN, at 'src' into at most
+  'cap' bytes at 'dst'. Returns the compressed length, or 0 if it
+  does not fit.
+ */
+int lz_compress(const char *src, int len, char *dst, int cap);
+
+/*
+  Decompress the chunk of 'len' bytes at 'src' into at most 'cap'
+  bytes at 'dst'. Returns the decompressed length, or -1 if the chunk
+  is bad or does not fit. Safe on any input.
+ */
+int lz_decompress(const char *src, int len, char *dst, int cap);
+
+#endif /* _LZ_H */
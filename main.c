@@ -0,0 +1,463 @@
+/* Command line front end of the tftp client and server, which are
+   in libtftp.a, see libtftp.h.
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "tftp.h"
+#include "libtftp.h"
+#include "log.h"
+
+/* Transfers run at once in batch mode unless told otherwise */
+#define TFTP_CONCURRENCY_DEFAULT 16
+
+/* Memory for cached files in server mode unless told otherwise (MB) */
+#define TFTP_CACHE_DEFAULT 256
+
+/*
+  Add a transfer to the job list, growing it as needed. Returns
+  negative if out of memory.
+ */
+static int tftp_add_job(struct tftp_job **jobs, int *njobs, int type,
+                        char *fname, char *hostname)
+{
+    struct tftp_job *j;
+
+    if ((*njobs & (*njobs - 1)) == 0) {
+        /* Size is zero or a power of two, double it */
+        j = realloc(*jobs, (*njobs ? 2 * *njobs : 1) * sizeof(struct tftp_job));
+
+        if (!j)
+            return -1;
+
+        *jobs = j;
+    }
+
+    j = &(*jobs)[(*njobs)++];
+    j->type = type;
+    j->fname = fname;
+    j->hostname = hostname;
+    j->digest = NULL;
+
+    return 0;
+}
+
+/*
+  Read transfers from a list file, one per line on the form
+  "get FILE HOST" or "put FILE HOST". Empty lines and lines starting
+  with '#' are skipped. Returns negative on error.
+ */
+static int tftp_read_jobs(const char *path, struct tftp_job **jobs, int *njobs)
+{
+    char line[1024];
+    int lineno = 0;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char op[8], fname[512], hostname[256];
+        int type;
+
+        lineno++;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+
+        if (sscanf(line, "%7s %511s %255s", op, fname, hostname) != 3) {
+            fprintf(stderr, "%s:%d: expected \"get|put FILE HOST\"\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+
+        if (!strcmp(op, "get"))
+            type = TFTP_TYPE_GET;
+        else if (!strcmp(op, "put"))
+            type = TFTP_TYPE_PUT;
+        else {
+            fprintf(stderr, "%s:%d: unknown operation %s\n", path, lineno, op);
+            fclose(fp);
+            return -1;
+        }
+
+        if (tftp_add_job(jobs, njobs, type, strdup(fname), strdup(hostname)) < 0) {
+            fprintf(stderr, "Out of memory!\n");
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+  Look up the digest each transfer must come to in a manifest in the
+  format of sha256sum: "DIGEST  FILE" per line, with '*' in front of
+  FILE in binary mode. FILE is matched against the file name as given
+  and against its last component, the first line matching wins.
+  Returns negative on error, which includes a transfer it does not
+  list.
+ */
+static int tftp_read_manifest(const char *path, struct tftp_job *jobs, int njobs)
+{
+    char line[1024];
+    int lineno = 0;
+    int ret = 0;
+    int i;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char hex[129], fname[512];
+        char *name = fname;
+
+        lineno++;
+
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+
+        if (sscanf(line, "%128s %511[^\r\n]", hex, fname) != 2) {
+            fprintf(stderr, "%s:%d: expected \"DIGEST  FILE\"\n", path, lineno);
+            fclose(fp);
+            return -1;
+        }
+
+        if (*name == '*')
+            name++;
+
+        for (i = 0; i < njobs; i++) {
+            char *base = strrchr(jobs[i].fname, '/');
+
+            if (!jobs[i].digest && (strcmp(jobs[i].fname, name) == 0 ||
+                                    (base && strcmp(base + 1, name) == 0)) &&
+                !(jobs[i].digest = strdup(hex))) {
+                fprintf(stderr, "Out of memory!\n");
+                fclose(fp);
+                return -1;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    for (i = 0; i < njobs; i++) {
+        if (!jobs[i].digest) {
+            fprintf(stderr, "%s: not in %s\n", jobs[i].fname, path);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+/*
+  Parse a comma separated list of CPU numbers. Returns negative on
+  error.
+ */
+static int tftp_parse_cpus(const char *list, int **cpus, int *ncpus)
+{
+    const char *p = list;
+    char *end;
+
+    *ncpus = 1;
+    for (p = list; *p; p++)
+        *ncpus += *p == ',';
+
+    if (!(*cpus = calloc(*ncpus, sizeof(int)))) {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+
+    for (p = list, *ncpus = 0; ; p = end + 1) {
+        long cpu = strtol(p, &end, 10);
+
+        if (end == p || cpu < 0 || (*end && *end != ',')) {
+            fprintf(stderr, "Bad CPU list %s\n", list);
+            return -1;
+        }
+
+        (*cpus)[(*ncpus)++] = cpu;
+
+        if (!*end)
+            break;
+    }
+
+    return 0;
+}
+
+/*
+  Parse the first multicast group to hand out, ADDR[:PORT]. Returns
+  negative if it is not one.
+ */
+static int tftp_parse_group(const char *arg, struct sockaddr_in *group)
+{
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t) (colon - arg) : strlen(arg);
+    int port = colon ? atoi(colon + 1) : TFTP_MCAST_PORT;
+    char addr[INET_ADDRSTRLEN];
+
+    memset(group, 0, sizeof(*group));
+    group->sin_family = AF_INET;
+    group->sin_port = htons(port);
+
+    if (len < sizeof(addr)) {
+        memcpy(addr, arg, len);
+        addr[len] = '\0';
+    }
+
+    if (len >= sizeof(addr) || inet_pton(AF_INET, addr, &group->sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(group->sin_addr.s_addr)) ||
+        port < 1 || port + TFTP_MCAST_GROUPS - 1 > 65535) {
+        fprintf(stderr, "Bad multicast group %s\n", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+
+    char *progname = argv[0];
+    int retval = -1;
+    struct tftp_params params;
+    int concurrency = TFTP_CONCURRENCY_DEFAULT;
+    char *mode = MODE_OCTET;
+    int stats_format = TFTP_STATS_NONE;
+    char *root = NULL;
+    int cache_mb = TFTP_CACHE_DEFAULT;
+    int nworkers = 0;
+    int *cpus = NULL;
+    int ncpus = 0;
+    struct tftp_stats stats;
+    struct tftp_job *jobs = NULL;
+    int njobs = 0;
+    char *expect = NULL;
+    char *manifest = NULL;
+    struct tftp_conn *tc;
+
+    tftp_params_init(&params);
+
+    /* Say what is going on unless told not to */
+    log_level = LOG_LEVEL_INFO;
+
+    /* Check whether the user wants to put or get files. */
+    while (argc > 0) {
+
+        if (strcmp("-b", argv[0]) == 0 && argc > 1) {
+            params.blksize = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-w", argv[0]) == 0 && argc > 1) {
+            params.windowsize = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-a", argv[0]) == 0) {
+            mode = MODE_NETASCII;
+        } else if (strcmp("-v", argv[0]) == 0) {
+            log_level++;
+        } else if (strcmp("-q", argv[0]) == 0) {
+            log_level = LOG_LEVEL_WARN;
+        } else if (strcmp("-r", argv[0]) == 0 && argc > 1) {
+            params.events = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("--stats=json", argv[0]) == 0) {
+            stats_format = TFTP_STATS_JSON;
+        } else if (strcmp("--stats=text", argv[0]) == 0) {
+            stats_format = TFTP_STATS_TEXT;
+        } else if (strcmp("-O", argv[0]) == 0) {
+            params.gso = 1;
+        } else if (strcmp("-U", argv[0]) == 0) {
+            params.uring = 1;
+        } else if (strcmp("-M", argv[0]) == 0) {
+            params.multicast = 1;
+        } else if (strcmp("-C", argv[0]) == 0) {
+            params.resume = 1;
+        } else if (strcmp("-z", argv[0]) == 0) {
+            params.compress = 1;
+        } else if (strcmp("-H", argv[0]) == 0 && argc > 1) {
+            if ((params.digest = tftp_digest_parse(argv[1])) < 0) {
+                fprintf(stderr, "Unknown digest %s, crc32c or sha256\n", argv[1]);
+                return -1;
+            }
+            argc--;
+            argv++;
+        } else if (strcmp("-e", argv[0]) == 0 && argc > 1) {
+            /* For the -g or -p that follows */
+            expect = argv[1];
+            argc--;
+            argv++;
+        } else if (strcmp("-f", argv[0]) == 0 && argc > 1) {
+            manifest = argv[1];
+            argc--;
+            argv++;
+        } else if (strcmp("-G", argv[0]) == 0 && argc > 1) {
+            if (tftp_parse_group(argv[1], &params.mcast_group) < 0)
+                return -1;
+            argc--;
+            argv++;
+        } else if (strcmp("-Q", argv[0]) == 0 && argc > 1) {
+            params.ioq = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-n", argv[0]) == 0 && argc > 1) {
+            params.batch = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-P", argv[0]) == 0 && argc > 1) {
+            params.port = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-m", argv[0]) == 0 && argc > 1) {
+            cache_mb = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-t", argv[0]) == 0 && argc > 1) {
+            nworkers = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-A", argv[0]) == 0 && argc > 1) {
+            if (tftp_parse_cpus(argv[1], &cpus, &ncpus) < 0)
+                return -1;
+            argc--;
+            argv++;
+        } else if (strcmp("-s", argv[0]) == 0 && argc > 1) {
+            root = argv[1];
+            argc--;
+            argv++;
+        } else if (strcmp("-c", argv[0]) == 0 && argc > 1) {
+            concurrency = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (strcmp("-l", argv[0]) == 0 && argc > 1) {
+            if (tftp_read_jobs(argv[1], &jobs, &njobs) < 0)
+                return -1;
+            argc--;
+            argv++;
+        } else if ((strcmp("-g", argv[0]) == 0 || strcmp("-p", argv[0]) == 0) &&
+                   argc > 2) {
+            int type = argv[0][1] == 'g' ? TFTP_TYPE_GET : TFTP_TYPE_PUT;
+
+            if (tftp_add_job(&jobs, &njobs, type, argv[1], argv[2]) < 0) {
+                fprintf(stderr, "Out of memory!\n");
+                return -1;
+            }
+            jobs[njobs - 1].digest = expect;
+            expect = NULL;
+            argc -= 2;
+            argv += 2;
+        }
+        argc--;
+        argv++;
+    }
+
+    /* Print usage message */
+    if ((njobs == 0 && !root) || concurrency < 1 || cache_mb < 0 || nworkers < 0 ||
+        params.port < 1 || params.port > 65535) {
+        fprintf(stderr, "Usage: %s [-a] [-b BLKSIZE] [-w WINDOWSIZE] [-n BATCH] [-O] [-U]\n"
+                "          [-M] [-C] [-z] [-Q DEPTH] [-v|-q] [-r EVENTS] [--stats=json|text]\n"
+                "          [-H crc32c|sha256] [-f MANIFEST] [-P PORT] [-c CONCURRENCY]\n"
+                "          [-l LISTFILE] [[-e DIGEST] -g|-p FILE HOST]...\n"
+                "       %s [-b BLKSIZE] [-w WINDOWSIZE] [-n BATCH] [-O] [-v|-q]\n"
+                "          [-r EVENTS] [--stats=json|text] [-P PORT] [-m CACHE_MB]\n"
+                "          [-t THREADS] [-A CPU[,CPU]...] [-G GROUP[:PORT]] -s ROOTDIR\n",
+                progname, progname);
+        return -1;
+    }
+
+    if (manifest && njobs > 0 && tftp_read_manifest(manifest, jobs, njobs) < 0)
+        return -1;
+
+    /* Keep stdout for the numbers */
+    if (stats_format == TFTP_STATS_JSON && log_level == LOG_LEVEL_INFO)
+        log_level = LOG_LEVEL_WARN;
+
+    memset(&stats, 0, sizeof(stats));
+
+    if (root) {
+        /* Server mode, -b and -w are the most we grant. One worker
+         * per core unless told otherwise. */
+        if (nworkers == 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+            nworkers = 1;
+
+        if (tftp_serve(root, (size_t) cache_mb << 20, nworkers, cpus, ncpus,
+                       &params, &stats) < 0)
+            return -1;
+
+        tftp_stats_cpu(&stats);
+        tftp_stats_print(&stats, stats_format);
+
+        return 0;
+    }
+
+    if (njobs > 1) {
+        /* The epoll loop only watches the unicast sockets */
+        if (params.multicast) {
+            log_info("Multicast is for single transfers, ignoring -M\n");
+            params.multicast = 0;
+        }
+
+        /* Batch mode, run them all concurrently */
+        int failed = tftp_batch(jobs, njobs, concurrency, mode, &params, &stats);
+
+        log_info("%d of %d transfers succeeded\n", njobs - failed, njobs);
+        tftp_stats_cpu(&stats);
+        tftp_stats_print(&stats, stats_format);
+
+        return failed ? -1 : 0;
+    }
+
+    /* Connect to the remote server */
+    tc = tftp_connect(jobs[0].type, jobs[0].fname, mode,
+                      jobs[0].hostname, &params);
+
+    if (tc && jobs[0].digest && tftp_expect_digest(tc, jobs[0].digest) < 0) {
+        tftp_close(tc);
+        tc = NULL;
+    }
+
+    if (!tc) {
+        fprintf(stderr, "Failed to connect!\n");
+        stats.transfers = stats.failed = 1;
+        tftp_stats_cpu(&stats);
+        tftp_stats_print(&stats, stats_format);
+        return -1;
+    }
+
+    /* Transfer the file to or from the server */
+#ifdef OS_LINUX
+    if (params.uring)
+        retval = tftp_transfer_uring(tc);
+    else
+#endif
+        retval = tftp_transfer(tc);
+
+    if (retval < 0) {
+        fprintf(stderr, "File transfer failed!\n");
+    }
+
+    stats = *tftp_get_stats(tc);
+    tftp_stats_cpu(&stats);
+    tftp_stats_print(&stats, stats_format);
+
+    /* We are done. Cleanup our state. */
+    tftp_close(tc);
+
+    return retval;
+}
@@ -0,0 +1,147 @@
+/* Streaming netascii translation.
+
+   Both directions copy runs of ordinary bytes in bulk and only look at
+   CR and LF one at a time. Finding the next CR or LF is done 16 bytes
+   at a time with SSE2 where available.
+*/
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "netascii.h"
+
+#define CR '\r'
+#define LF '\n'
+#define NUL '\0'
+
+/* Offset of the first CR or LF in 'p', or 'len' if there is none */
+static size_t netascii_scan(const char *p, size_t len)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8(CR);
+    const __m128i lf = _mm_set1_epi8(LF);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                  _mm_cmpeq_epi8(v, lf)));
+
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (p[i] == CR || p[i] == LF)
+            return i;
+    }
+
+    return len;
+}
+
+size_t netascii_encode(struct netascii *na, char *dst, size_t dstlen,
+                       const char *src, size_t *srclen)
+{
+    size_t in = 0, out = 0;
+    size_t len = *srclen;
+
+    /* Finish an expansion the previous block had no room for */
+    if (na->pending >= 0 && out < dstlen) {
+        dst[out++] = na->pending;
+        na->pending = -1;
+    }
+
+    while (in < len && out < dstlen) {
+        size_t run = netascii_scan(src + in, len - in);
+
+        if (run > dstlen - out)
+            run = dstlen - out;
+
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+
+        if (in == len || out == dstlen)
+            break;
+
+        /* A CR or LF, both become two bytes */
+        dst[out++] = CR;
+        na->pending = src[in++] == LF ? LF : NUL;
+
+        if (out < dstlen) {
+            dst[out++] = na->pending;
+            na->pending = -1;
+        }
+    }
+
+    *srclen = in;
+
+    return out;
+}
+
+size_t netascii_decode(struct netascii *na, char *dst,
+                       const char *src, size_t srclen)
+{
+    size_t in = 0, out = 0;
+
+    if (na->pending >= 0 && srclen > 0) {
+        /* The previous block ended with a CR */
+        na->pending = -1;
+
+        if (src[0] == LF) {
+            dst[out++] = LF;
+            in++;
+        } else if (src[0] == NUL) {
+            dst[out++] = CR;
+            in++;
+        } else {
+            /* Not valid netascii, keep the CR as is */
+            dst[out++] = CR;
+        }
+    }
+
+    while (in < srclen) {
+        const char *cr = memchr(src + in, CR, srclen - in);
+        size_t run = cr ? (size_t) (cr - (src + in)) : srclen - in;
+
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+
+        if (in == srclen)
+            break;
+
+        /* At a CR, look at what follows it */
+        if (++in == srclen) {
+            na->pending = CR;
+            break;
+        }
+
+        if (src[in] == LF) {
+            dst[out++] = LF;
+            in++;
+        } else if (src[in] == NUL) {
+            dst[out++] = CR;
+            in++;
+        } else {
+            dst[out++] = CR;
+        }
+    }
+
+    return out;
+}
+
+size_t netascii_decode_finish(struct netascii *na, char *dst)
+{
+    if (na->pending < 0)
+        return 0;
+
+    na->pending = -1;
+    dst[0] = CR;
+
+    return 1;
+}
@@ -0,0 +1,46 @@
+#ifndef _NETASCII_H
+#define _NETASCII_H
+
+#include <stddef.h>
+
+/*
+  Streaming netascii translation (RFC 764). On the wire every newline
+  is CR LF and a bare CR is CR NUL. The state carries a translation
+  that was split by a block boundary over to the next call, so blocks
+  can be translated one at a time.
+ */
+struct netascii {
+	int pending; /* Encoder: second byte of a CR LF or CR NUL still
+			to be written. Decoder: a CR ended the previous
+			block. -1 if nothing is pending. */
+};
+
+static inline void netascii_init(struct netascii *na)
+{
+	na->pending = -1;
+}
+
+/*
+  Translate host text in 'src' to netascii in 'dst'. At most 'dstlen'
+  bytes are written and '*srclen' is updated to the number of bytes
+  consumed from 'src'. Returns the number of bytes written, which is
+  less than 'dstlen' only if all of 'src' was consumed.
+ */
+size_t netascii_encode(struct netascii *na, char *dst, size_t dstlen,
+		       const char *src, size_t *srclen);
+
+/*
+  Translate netascii in 'src' to host text in 'dst', which must have
+  room for 'srclen' + 1 bytes. Returns the number of bytes written.
+ */
+size_t netascii_decode(struct netascii *na, char *dst,
+		       const char *src, size_t srclen);
+
+/*
+  End of input for the decoder. Writes a CR that ended the last block
+  to 'dst', which must have room for one byte. Returns the number of
+  bytes written.
+ */
+size_t netascii_decode_finish(struct netascii *na, char *dst);
+
+#endif /* _NETASCII_H */
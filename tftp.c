@@ -3,6 +3,7 @@
    Author: Simon Strandman <sist8525@student.uu.se>
    Author: Egil Salomonsson <egsa7833@student.uu.se>
 */
+#define _GNU_SOURCE /* sendmmsg/recvmmsg */
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -15,19 +16,124 @@
 #include <fcntl.h>
 #include <sys/select.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "tftp.h"
+#include "libtftp.h"
+#include "netascii.h"
+#include "log.h"
+#include "cache.h"
+#include "ioq.h"
+#include "digest.h"
+#include "lz.h"
+#ifdef OS_LINUX
+#include "uring.h"
+#endif
+
+#ifdef OS_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/udp.h>
+#include <sched.h>
+#endif
 
 extern int h_errno;
 
-#define TFTP_TYPE_GET 0
-#define TFTP_TYPE_PUT 1
 
-#define HOST_NEWLINE_STYLE "\n"
-#define NETASCII_NEWLINE_STYLE "\r\n"
+/* Chunk of the file translated at a time in netascii mode. Also large
+ * enough for translating the largest block back. */
+#define TFTP_XLAT_SIZE 65536
 
-/* Should cover most needs */
-#define MSGBUF_SIZE (TFTP_DATA_HDR_LEN + BLOCK_SIZE)
+/* A compressed transfer (OPT_COMPRESS) sends the file as frames of up
+ * to TFTP_XLAT_SIZE bytes, each compressed on its own. A frame is a 4
+ * byte header in network order, its length and TFTP_LZ_STORED if it
+ * went as it was because it did not get any smaller, then its data. */
+#define TFTP_LZ_HDR_LEN 4
+#define TFTP_LZ_STORED 0x80000000
+
+/* Shorter runs of zeros are written rather than left as a hole, they
+ * would not free a filesystem block */
+#define TFTP_HOLE_MIN 4096
+
+/* Block size we ask for unless told otherwise. Fills a standard
+ * Ethernet frame without IP fragmentation. */
+#define TFTP_BLKSIZE_DEFAULT 1468
+
+/* Window we ask for unless told otherwise (RFC 7440). Servers that
+ * don't know the option simply run lock-step. */
+#define TFTP_WINDOWSIZE_DEFAULT 8
+
+/* Largest window we are willing to buffer when putting */
+#define TFTP_WINDOWSIZE_MAX 1024
+
+/* Datagrams per sendmmsg/recvmmsg call unless told otherwise */
+#define TFTP_BATCH_DEFAULT 32
+#define TFTP_BATCH_MAX 1024
+
+/* Limits for one UDP GSO send: segments, and payload bytes of all
+ * segments together, which must fit in one IPv4 datagram */
+#define TFTP_GSO_MAX_SEGS 64
+#define TFTP_GSO_MAX_BYTES 65507
+
+/* Receive buffer size with UDP GRO, which may coalesce up to a full
+ * IPv4 datagram */
+#define TFTP_GRO_BUF_SIZE 65535
+
+/* Room for the control messages of a received datagram: the UDP GRO
+ * segment size and the SO_RXQ_OVFL drop counter */
+#define TFTP_RXCTL_SIZE (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(u_int32_t)))
+
+/* Windows of blocks the socket buffers are sized for, see
+ * tftp_size_bufs() */
+#define TFTP_SOCKBUF_WINDOWS 4
+
+/* Blocks a client reads ahead or writes behind unless told
+ * otherwise, see ioq.h */
+#define TFTP_IOQ_DEFAULT 64
+#define TFTP_IOQ_MAX 65536
+
+/* Events taken from epoll at a time in server mode */
+#define TFTP_SERVE_EVENTS 256
+
+/* Blocks a multicast transfer can have, block numbers don't wrap */
+#define TFTP_MCAST_BLOCKS 65535
+
+/* Transfer states */
+#define TFTP_STATE_XFER   0 /* Request sent or blocks on the move */
+#define TFTP_STATE_LINGER 1 /* Got the last block, our last ack may need resending */
+#define TFTP_STATE_DONE   2 /* Finished, see retval */
+
+/* Message buffer size needed for a given block size */
+#define MSGBUF_SIZE(blksize) (TFTP_DATA_HDR_LEN + (blksize))
+
+
+
+/*
+  A multicast transfer served to a group of clients (RFC 2090). One
+  session sends the blocks to the group address for all of them and
+  takes acks from its master client only, the first one in
+  'clients'. Once the master has the whole file, the next client
+  becomes master and has the blocks it missed sent again.
+ */
+struct tftp_mcast {
+    struct sockaddr_in group; /* Where the blocks go */
+    int slot; /* Port of the group, counted from the first one */
+    int last; /* Number of the final block */
+    int rewind; /* New master client, waiting for its first ack? */
+    struct sockaddr_in *clients; /* Master first, the rest as they came */
+    int nclients;
+    int maxclients;
+};
 
 
 /*
@@ -40,56 +146,487 @@ extern int h_errno;
 /* A connection handle */
 struct tftp_conn {
     int type; /* Are we putting or getting? */
+    int server; /* Serving a client's request rather than making one? */
+    int state; /* Where the transfer is, see TFTP_STATE_* */
+    int retval; /* Result once state is TFTP_STATE_DONE */
+    /* Read the next block of data, returns its length or negative */
+    int (*read_block)(struct tftp_conn *tc, char *buf, int len);
+    /* Write a received block of data, returns negative on error */
+    int (*write_block)(struct tftp_conn *tc, const char *buf, int len);
+    struct netascii na; /* Netascii translation state */
+    char *xlatbuf; /* Netascii translation buffer, TFTP_XLAT_SIZE bytes */
+    int xlat_pos; /* Next byte in xlatbuf to translate when putting */
+    int xlat_len; /* Bytes in xlatbuf when putting */
+    int xlat_eof; /* Whole file read into xlatbuf? */
+    int lz_req; /* Ask for compression, see tftp_lz_start()? */
+    char *lz_frame; /* Compressed frame being sent or received, NULL unless compressed */
+    char *lz_raw; /* The frame uncompressed */
+    int lz_pos; /* Next byte of lz_frame to send, or bytes of it received */
+    int lz_len; /* Bytes in lz_frame, 0 until the header is received */
+    int lz_eof; /* Whole file read into frames? */
     FILE *fp; /* The file we are reading or writing */
+    int sparse; /* Getting into a regular file, leave holes for zeros, see tftp_write_octet()? */
+    off_t hole; /* Zeros got since the last write, not written yet */
+    off_t write_pos; /* Where in the file the next block goes when getting */
+    off_t write_end; /* Where the file ends so far, holes included */
+    int trunc; /* Cut the file at write_end once closed, as it has holes or preallocated space? */
+    int prealloc; /* Space was fallocate()d for the file, see tftp_prealloc()? */
+    off_t tsize; /* File size (RFC 2349): of the file we put, or what the sender said it has */
+    struct tftp_io io; /* Or the caller's callbacks, see tftp_connect_io() */
+    struct ioq *ioq; /* Thread doing the I/O on fp, see tftp_ioq_start(), or NULL */
+    int ioq_depth; /* Blocks it may queue, 0 to do the I/O in line */
+    struct cache *cache; /* Where 'file' came from */
+    struct cache_file *file; /* The cached file we are sending, instead of fp */
+    size_t file_pos; /* Next byte of 'file' to send */
     int sock; /* Socket to communicate with server */
-    int blocknr; /* The current block number */
+    /* Block numbers count on past 65535, only the low 16 bits are
+     * on the wire, see tftp_blocknr() */
+    int64_t blocknr; /* The current block number, last sent when putting */
+    int64_t blocknr_acked; /* Last block acknowledged by the server when putting */
+    int64_t blocknr_last; /* Number of the final (short) block, -1 until read */
+    int winpos; /* Blocks received since our last ack when getting */
+    int gap_acked; /* Already re-acked the current gap when getting? */
+    int64_t ack_sent; /* Block number of the last ack we sent, -1 if none */
+    u_int64_t window_sent; /* When the window after blocknr_acked last went out */
+    int resume; /* Getting into an existing file, see tftp_resume() */
+    off_t offset_req; /* Where in the file we asked the server to start, or 0 */
+    off_t offset; /* Where the server starts, 0 unless it granted an offset */
     char *fname; /* The file name of the file we are putting or getting */
     char *mode; /* TFTP mode */
     struct sockaddr_in peer_addr; /* Remote peer address */
+    struct sockaddr_in server_addr; /* Where requests go, when we are the client */
+    int tid_locked; /* peer_addr is the peer's TID, see tftp_check_tid()? */
+    int connected; /* sock connect()ed to peer_addr, the kernel filters for us? */
     socklen_t addrlen; /* The remote address length */
-    char msgbuf[MSGBUF_SIZE]; /* Buffer for messages being sent or received */
+    int blksize; /* Negotiated block size, TFTP_BLOCK_SIZE until an OACK says otherwise */
+    int blksize_req; /* Block size asked for in the request */
+    int windowsize; /* Negotiated window size, 1 means lock-step */
+    int windowsize_req; /* Window size asked for in the request */
+    int use_opts; /* Append options to RRQ/WRQ? Cleared if the server refuses them */
+    int mc_req; /* Multicast (RFC 2090) asked for, by us or the client? */
+    int mc_sock; /* Socket of the multicast group we get from, or -1 */
+    int mc_master; /* Are we the master client, the one that acks? */
+    int mc_last; /* Number of the final block, 0 until it came */
+    unsigned char *mc_have; /* Bitmap of the blocks we have */
+    struct tftp_mcast *mc; /* Serving: the group our blocks go to, or NULL */
+    u_int64_t rto; /* Current retransmission timeout (us) */
+    u_int64_t srtt; /* Smoothed round trip time (us), 0 until measured */
+    u_int64_t rttvar; /* Round trip time variation (us) */
+    u_int64_t rtt_sent; /* When the packet being timed was sent, 0 if none */
+    u_int64_t deadline; /* When to retransmit if nothing arrives */
+    int timer_pos; /* Where in the heap of the loop driving us, see struct tftp_timers */
+    u_int64_t peer_key; /* peer_addr as the server's session table has it */
+    struct tftp_conn *hnext; /* Hash chain of that table */
+    int retries; /* Consecutive timeouts */
+    int msgbuf_size; /* Size of msgbuf */
+    int msglen; /* Length of the message in msgbuf */
+    char *msgbuf; /* Buffer for messages being sent or received */
+    char *recbuf; /* Buffers for messages being received, rxbuf_size each */
+    int rxbuf_size; /* Size of each receive buffer */
+    char *window; /* Sent but unacknowledged data blocks, msgbuf_size each */
+    int *window_len; /* Length of each message in window */
+    /* Data of each block in window when sent straight from 'file',
+     * the window slot then only holds the header */
+    const char **window_data;
+    /* When each block in window was sent, 0 once it has been resent
+     * and an ack for it can't be timed */
+    u_int64_t *window_time;
+    int batch; /* Max datagrams queued for sending or received at once */
+    int txq_len; /* Datagrams queued for sending */
+#ifdef OS_LINUX
+    struct mmsghdr *txq; /* Datagrams queued for sending */
+    int *txsegs; /* Data blocks in each of them, each one or two iovecs */
+    struct iovec *txiov; /* Where their data is, msgbuf or window slots */
+    char *txctl; /* UDP_SEGMENT control message of each queued datagram */
+    struct mmsghdr *rxq; /* Headers for receiving a batch into recbuf */
+    struct iovec *rxiov;
+    struct sockaddr_in *rxaddr; /* Source address of each received datagram */
+    char *rxctl; /* Control messages of each received datagram */
+    int gso; /* Send runs of full data blocks as one UDP_SEGMENT datagram? */
+    int gro; /* May the kernel coalesce data blocks for us (UDP_GRO)? */
+    u_int32_t sock_drops; /* Kernel drop counters of sock and mc_sock (SO_RXQ_OVFL) */
+    u_int32_t mc_drops;
+    unsigned long gso_sends; /* Coalesced datagrams sent */
+    unsigned long gso_segs; /* Data blocks in them */
+    unsigned long gro_recvs; /* Coalesced datagrams received */
+    unsigned long gro_segs; /* Data blocks in them */
+    struct uring *uring; /* Ring of tftp_transfer_uring(), else NULL */
+    struct msghdr uring_rxmsg; /* Template for the multishot receive */
+    int uring_sends; /* Sends queued for the next io_uring_enter() */
+    off_t file_size; /* Size of the file being put, read by offset */
+    off_t file_off; /* Where the next block is read from */
+    struct msghdr *slot_msg; /* Send of each window slot through the ring */
+    struct iovec *slot_iov;
+    char *slot_busy; /* Read and send of each slot still in flight? */
+#endif
+    unsigned long tx_calls; /* Send syscalls made */
+    unsigned long tx_msgs; /* Datagrams sent by them */
+    unsigned long rx_calls; /* Receive syscalls that got something */
+    unsigned long rx_msgs; /* Datagrams received by them */
+    struct log_ring ring; /* Recent packets, dumped if the transfer fails */
+    struct digest digest; /* Of the file's data so far, see tftp_digest_init() */
+    char digest_expect[2 * DIGEST_MAX_LEN + 1]; /* What it must come to in hex, or "" */
+    char digest_hex[2 * DIGEST_MAX_LEN + 1]; /* What it came to, "" until known */
+    struct tftp_stats stats;
+    tftp_done_fn done; /* Called once complete, see tftp_set_done() */
+    void *done_arg;
+    int done_called;
 };
 
-void print_message(struct tftp_msg* msg, int type)
+/*
+  The block a 16 bit block number from the wire stands for: the one
+  closest to 'near', as the numbers roll over from 65535 to 0 in
+  transfers of more blocks than that.
+ */
+static inline int64_t tftp_blocknr(u_int16_t wire, int64_t near)
 {
+    return near + (int16_t) (wire - (u_int16_t) near);
+}
 
-    printf("\n==========\nMessage type: ");
-    if (type == 0)
-        printf("sent\n");
-    else
-        printf("received\n");
+/* Set once SIGINT or SIGTERM arrives, to stop all workers */
+static volatile sig_atomic_t tftp_stop;
+
+/* Monotonic time in microseconds */
+static u_int64_t tftp_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u_int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+  Arm the retransmission timer after sending something we expect an
+  answer to. Only 'fresh' packets, i.e. not retransmissions, are
+  timed since we can't tell which copy an answer belongs to (Karn's
+  algorithm).
+ */
+static void tftp_timer_arm(struct tftp_conn *tc, int fresh)
+{
+    u_int64_t now = tftp_now();
+
+    tc->rtt_sent = fresh ? now : 0;
+    tc->deadline = now + tc->rto;
+}
+
+/* Histogram bucket of an RTT sample, see TFTP_RTT_BUCKETS */
+static int tftp_rtt_bucket(u_int64_t rtt)
+{
+    int e;
+
+    if (rtt < 8)
+        return rtt;
+
+    e = 63 - __builtin_clzll(rtt);
+
+    return (e - 2) * 8 + ((rtt >> (e - 3)) & 7);
+}
+
+/* Smallest RTT (us) that falls in a bucket */
+static u_int64_t tftp_rtt_bucket_min(int bucket)
+{
+    if (bucket < 8)
+        return bucket;
+
+    return (u_int64_t) (8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+static void tftp_stats_rtt(struct tftp_stats *st, u_int64_t rtt)
+{
+    if (!st->rtt_count || rtt < st->rtt_min)
+        st->rtt_min = rtt;
+
+    st->rtt_count++;
+    st->rtt_sum += rtt;
+    st->rtt_hist[tftp_rtt_bucket(rtt)]++;
+}
+
+/* RTT (us) below which 'pct' percent of the samples fall, to within
+ * the bucket width of 1/8 */
+static u_int64_t tftp_stats_rtt_pct(const struct tftp_stats *st, int pct)
+{
+    unsigned long want = (st->rtt_count * pct + 99) / 100;
+    unsigned long seen = 0;
+    int i;
+
+    for (i = 0; i < TFTP_RTT_BUCKETS; i++) {
+        seen += st->rtt_hist[i];
+
+        if (seen >= want && seen > 0)
+            return tftp_rtt_bucket_min(i);
+    }
+
+    return 0;
+}
+
+/* Add the counters of 'st' to 'total' */
+void tftp_stats_add(struct tftp_stats *total, const struct tftp_stats *st)
+{
+    int i;
+
+    if (st->rtt_count && (!total->rtt_count || st->rtt_min < total->rtt_min))
+        total->rtt_min = st->rtt_min;
+    if (st->start && (!total->start || st->start < total->start))
+        total->start = st->start;
+    if (st->end > total->end)
+        total->end = st->end;
+
+    total->transfers += st->transfers;
+    total->failed += st->failed;
+    total->bytes += st->bytes;
+    total->blocks += st->blocks;
+    total->retrans += st->retrans;
+    total->dups += st->dups;
+    total->dup_acks += st->dup_acks;
+    total->stale_data += st->stale_data;
+    total->foreign += st->foreign;
+    total->drops += st->drops;
+    total->lz_bytes += st->lz_bytes;
+    total->lz_file_bytes += st->lz_file_bytes;
+    total->timeouts += st->timeouts;
+    total->packets += st->packets;
+    total->rtt_count += st->rtt_count;
+    total->rtt_sum += st->rtt_sum;
+
+    for (i = 0; i < TFTP_RTT_BUCKETS; i++)
+        total->rtt_hist[i] += st->rtt_hist[i];
+}
+
+/* Note the CPU time used so far, by all transfers together */
+void tftp_stats_cpu(struct tftp_stats *st)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return;
+
+    st->cpu_user = (u_int64_t) ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+    st->cpu_sys = (u_int64_t) ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+}
+
+/* Print the counters in one of the TFTP_STATS_* formats */
+void tftp_stats_print(const struct tftp_stats *st, int format)
+{
+    double secs = st->end > st->start ? (st->end - st->start) / 1e6 : 0;
+    double rate = secs > 0 ? st->bytes / secs : 0;
+    double avg = st->rtt_count ? (double) st->rtt_sum / st->rtt_count : 0;
+    double min = st->rtt_count ? st->rtt_min : 0;
+    double p99 = tftp_stats_rtt_pct(st, 99);
+    double pps = secs > 0 ? st->packets / secs : 0;
+    double ratio = st->lz_bytes ? (double) st->lz_file_bytes / st->lz_bytes : 0;
+
+    if (format == TFTP_STATS_JSON) {
+        printf("{\"transfers\": %lu, \"failed\": %lu, \"bytes\": %llu, "
+               "\"blocks\": %llu, \"retransmissions\": %lu, \"duplicates\": %lu, "
+               "\"duplicate_acks\": %lu, \"stale_data\": %lu, \"unknown_tid\": %lu, "
+               "\"kernel_drops\": %lu, \"timeouts\": %lu, \"packets\": %lu, "
+               "\"compressed_bytes\": %llu, \"compressed_file_bytes\": %llu, "
+               "\"compression_ratio\": %.3f, "
+               "\"rtt_samples\": %lu, "
+               "\"rtt_min_ms\": %.3f, \"rtt_avg_ms\": %.3f, \"rtt_p99_ms\": %.3f, "
+               "\"seconds\": %.6f, \"bytes_per_sec\": %.0f, \"packets_per_sec\": %.0f, "
+               "\"cpu_user_s\": %.6f, \"cpu_sys_s\": %.6f}\n",
+               st->transfers, st->failed, (unsigned long long) st->bytes,
+               (unsigned long long) st->blocks, st->retrans,
+               st->dups, st->dup_acks, st->stale_data, st->foreign, st->drops,
+               st->timeouts, st->packets, (unsigned long long) st->lz_bytes,
+               (unsigned long long) st->lz_file_bytes, ratio,
+               st->rtt_count, min / 1000, avg / 1000,
+               p99 / 1000, secs, rate, pps,
+               st->cpu_user / 1e6, st->cpu_sys / 1e6);
+    } else if (format == TFTP_STATS_TEXT) {
+        printf("%llu bytes in %llu blocks in %.3f s (%.2f MB/s, %.0f packets/s)\n"
+               "%lu retransmissions, %lu duplicates, %lu timeouts\n"
+               "%lu duplicate acks ignored, %lu stale data blocks, "
+               "%lu datagrams from unknown TIDs, %lu dropped by the kernel\n"
+               "RTT min/avg/p99 %.3f/%.3f/%.3f ms over %lu samples\n"
+               "CPU %.3f s user, %.3f s system\n",
+               (unsigned long long) st->bytes, (unsigned long long) st->blocks,
+               secs, rate / 1e6, pps,
+               st->retrans, st->dups, st->timeouts,
+               st->dup_acks, st->stale_data, st->foreign, st->drops,
+               min / 1000, avg / 1000, p99 / 1000, st->rtt_count,
+               st->cpu_user / 1e6, st->cpu_sys / 1e6);
+        if (st->lz_bytes)
+            printf("Compressed: %llu file bytes in %llu (ratio %.2f)\n",
+                   (unsigned long long) st->lz_file_bytes,
+                   (unsigned long long) st->lz_bytes, ratio);
+    }
+}
+
+/*
+  The server answered, i.e. the transfer made progress. Update the
+  RTT estimate if the answer was to a timed packet and recompute the
+  timeout as in RFC 6298. Unlike RFC 6298 the backoff ends with any
+  progress, not only with the next sample: under loss the answer
+  after a timeout is rarely one that can be timed, and the backoff
+  would build up over the transfer.
+ */
+static void tftp_timer_progress(struct tftp_conn *tc)
+{
+    u_int64_t now = tftp_now();
+
+    tc->retries = 0;
+
+    if (tc->rtt_sent) {
+        u_int64_t rtt = now - tc->rtt_sent;
+
+        tftp_stats_rtt(&tc->stats, rtt);
+
+        if (!tc->srtt) {
+            tc->srtt = rtt;
+            tc->rttvar = rtt / 2;
+        } else {
+            u_int64_t delta = rtt > tc->srtt ? rtt - tc->srtt : tc->srtt - rtt;
+
+            tc->rttvar = (3 * tc->rttvar + delta) / 4;
+            tc->srtt = (7 * tc->srtt + rtt) / 8;
+        }
+
+        tc->rtt_sent = 0;
+    }
+
+    if (tc->srtt) {
+        tc->rto = tc->srtt + 4 * tc->rttvar;
+
+        if (tc->rto < TFTP_RTO_MIN * 1000)
+            tc->rto = TFTP_RTO_MIN * 1000;
+        if (tc->rto > TFTP_RTO_MAX * 1000)
+            tc->rto = TFTP_RTO_MAX * 1000;
+    }
+
+    tc->deadline = now + tc->rto;
+}
+
+/*
+  The retransmission timer expired. Back off exponentially. Returns
+  negative once we have tried TFTP_MAX_RETRIES times.
+ */
+static int tftp_timer_expired(struct tftp_conn *tc)
+{
+    if (++tc->retries > TFTP_MAX_RETRIES)
+        return -1;
+
+    tc->rto *= 2;
+
+    if (tc->rto > TFTP_RTO_MAX * 1000)
+        tc->rto = TFTP_RTO_MAX * 1000;
+
+    return 0;
+}
+
+#ifdef TFTP_TRACE
+/* Trace a message that was sent (type 0) or received (type 1) */
+static void print_message(struct tftp_msg* msg, int len, int type)
+{
+    const char *dir = type == 0 ? "sent" : "received";
 
-    printf("Message content: ");
     switch (ntohs(msg->opcode)) {
     case OPCODE_DATA:
-        printf("data\n");
-        printf("Block number: %hu\n", ntohs(((struct tftp_data*) msg)->blocknr));
+        log_trace("%s data, block %hu, %d bytes\n", dir,
+                  ntohs(((struct tftp_data*) msg)->blocknr), len);
         break;
     case OPCODE_RRQ:
-        printf("read req\n");
+        log_trace("%s read req\n", dir);
         break;
     case OPCODE_WRQ:
-        printf("write req\n");
+        log_trace("%s write req\n", dir);
         break;
     case OPCODE_ACK:
-        printf("ack\n");
-        printf("Block number: %hu\n", ntohs(((struct tftp_ack*) msg)->blocknr));
+        log_trace("%s ack, block %hu\n", dir,
+                  ntohs(((struct tftp_ack*) msg)->blocknr));
+        break;
+    case OPCODE_OACK:
+        log_trace("%s option ack\n", dir);
         break;
     case OPCODE_ERR:
-        printf("error\n");
-        printf("Error code: %hu\n", ntohs(((struct tftp_err*) msg)->errcode));
-        printf("Error message: %s\n", ((struct tftp_err*) msg)->errmsg);
+        /* The message need not be terminated */
+        log_trace("%s error %hu: %.*s\n", dir,
+                  ntohs(((struct tftp_err*) msg)->errcode),
+                  len - (int) TFTP_ERR_HDR_LEN, ((struct tftp_err*) msg)->errmsg);
         break;
     default:
-        printf("\nunknown\n");
-        printf("Opcode: %hu\n", ntohs(msg->opcode));
+        log_trace("%s unknown, opcode %hu\n", dir, ntohs(msg->opcode));
     }
-    printf("==========\n\n");
+}
+#else
+#define print_message(msg, len, type) do { } while (0)
+#endif
+
+/* Record a message in the event ring, if we keep one */
+static inline void tftp_event(struct tftp_conn *tc, int dir, void *msg, int len)
+{
+    if (tc->ring.events)
+        log_ring_add(&tc->ring, dir, tftp_now(), msg, len);
+}
+
+static void tftp_mcast_free(struct tftp_mcast *mc);
+#ifdef OS_LINUX
+static void tftp_uring_free(struct tftp_conn *tc);
+static int tftp_uring_send_block(struct tftp_conn *tc, int slot, int len);
+#endif
 
-    return;
+/*
+  Give back the preallocated space that runs of zeros were left out
+  of, so they become holes rather than stay allocated. Only once the
+  file has its size, as space past the end can't be punched. What was
+  never written shows as a hole to SEEK_HOLE.
+ */
+static void tftp_punch_holes(struct tftp_conn *tc)
+{
+#if defined(OS_LINUX) && defined(FALLOC_FL_PUNCH_HOLE) && defined(SEEK_HOLE)
+    int fd = fileno(tc->fp);
+    off_t hole, data;
+
+    for (data = 0; data < tc->write_end; ) {
+        if ((hole = lseek(fd, data, SEEK_HOLE)) < 0 || hole >= tc->write_end)
+            break;
+        if ((data = lseek(fd, hole, SEEK_DATA)) < 0)
+            data = tc->write_end;
 
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole, data - hole) < 0) {
+            log_debug("fallocate: %s\n", strerror(errno));
+            break;
+        }
+    }
+#else
+    (void) tc;
+#endif
 }
 
+/*
+  Close the file, once its I/O thread has written everything queued.
+  Returns negative if a write failed.
+ */
+static int tftp_close_file(struct tftp_conn *tc)
+{
+    int ret = 0;
+
+    if (tc->ioq) {
+        log_debug("I/O thread: transfer waited %lu times\n", tc->ioq->waits);
+        ret = ioq_free(tc->ioq);
+        free(tc->ioq);
+        tc->ioq = NULL;
+    }
+
+    /* Zeros at the end were never written and preallocated space
+     * may reach past it */
+    if (tc->fp && tc->trunc &&
+        (fflush(tc->fp) != 0 || ftruncate(fileno(tc->fp), tc->write_end) < 0))
+        ret = -1;
+    else if (tc->fp && tc->prealloc)
+        tftp_punch_holes(tc);
+    tc->trunc = 0;
+    tc->prealloc = 0;
+    tc->hole = 0;
+
+    if (tc->fp && fclose(tc->fp) != 0)
+        ret = -1;
+    tc->fp = NULL;
+
+    return ret;
+}
 
 /* Close the connection handle, i.e., delete our local state. */
 void tftp_close(struct tftp_conn *tc)
@@ -97,612 +634,4066 @@ void tftp_close(struct tftp_conn *tc)
     if (!tc)
         return;
 
-    fclose(tc->fp);
+    tftp_close_file(tc);
     close(tc->sock);
+    free(tc->msgbuf);
+    free(tc->recbuf);
+    free(tc->xlatbuf);
+    free(tc->lz_frame);
+    free(tc->lz_raw);
+    free(tc->window);
+    free(tc->window_len);
+    free(tc->window_data);
+    free(tc->window_time);
+    if (tc->file)
+        cache_put(tc->cache, tc->file);
+    if (tc->mc_sock >= 0)
+        close(tc->mc_sock);
+    free(tc->mc_have);
+    if (tc->mc)
+        tftp_mcast_free(tc->mc);
+    log_ring_free(&tc->ring);
+    /* The server's copy of the requested path */
+    if (tc->server)
+        free(tc->fname);
+#ifdef OS_LINUX
+    free(tc->txq);
+    free(tc->txsegs);
+    free(tc->txiov);
+    free(tc->txctl);
+    free(tc->rxq);
+    free(tc->rxiov);
+    free(tc->rxaddr);
+    free(tc->rxctl);
+    tftp_uring_free(tc);
+#endif
     free(tc);
 }
 
-/* Connect to a remote TFTP server. */
-struct tftp_conn *tftp_connect(int type, char *fname, char *mode,
-                               const char *hostname) {
-    struct addrinfo hints;
-    struct addrinfo * res = NULL;
-    struct tftp_conn *tc;
+/*
+  Hand the file over to a thread of its own, the first time it is
+  read or written, so the transfer only waits for the disk when the
+  queue runs empty or full. Returns negative if the I/O is to be done
+  in line instead.
+ */
+static int tftp_ioq_start(struct tftp_conn *tc)
+{
+    if (!tc->ioq_depth || !tc->fp)
+        return -1;
 
-    if (!fname || !mode || !hostname)
-        return NULL;
+    /* Blocks from a multicast group are written wherever they
+     * belong, not one after the other */
+    if (tc->mc_sock >= 0 || !(tc->ioq = malloc(sizeof(struct ioq))) ||
+        ioq_init(tc->ioq, tc->fp, tc->type == TFTP_TYPE_GET, tc->ioq_depth,
+                 tc->blksize) < 0) {
+        free(tc->ioq);
+        tc->ioq = NULL;
+        tc->ioq_depth = 0;
+        return -1;
+    }
 
-    tc = malloc(sizeof(struct tftp_conn));
+    return 0;
+}
 
-    if (!tc)
-        return NULL;
+/* Read the next block of an octet transfer */
+static int tftp_read_octet(struct tftp_conn *tc, char *buf, int len)
+{
+    if (tc->file) {
+        size_t left = tc->file->size - tc->file_pos;
 
-    /* Create a socket.
-     * Check return value. */
+        if ((size_t) len > left)
+            len = left;
+        if (len > 0)
+            memcpy(buf, tc->file->data + tc->file_pos, len);
+        tc->file_pos += len;
 
-    /* ... */
+        return len;
+    }
 
-    if ((tc->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        fprintf(stderr, "Could not create socket!\n");
-        return NULL;
+    if (tc->io.read)
+        len = tc->io.read(tc->io.arg, buf, len);
+    else if (tc->ioq || tftp_ioq_start(tc) == 0)
+        len = ioq_read(tc->ioq, buf, len);
+    else {
+        len = fread(buf, 1, len, tc->fp);
+        if (ferror(tc->fp))
+            return -1;
     }
 
+    if (len > 0 && tc->digest.alg != DIGEST_NONE)
+        digest_update(&tc->digest, buf, len);
 
-    if (type == TFTP_TYPE_PUT)
-        tc->fp = fopen(fname, "rb");
-    else if (type == TFTP_TYPE_GET)
-        tc->fp = fopen(fname, "wb");
-    else {
-        fprintf(stderr, "Invalid TFTP mode, must be put or get\n");
-        return NULL;
+    return len;
+}
+
+/* Read the next block of a netascii transfer. The file is read in
+ * large chunks and translated into the block. */
+static int tftp_read_netascii(struct tftp_conn *tc, char *buf, int len)
+{
+    int out = 0;
+
+    while (out < len) {
+        size_t n;
+
+        if (tc->xlat_pos == tc->xlat_len && !tc->xlat_eof) {
+            tc->xlat_len = tftp_read_octet(tc, tc->xlatbuf, TFTP_XLAT_SIZE);
+            tc->xlat_pos = 0;
+
+            if (tc->xlat_len < 0)
+                return -1;
+            if (tc->xlat_len < TFTP_XLAT_SIZE)
+                tc->xlat_eof = 1;
+        }
+
+        /* End of file, unless the translation of the last byte
+         * still has to be finished */
+        if (tc->xlat_pos == tc->xlat_len && tc->na.pending < 0)
+            break;
+
+        n = tc->xlat_len - tc->xlat_pos;
+        out += netascii_encode(&tc->na, buf + out, len - out,
+                               tc->xlatbuf + tc->xlat_pos, &n);
+        tc->xlat_pos += n;
     }
 
-    if (tc->fp == NULL) {
-        fprintf(stderr, "File I/O error!\n");
-        close(tc->sock);
-        free(tc);
-        return NULL;
+    return out;
+}
+
+/* Whether 'len' bytes at 'buf' are all zero, 64 at a time with SSE2
+ * where available */
+static int tftp_all_zero(const char *buf, int len)
+{
+    int i = 0;
+
+#ifdef __SSE2__
+    for (; i + 64 <= len; i += 64) {
+        const __m128i *p = (const __m128i *) (buf + i);
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return 0;
     }
+#endif
 
-    memset(&hints,0,sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-    char port_str[5];
-    sprintf(port_str, "%d", TFTP_PORT);
+    for (; i < len; i++) {
+        if (buf[i])
+            return 0;
+    }
 
-    if (getaddrinfo(hostname, port_str, &hints, &res)) {
-        fprintf(stderr, "Couldn't get host address info!\n");
-        close(tc->sock);
-        fclose(tc->fp);
-        free(tc);
-        return NULL;
+    return 1;
+}
+
+/* Write to the file, through the I/O thread if there is one */
+static int tftp_write_file(struct tftp_conn *tc, const char *buf, int len)
+{
+    if (tc->ioq || tftp_ioq_start(tc) == 0)
+        return ioq_write(tc->ioq, buf, len);
+
+    return fwrite(buf, 1, len, tc->fp) == (size_t) len ? 0 : -1;
+}
+
+/* Pass over the zeros got since the last write, leaving a hole if
+ * there are enough of them. Returns negative on error. */
+static int tftp_skip_hole(struct tftp_conn *tc)
+{
+    static const char zeros[TFTP_HOLE_MIN];
+    off_t len = tc->hole;
+
+    tc->hole = 0;
+
+    if (len < TFTP_HOLE_MIN)
+        return tftp_write_file(tc, zeros, len);
+
+
+    if (tc->ioq || tftp_ioq_start(tc) == 0)
+        return ioq_skip(tc->ioq, len);
+
+    return fseeko(tc->fp, len, SEEK_CUR);
+}
+
+/* Write data that is not zeros to a sparse file, after passing over
+ * the zeros that came before it */
+static int tftp_write_sparse(struct tftp_conn *tc, const char *buf, int len)
+{
+    if (tc->hole && tftp_skip_hole(tc) < 0)
+        return -1;
+
+    tc->write_pos += len;
+    if (tc->write_pos > tc->write_end)
+        tc->write_end = tc->write_pos;
+
+    return tftp_write_file(tc, buf, len);
+}
+
+/*
+  Write a block of an octet transfer. In a regular file, runs of
+  zeros are not written but seeked over once something else comes,
+  so they cost no I/O and leave a hole. They are looked for
+  TFTP_HOLE_MIN bytes at a time, so a large block such as a frame of
+  a compressed transfer leaves the same holes as small ones.
+  tftp_close_file() sets the size in case zeros ended the file.
+ */
+static int tftp_write_octet(struct tftp_conn *tc, const char *buf, int len)
+{
+    int start = 0; /* Of the data not written yet */
+    int i, n;
+
+    /* Blocks from a group come in any order, the file is hashed
+     * once it is complete instead */
+    if (tc->digest.alg != DIGEST_NONE && tc->mc_sock < 0)
+        digest_update(&tc->digest, buf, len);
+
+    if (tc->io.write)
+        return tc->io.write(tc->io.arg, buf, len) < 0 ? -1 : 0;
+
+    if (!tc->sparse)
+        return tftp_write_file(tc, buf, len);
+
+    for (i = 0; i < len; i += n) {
+        n = len - i < TFTP_HOLE_MIN ? len - i : TFTP_HOLE_MIN;
+
+        if (!tftp_all_zero(buf + i, n))
+            continue;
+
+        if (i > start && tftp_write_sparse(tc, buf + start, i - start) < 0)
+            return -1;
+
+        tc->hole += n;
+        tc->write_pos += n;
+        if (tc->write_pos > tc->write_end)
+            tc->write_end = tc->write_pos;
+        tc->trunc = 1;
+        start = i + n;
     }
 
-    /* get address from host name.
-     * If error, gracefully clean up.*/
+    return len > start ? tftp_write_sparse(tc, buf + start, len - start) : 0;
+}
 
-    /* ... */
+/* Write a block of a netascii transfer, translated back to host
+ * newlines */
+static int tftp_write_netascii(struct tftp_conn *tc, const char *buf, int len)
+{
+    return tftp_write_octet(tc, tc->xlatbuf,
+                            netascii_decode(&tc->na, tc->xlatbuf, buf, len));
+}
 
-    /* Assign address to the connection handle.
-     * You can assume that the first address in the hostent
-     * struct is the correct one */
+/*
+  Compress the next frame of the file into lz_frame. Returns its
+  length, 0 at the end of the file or negative on error.
+ */
+static int tftp_lz_fill(struct tftp_conn *tc)
+{
+    int len = tftp_read_octet(tc, tc->lz_raw, TFTP_XLAT_SIZE);
+    u_int32_t hdr;
+    int clen;
 
-    memcpy(&tc->peer_addr, res->ai_addr, res->ai_addrlen);
+    tc->lz_pos = tc->lz_len = 0;
 
-    tc->addrlen = sizeof(struct sockaddr_in);
+    if (len < 0)
+        return -1;
+    if (len < TFTP_XLAT_SIZE)
+        tc->lz_eof = 1;
+    if (len == 0)
+        return 0;
 
-    tc->type = type;
-    tc->mode = mode;
-    tc->fname = fname;
-    tc->blocknr = 0;
+    clen = lz_compress(tc->lz_raw, len, tc->lz_frame + TFTP_LZ_HDR_LEN, len - 1);
 
-    memset(tc->msgbuf, 0, MSGBUF_SIZE);
+    if (clen > 0) {
+        hdr = clen;
+    } else {
+        memcpy(tc->lz_frame + TFTP_LZ_HDR_LEN, tc->lz_raw, len);
+        hdr = len | TFTP_LZ_STORED;
+        clen = len;
+    }
 
+    hdr = htonl(hdr);
+    memcpy(tc->lz_frame, &hdr, TFTP_LZ_HDR_LEN);
+    tc->lz_len = TFTP_LZ_HDR_LEN + clen;
+    tc->stats.lz_file_bytes += len;
 
-    printf("Connection opened. \n");
+    return tc->lz_len;
+}
 
-    return tc;
+/* Read the next block of a compressed transfer, the frames one after
+ * the other regardless of where blocks end */
+static int tftp_read_lz(struct tftp_conn *tc, char *buf, int len)
+{
+    int out = 0;
+
+    while (out < len) {
+        int n;
+
+        if (tc->lz_pos == tc->lz_len) {
+            if (tc->lz_eof || (n = tftp_lz_fill(tc)) == 0)
+                break;
+            if (n < 0)
+                return -1;
+        }
+
+        n = tc->lz_len - tc->lz_pos;
+        if (n > len - out)
+            n = len - out;
+
+        memcpy(buf + out, tc->lz_frame + tc->lz_pos, n);
+        tc->lz_pos += n;
+        out += n;
+    }
+
+    return out;
 }
 
 /*
-  Send a read request to the server.
-  1. Format message.
-  2. Send the request using the connection handle.
-  3. Return the number of bytes sent, or negative on error.
+  Write a block of a compressed transfer. Frames are gathered in
+  lz_frame and written uncompressed once whole. Returns negative on
+  error or a frame that does not decompress.
  */
-int tftp_send_rrq(struct tftp_conn *tc)
+static int tftp_write_lz(struct tftp_conn *tc, const char *buf, int len)
+{
+    while (len > 0) {
+        int n = (tc->lz_len ? tc->lz_len : TFTP_LZ_HDR_LEN) - tc->lz_pos;
+        u_int32_t hdr;
+
+        if (n > len)
+            n = len;
+
+        memcpy(tc->lz_frame + tc->lz_pos, buf, n);
+        tc->lz_pos += n;
+        buf += n;
+        len -= n;
+
+        if (!tc->lz_len) {
+            if (tc->lz_pos < TFTP_LZ_HDR_LEN)
+                continue;
+
+            memcpy(&hdr, tc->lz_frame, TFTP_LZ_HDR_LEN);
+            hdr = ntohl(hdr) & ~TFTP_LZ_STORED;
+            if (hdr == 0 || hdr > TFTP_XLAT_SIZE)
+                return -1;
+            tc->lz_len = TFTP_LZ_HDR_LEN + hdr;
+            continue;
+        }
+
+        if (tc->lz_pos < tc->lz_len)
+            continue;
+
+        memcpy(&hdr, tc->lz_frame, TFTP_LZ_HDR_LEN);
+        if (ntohl(hdr) & TFTP_LZ_STORED) {
+            n = tc->lz_len - TFTP_LZ_HDR_LEN;
+            if (tftp_write_octet(tc, tc->lz_frame + TFTP_LZ_HDR_LEN, n) < 0)
+                return -1;
+        } else if ((n = lz_decompress(tc->lz_frame + TFTP_LZ_HDR_LEN,
+                                      tc->lz_len - TFTP_LZ_HDR_LEN,
+                                      tc->lz_raw, TFTP_XLAT_SIZE)) < 0 ||
+                   tftp_write_octet(tc, tc->lz_raw, n) < 0) {
+            return -1;
+        }
+
+        tc->stats.lz_file_bytes += n;
+        tc->lz_pos = tc->lz_len = 0;
+    }
+
+    return 0;
+}
+
+/*
+  Compress the data blocks of an octet transfer from now on, as
+  agreed with OPT_COMPRESS. Returns negative if out of memory.
+ */
+static int tftp_lz_start(struct tftp_conn *tc)
 {
-    /* struct tftp_rrq *rrq; */
+    tc->lz_frame = malloc(TFTP_LZ_HDR_LEN + TFTP_XLAT_SIZE);
+    tc->lz_raw = malloc(TFTP_XLAT_SIZE);
+
+    if (!tc->lz_frame || !tc->lz_raw)
+        return -1;
+
+    tc->read_block = tftp_read_lz;
+    tc->write_block = tftp_write_lz;
 
-    int reqlen = TFTP_RRQ_LEN(tc->fname, tc->mode);
+    return 0;
+}
+
+void tftp_params_init(struct tftp_params *params)
+{
+    memset(params, 0, sizeof(*params));
+    params->blksize = TFTP_BLKSIZE_DEFAULT;
+    params->windowsize = TFTP_WINDOWSIZE_DEFAULT;
+    params->batch = TFTP_BATCH_DEFAULT;
+    params->ioq = TFTP_IOQ_DEFAULT;
+    params->port = TFTP_PORT;
+    params->sparse = 1;
+}
+
+/*
+  Reserve the disk space for the rest of a file got whose size the
+  sender told us, so it is laid out in one piece rather than block by
+  block as they come. The file size is left alone until
+  tftp_close_file(), which punches out the runs of zeros again.
+ */
+static void tftp_prealloc(struct tftp_conn *tc)
+{
+#if defined(OS_LINUX) && defined(FALLOC_FL_KEEP_SIZE)
+    if (!tc->sparse || tc->tsize <= tc->write_pos)
+        return;
+
+    if (fallocate(fileno(tc->fp), FALLOC_FL_KEEP_SIZE, tc->write_pos,
+                  tc->tsize - tc->write_pos) == 0) {
+        tc->prealloc = 1;
+        tc->trunc = 1;
+    } else
+        log_debug("fallocate: %s\n", strerror(errno));
+#else
+    (void) tc;
+#endif
+}
+
+/*
+  Hash what the file holds on disk, read back by name: what a resumed
+  get starts after, or what a multicast group wrote in any order.
+  Returns negative on error.
+ */
+static int tftp_digest_file(struct tftp_conn *tc)
+{
+    FILE *fp = fopen(tc->fname, "rb");
+    char *buf = malloc(TFTP_XLAT_SIZE);
+    size_t n;
+    int ret = -1;
+
+    if (fp && buf) {
+        while ((n = fread(buf, 1, TFTP_XLAT_SIZE, fp)) > 0)
+            digest_update(&tc->digest, buf, n);
+        ret = ferror(fp) ? -1 : 0;
+    }
+
+    if (fp)
+        fclose(fp);
+    free(buf);
+
+    return ret;
+}
+
+/*
+  Ready the file we resume a get into for the first block: cut it
+  where the server starts, at the offset it granted or at the very
+  beginning if it did not. What is kept is hashed first. Returns
+  negative on error.
+ */
+static int tftp_resume(struct tftp_conn *tc)
+{
+    if (tc->offset)
+        log_info("Resuming %s at byte %lld\n", tc->fname, (long long) tc->offset);
+    else if (tc->offset_req)
+        log_info("Server can't resume %s, getting all of it\n", tc->fname);
+
+    if (fflush(tc->fp) != 0 || ftruncate(fileno(tc->fp), tc->offset) < 0 ||
+        (tc->offset && tc->digest.alg != DIGEST_NONE && tftp_digest_file(tc) < 0) ||
+        fseeko(tc->fp, tc->offset, SEEK_SET) < 0)
+        return -1;
+
+    tc->write_pos = tc->write_end = tc->offset;
+    tftp_prealloc(tc);
+
+    return 0;
+}
+
+/*
+  Set up a connection handle for a transfer of the already opened
+  file 'fp', which the handle owns from now on. 'fp' is NULL if the
+  caller sets up a cached file instead. Buffers are sized for
+  params->blksize and params->windowsize. The socket is left unbound,
+  the first send binds it to an ephemeral port, our TID.
+ */
+static struct tftp_conn *tftp_conn_new(int type, char *fname, char *mode, FILE *fp,
+                                       const struct tftp_params *params)
+{
+    struct tftp_conn *tc;
+    int blksize = params->blksize;
+    int windowsize = params->windowsize;
+    int batch = params->batch;
+    int segs = 1;
+    int i;
+
+    if (blksize < TFTP_BLKSIZE_MIN || blksize > TFTP_BLKSIZE_MAX) {
+        fprintf(stderr, "Block size must be between %d and %d\n",
+                TFTP_BLKSIZE_MIN, TFTP_BLKSIZE_MAX);
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+
+    if (windowsize < 1 || windowsize > TFTP_WINDOWSIZE_MAX) {
+        fprintf(stderr, "Window size must be between 1 and %d\n",
+                TFTP_WINDOWSIZE_MAX);
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+
+    if (batch < 1 || batch > TFTP_BATCH_MAX) {
+        fprintf(stderr, "Batch size must be between 1 and %d\n",
+                TFTP_BATCH_MAX);
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+
+    if (params->ioq < 0 || params->ioq > TFTP_IOQ_MAX) {
+        fprintf(stderr, "I/O queue depth must be between 0 and %d\n",
+                TFTP_IOQ_MAX);
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+
+    tc = calloc(1, sizeof(struct tftp_conn));
+
+    if (!tc) {
+        if (fp)
+            fclose(fp);
+        return NULL;
+    }
+
+    tc->fp = fp;
+    tc->ioq_depth = params->ioq;
+
+    /* Holes need a file that can seek */
+    if (type == TFTP_TYPE_GET && fp && params->sparse) {
+        struct stat st;
+
+        tc->sparse = fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode);
+    }
+
+    if ((tc->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        fprintf(stderr, "Could not create socket!\n");
+        if (fp)
+            fclose(fp);
+        free(tc);
+        return NULL;
+    }
+
+    tc->addrlen = sizeof(struct sockaddr_in);
+
+    tc->type = type;
+    tc->mode = mode;
+    tc->fname = fname;
+    tc->blocknr = 0;
+    tc->blocknr_acked = 0;
+    tc->blocknr_last = -1;
+    tc->ack_sent = -1;
+    tc->blksize = TFTP_BLOCK_SIZE;
+    tc->blksize_req = blksize;
+    tc->windowsize = 1;
+    tc->windowsize_req = windowsize;
+    tc->use_opts = 1;
+    tc->mc_sock = -1;
+    tc->rto = TFTP_TIMEOUT * 1000000;
+
+    /* Large enough for both a full data block and the request */
+    tc->msgbuf_size = MSGBUF_SIZE(blksize > TFTP_BLOCK_SIZE ? blksize : TFTP_BLOCK_SIZE);
+
+    tc->rxbuf_size = tc->msgbuf_size;
+
+    /* Pick the translation for the mode once and for all */
+    if (!strcasecmp(mode, MODE_NETASCII)) {
+        tc->read_block = tftp_read_netascii;
+        tc->write_block = tftp_write_netascii;
+        netascii_init(&tc->na);
+        tc->xlatbuf = malloc(TFTP_XLAT_SIZE);
+    } else {
+        tc->read_block = tftp_read_octet;
+        tc->write_block = tftp_write_octet;
+
+        /* In octet mode whole blocks are read straight into the
+         * window slot they are sent from, stdio buffering would only
+         * add a copy */
+        if (type == TFTP_TYPE_PUT && fp)
+            setvbuf(tc->fp, NULL, _IONBF, 0);
+
+        /* Blocks from a group are written wherever they belong,
+         * which netascii can't do */
+        tc->mc_req = params->multicast && type == TFTP_TYPE_GET;
+
+        /* Compressed blocks can't be written by offset either */
+        tc->lz_req = params->compress && !tc->mc_req;
+    }
+
+#ifdef OS_LINUX
+    if (params->gso) {
+        int off = 0, on = 1;
+
+        /* Find out whether the kernel knows about UDP GSO and GRO at
+         * all. A zero segment size leaves sends as they are. */
+        tc->gso = setsockopt(tc->sock, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+        tc->gro = setsockopt(tc->sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+
+        if (!tc->gso || !tc->gro)
+            fprintf(stderr, "UDP %s not supported, not using it\n",
+                    tc->gso ? "GRO" : tc->gro ? "GSO" : "GSO/GRO");
+
+        if (tc->gso)
+            segs = TFTP_GSO_MAX_SEGS;
+        if (tc->gro)
+            tc->rxbuf_size = TFTP_GRO_BUF_SIZE;
+    }
+
+#ifdef SO_RXQ_OVFL
+    {
+        int on = 1;
+
+        /* Have the kernel tell us how many datagrams it dropped */
+        setsockopt(tc->sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+    }
+#endif
+#endif
+
+    tc->msgbuf = calloc(1, tc->msgbuf_size);
+    tc->recbuf = malloc(batch * tc->rxbuf_size);
+    tc->batch = batch;
+
+    /* Only the sender has to keep blocks around for resending */
+    if (type == TFTP_TYPE_PUT) {
+        tc->window = malloc(windowsize * tc->msgbuf_size);
+        tc->window_len = calloc(windowsize, sizeof(int));
+        tc->window_time = calloc(windowsize, sizeof(u_int64_t));
+    }
+
+    if (params->events > 0 && log_ring_init(&tc->ring, params->events) < 0)
+        tc->ring.events = NULL;
+
+    if (!tc->msgbuf || !tc->recbuf ||
+        (type == TFTP_TYPE_PUT && (!tc->window || !tc->window_len || !tc->window_time)) ||
+        (tc->read_block == tftp_read_netascii && !tc->xlatbuf) ||
+        (params->events > 0 && !tc->ring.events)) {
+
+        fprintf(stderr, "Out of memory!\n");
+        tftp_close(tc);
+        return NULL;
+    }
+
+#ifdef OS_LINUX
+    /* Send and receive vectors. The receive side is set up once,
+     * one recbuf slot per datagram. */
+    tc->txq = calloc(batch, sizeof(struct mmsghdr));
+    tc->txsegs = calloc(batch, sizeof(int));
+    tc->txiov = calloc(batch * segs * 2, sizeof(struct iovec));
+    tc->txctl = calloc(batch, CMSG_SPACE(sizeof(u_int16_t)));
+    tc->rxq = calloc(batch, sizeof(struct mmsghdr));
+    tc->rxiov = calloc(batch, sizeof(struct iovec));
+    tc->rxaddr = calloc(batch, sizeof(struct sockaddr_in));
+    tc->rxctl = calloc(batch, TFTP_RXCTL_SIZE);
+
+    if (!tc->txq || !tc->txsegs || !tc->txiov || !tc->txctl || !tc->rxq || !tc->rxiov ||
+        !tc->rxaddr || !tc->rxctl) {
+        fprintf(stderr, "Out of memory!\n");
+        tftp_close(tc);
+        return NULL;
+    }
+
+    for (i = 0; i < batch; i++) {
+        tc->rxiov[i].iov_base = tc->recbuf + i * tc->rxbuf_size;
+        tc->rxiov[i].iov_len = tc->rxbuf_size;
+        tc->rxq[i].msg_hdr.msg_iov = &tc->rxiov[i];
+        tc->rxq[i].msg_hdr.msg_iovlen = 1;
+        tc->rxq[i].msg_hdr.msg_name = &tc->rxaddr[i];
+
+        /* Room for a run of up to 'segs' data blocks per datagram,
+         * header and data of each one apart if need be */
+        tc->txq[i].msg_hdr.msg_iov = &tc->txiov[i * segs * 2];
+        tc->txq[i].msg_hdr.msg_iovlen = 1;
+        tc->txq[i].msg_hdr.msg_name = &tc->peer_addr;
+    }
+#else
+    (void) i;
+#endif
+
+    return tc;
+}
+
+/*
+  Hash the data of a transfer of ours as it is read or written, with
+  'alg', a TFTP_DIGEST_* of libtftp.h, which are the DIGEST_* of
+  digest.h. Returns negative if there is no such digest.
+ */
+static int tftp_digest_init(struct tftp_conn *tc, int alg)
+{
+    if (!digest_len(alg)) {
+        fprintf(stderr, "Unknown digest %d\n", alg);
+        return -1;
+    }
+
+    digest_init(&tc->digest, alg);
+
+    return 0;
+}
+
+/*
+  Look up the server the transfer is with. Returns negative if it
+  can't be found.
+ */
+static int tftp_resolve(struct tftp_conn *tc, const char *hostname, int port)
+{
+    struct addrinfo hints;
+    struct addrinfo * res = NULL;
+    char port_str[6];
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    sprintf(port_str, "%d", port);
+
+    if (getaddrinfo(hostname, port_str, &hints, &res)) {
+        fprintf(stderr, "Couldn't get host address info!\n");
+        return -1;
+    }
+
+    /* Assign address to the connection handle.
+     * You can assume that the first address in the hostent
+     * struct is the correct one */
+
+    memcpy(&tc->peer_addr, res->ai_addr, res->ai_addrlen);
+    memcpy(&tc->server_addr, &tc->peer_addr, sizeof(tc->server_addr));
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/* Connect to a remote TFTP server. A blksize other than TFTP_BLOCK_SIZE
+ * is asked for with the blksize option (RFC 2348) and a windowsize
+ * above 1 with the windowsize option (RFC 7440). */
+struct tftp_conn *tftp_connect(int type, char *fname, char *mode,
+                               const char *hostname,
+                               const struct tftp_params *params) {
+    struct tftp_conn *tc;
+    FILE *fp;
+
+    if (!fname || !mode || !hostname)
+        return NULL;
+
+    if (type == TFTP_TYPE_PUT)
+        fp = fopen(fname, "rb");
+    else if (type == TFTP_TYPE_GET && params->resume) {
+        /* Keep what we have, tftp_resume() cuts it once the server
+         * says where it starts */
+        if (!(fp = fopen(fname, "r+b")))
+            fp = fopen(fname, "wb");
+    } else if (type == TFTP_TYPE_GET)
+        fp = fopen(fname, "wb");
+    else {
+        fprintf(stderr, "Invalid TFTP mode, must be put or get\n");
+        return NULL;
+    }
+
+    if (fp == NULL) {
+        fprintf(stderr, "File I/O error!\n");
+        return NULL;
+    }
+
+    if (!(tc = tftp_conn_new(type, fname, mode, fp, params)))
+        return NULL;
+
+    /* Tell the server how much is coming, octet only as netascii
+     * changes the size */
+    if (type == TFTP_TYPE_PUT && tc->read_block == tftp_read_octet) {
+        struct stat st;
+
+        if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode))
+            tc->tsize = st.st_size;
+    }
+
+    if (type == TFTP_TYPE_GET && params->resume) {
+        struct stat st;
+
+        tc->resume = 1;
+
+        /* Ask for the rest of the file. Only octet files are the
+         * same size on both ends, and a multicast group sends the
+         * whole file. */
+        if (tc->write_block == tftp_write_octet && fstat(fileno(fp), &st) == 0 &&
+            st.st_size > 0) {
+            tc->offset_req = st.st_size;
+            tc->mc_req = 0;
+        }
+    }
+
+    if ((params->digest && tftp_digest_init(tc, params->digest) < 0) ||
+        tftp_resolve(tc, hostname, params->port) < 0) {
+        tftp_close(tc);
+        return NULL;
+    }
+
+    log_debug("Connection opened.\n");
+
+    return tc;
+}
+
+/*
+  Connect to a remote TFTP server for a transfer whose data comes
+  from or goes to the callbacks in 'io' instead of a local file.
+ */
+struct tftp_conn *tftp_connect_io(int type, char *fname, char *mode,
+                                  const char *hostname, const struct tftp_io *io,
+                                  const struct tftp_params *params)
+{
+    struct tftp_conn *tc;
+
+    if (!fname || !mode || !hostname || !io)
+        return NULL;
+
+    if (type != TFTP_TYPE_GET && type != TFTP_TYPE_PUT) {
+        fprintf(stderr, "Invalid TFTP mode, must be put or get\n");
+        return NULL;
+    }
+
+    if (type == TFTP_TYPE_GET ? !io->write : !io->read) {
+        fprintf(stderr, "No callback to %s the data\n",
+                type == TFTP_TYPE_GET ? "write" : "read");
+        return NULL;
+    }
+
+    if (!(tc = tftp_conn_new(type, fname, mode, NULL, params)))
+        return NULL;
+
+    tc->io = *io;
+
+    /* Blocks from a group are written by offset */
+    tc->mc_req = 0;
+
+    if ((params->digest && tftp_digest_init(tc, params->digest) < 0) ||
+        tftp_resolve(tc, hostname, params->port) < 0) {
+        tftp_close(tc);
+        return NULL;
+    }
+
+    log_debug("Connection opened.\n");
+
+    return tc;
+}
+
+static int tftp_mem_read(void *arg, char *buf, int len)
+{
+    struct tftp_mem *mem = arg;
+    size_t left = mem->len - mem->pos;
+
+    if ((size_t) len > left)
+        len = left;
+    if (len > 0)
+        memcpy(buf, mem->data + mem->pos, len);
+    mem->pos += len;
+
+    return len;
+}
+
+/* Append to the buffer, doubling it as it fills up */
+static int tftp_mem_write(void *arg, const char *buf, int len)
+{
+    struct tftp_mem *mem = arg;
+
+    if (mem->len + len > mem->size) {
+        size_t size = mem->size ? mem->size : 65536;
+        char *data;
+
+        while (size < mem->len + len)
+            size *= 2;
+
+        if (!(data = realloc(mem->data, size)))
+            return -1;
+
+        mem->data = data;
+        mem->size = size;
+    }
+
+    if (len > 0)
+        memcpy(mem->data + mem->len, buf, len);
+    mem->len += len;
+
+    return 0;
+}
+
+void tftp_mem_io(struct tftp_mem *mem, struct tftp_io *io)
+{
+    io->read = tftp_mem_read;
+    io->write = tftp_mem_write;
+    io->arg = mem;
+}
+
+void tftp_set_done(struct tftp_conn *tc, tftp_done_fn done, void *arg)
+{
+    tc->done = done;
+    tc->done_arg = arg;
+}
+
+int tftp_digest_parse(const char *name)
+{
+    return digest_parse_alg(name);
+}
+
+int tftp_expect_digest(struct tftp_conn *tc, const char *hex)
+{
+    unsigned char md[DIGEST_MAX_LEN];
+    int len = digest_unhex(hex, md);
+    int alg = tc->digest.alg;
+
+    /* Tell the digest by its length if none was asked for */
+    if (alg == DIGEST_NONE)
+        alg = len == (int) digest_len(DIGEST_CRC32C) ? DIGEST_CRC32C : DIGEST_SHA256;
+
+    if (len < 0 || len != (int) digest_len(alg)) {
+        fprintf(stderr, "%s is not a %s digest\n", hex,
+                tc->digest.alg == DIGEST_NONE ? "CRC32C or SHA-256" : digest_name(alg));
+        return -1;
+    }
+
+    if (tc->digest.alg == DIGEST_NONE)
+        digest_init(&tc->digest, alg);
+    digest_hex(md, len, tc->digest_expect);
+
+    return 0;
+}
+
+const char *tftp_get_digest(const struct tftp_conn *tc)
+{
+    return tc->digest_hex[0] ? tc->digest_hex : NULL;
+}
+
+/*
+  Write a single name/value option at 'p', or only measure it if 'p'
+  is NULL. Returns the length of the option.
+ */
+static int tftp_put_optstr(char *p, const char *name, const char *val)
+{
+    int namelen = strlen(name) + 1;
+    int vallen = strlen(val) + 1;
+
+    if (p) {
+        memcpy(p, name, namelen);
+        memcpy(p + namelen, val, vallen);
+    }
+
+    return namelen + vallen;
+}
+
+/* The same for an option with a number as its value */
+static int tftp_put_opt(char *p, const char *name, long long val)
+{
+    char valstr[24];
+
+    sprintf(valstr, "%lld", val);
+
+    return tftp_put_optstr(p, name, valstr);
+}
+
+/*
+  The value of the timeout option: our retransmission timeout rounded
+  up to seconds, limited to the 1-255 range of RFC 2349.
+ */
+static int tftp_opt_timeout(struct tftp_conn *tc)
+{
+    int secs = (tc->rto + 999999) / 1000000;
+
+    if (secs < 1)
+        secs = 1;
+    if (secs > 255)
+        secs = 255;
+
+    return secs;
+}
+
+/* Whether we ask with the tsize option: when putting a file of
+ * known size, or getting into a file we can preallocate */
+static int tftp_tsize_req(const struct tftp_conn *tc)
+{
+    return tc->type == TFTP_TYPE_PUT ? tc->tsize > 0 : tc->sparse;
+}
+
+/*
+  Write the option list after a request, or only measure it if 'p'
+  is NULL. Returns the length of the list, zero if no options are
+  to be sent.
+ */
+static int tftp_put_opts(struct tftp_conn *tc, char *p)
+{
+    int len = 0;
+
+    if (!tc->use_opts)
+        return 0;
+
+    if (tc->blksize_req != TFTP_BLOCK_SIZE)
+        len += tftp_put_opt(p ? p + len : NULL, OPT_BLKSIZE, tc->blksize_req);
+
+    if (tc->windowsize_req != 1)
+        len += tftp_put_opt(p ? p + len : NULL, OPT_WINDOWSIZE, tc->windowsize_req);
+
+    /* Tell the server to use our current timeout, in whole seconds
+     * as RFC 2349 wants it */
+    len += tftp_put_opt(p ? p + len : NULL, OPT_TIMEOUT, tftp_opt_timeout(tc));
+
+    /* The server says which group in the OACK */
+    if (tc->mc_req)
+        len += tftp_put_optstr(p ? p + len : NULL, OPT_MULTICAST, "");
+
+    if (tc->offset_req)
+        len += tftp_put_opt(p ? p + len : NULL, OPT_OFFSET, tc->offset_req);
+
+    if (tc->lz_req)
+        len += tftp_put_optstr(p ? p + len : NULL, OPT_COMPRESS, TFTP_LZ_NAME);
+
+    /* The size of what we put, or 0 to be told the size of what we
+     * get (RFC 2349) */
+    if (tftp_tsize_req(tc))
+        len += tftp_put_opt(p ? p + len : NULL, OPT_TSIZE, tc->type == TFTP_TYPE_PUT ? tc->tsize : 0);
+
+    return len;
+}
+
+#define tftp_opts_len(tc) tftp_put_opts(tc, NULL)
+
+/*
+  The address of ours that 'peer' is reached from, which is also the
+  interface multicast to or from it has to go through. Returns
+  negative if there is no route.
+ */
+static int tftp_local_addr(const struct sockaddr_in *peer, struct in_addr *addr)
+{
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int ret = -1;
+
+    /* Connecting a datagram socket only looks up the route */
+    if (sock >= 0 && connect(sock, (const struct sockaddr *) peer, sizeof(*peer)) == 0 &&
+        getsockname(sock, (struct sockaddr *) &local, &len) == 0) {
+        *addr = local.sin_addr;
+        ret = 0;
+    }
+
+    if (sock >= 0)
+        close(sock);
+
+    return ret;
+}
+
+/*
+  Apply the multicast option of an OACK, "addr,port,mc" (RFC 2090).
+  The first one has us join the group. Later ones only tell whether
+  we are the master client and may leave out the address and port.
+  Returns negative if the value is bad or the group can't be joined.
+ */
+static int tftp_mcast_join(struct tftp_conn *tc, const char *val)
+{
+    const char *port = strchr(val, ',');
+    const char *master = port ? strchr(port + 1, ',') : NULL;
+    struct sockaddr_in group;
+    struct ip_mreq mreq;
+    char addr[INET_ADDRSTRLEN];
+    int on = 1;
+
+    if (!master || (strcmp(master + 1, "0") && strcmp(master + 1, "1")))
+        return -1;
+
+    tc->mc_master = master[1] == '1';
+
+    if (tc->mc_sock >= 0)
+        return 0;
+
+    if (port - val >= (int) sizeof(addr))
+        return -1;
+
+    memcpy(addr, val, port - val);
+    addr[port - val] = '\0';
+
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(atoi(port + 1));
+
+    if (inet_pton(AF_INET, addr, &group.sin_addr) != 1 || !group.sin_port ||
+        !IN_MULTICAST(ntohl(group.sin_addr.s_addr)))
+        return -1;
+
+    mreq.imr_multiaddr = group.sin_addr;
+
+    /* Bound to the group, other clients of it on this host too */
+    if ((tc->mc_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        setsockopt(tc->mc_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(tc->mc_sock, (struct sockaddr *) &group, sizeof(group)) < 0 ||
+        tftp_local_addr(&tc->peer_addr, &mreq.imr_interface) < 0 ||
+        setsockopt(tc->mc_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        fprintf(stderr, "Could not join multicast group %s:%d\n", addr,
+                ntohs(group.sin_port));
+        if (tc->mc_sock >= 0)
+            close(tc->mc_sock);
+        tc->mc_sock = -1;
+        return -1;
+    }
+
+#ifdef SO_RXQ_OVFL
+    setsockopt(tc->mc_sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+
+    if (!(tc->mc_have = calloc(TFTP_MCAST_BLOCKS / 8 + 1, 1))) {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+
+    log_info("Joined multicast group %s:%d%s\n", addr, ntohs(group.sin_port),
+             tc->mc_master ? " as master client" : "");
+
+    return 0;
+}
+
+/*
+  Parse an OACK from the server and apply the options it accepted.
+  Returns 0 on success, or negative if the server acknowledged
+  something we did not ask for or a value we cannot use.
+ */
+static int tftp_parse_oack(struct tftp_conn *tc, struct tftp_oack *oack, int len)
+{
+    char *p = oack->opts;
+    char *end = (char *) oack + len;
+
+    while (p < end) {
+        char *name = p;
+        char *val = memchr(name, '\0', end - name);
+
+        if (!val || ++val >= end || !memchr(val, '\0', end - val))
+            return -1;
+
+        if (!strcasecmp(name, OPT_BLKSIZE)) {
+            int blksize = atoi(val);
+
+            if (!tc->use_opts || blksize < TFTP_BLKSIZE_MIN ||
+                blksize > tc->blksize_req)
+                return -1;
+
+            tc->blksize = blksize;
+        } else if (!strcasecmp(name, OPT_WINDOWSIZE)) {
+            int windowsize = atoi(val);
+
+            if (!tc->use_opts || windowsize < 1 ||
+                windowsize > tc->windowsize_req)
+                return -1;
+
+            tc->windowsize = windowsize;
+        } else if (!strcasecmp(name, OPT_TIMEOUT)) {
+            /* The server must echo the value we sent. It only
+             * affects the server, we keep our own estimate. */
+            int secs = atoi(val);
+
+            if (!tc->use_opts || secs < 1 || secs > 255)
+                return -1;
+        } else if (!strcasecmp(name, OPT_MULTICAST)) {
+            if (!tc->use_opts || !tc->mc_req || tftp_mcast_join(tc, val) < 0)
+                return -1;
+        } else if (!strcasecmp(name, OPT_OFFSET)) {
+            /* Where we asked to resume or nowhere */
+            if (!tc->use_opts || !tc->offset_req || strtoll(val, NULL, 10) != tc->offset_req)
+                return -1;
+
+            tc->offset = tc->offset_req;
+        } else if (!strcasecmp(name, OPT_TSIZE)) {
+            /* The server echoes the size we put, or says what it has */
+            long long tsize = strtoll(val, NULL, 10);
+
+            if (!tc->use_opts || !tftp_tsize_req(tc) || tsize < 0 ||
+                (tc->type == TFTP_TYPE_PUT && tsize != tc->tsize))
+                return -1;
+
+            tc->tsize = tsize;
+        } else if (!strcasecmp(name, OPT_COMPRESS)) {
+            if (!tc->use_opts || !tc->lz_req || strcasecmp(val, TFTP_LZ_NAME) ||
+                (!tc->lz_frame && tftp_lz_start(tc) < 0))
+                return -1;
+        } else {
+
+            /* RFC 2347: the server may only ack options we sent */
+            return -1;
+        }
+
+        p = val + strlen(val) + 1;
+    }
+
+    return 0;
+}
+
+/*
+  Refuse a request with an error sent from the listening socket, as
+  there is no session to send it from, or a datagram that is not
+  part of the transfer on 'sock'.
+ */
+static void tftp_reject(int sock, const struct sockaddr_in *peer, int errcode)
+{
+    char buf[TFTP_ERR_HDR_LEN + 64];
+    struct tftp_err *err = (struct tftp_err *) buf;
+    int len = TFTP_ERR_HDR_LEN + strlen(tftp_err_to_str(errcode)) + 1;
+
+    err->opcode = htons(OPCODE_ERR);
+    err->errcode = htons(errcode);
+    strcpy(err->errmsg, tftp_err_to_str(errcode));
+
+    sendto(sock, buf, len, 0, (struct sockaddr *) peer, sizeof(*peer));
+}
+
+/*
+  Set up a session for a request from 'peer' to the server listening
+  on 'sock', serving files below 'root'. An RRQ makes us the one
+  putting, a WRQ the one getting. Files are read from 'cache' unless
+  it is NULL or they don't fit. Options are granted up to the block
+  and window size in 'params' and the OACK is left in msgbuf for
+  tftp_start() to send. Returns NULL if the request was refused.
+ */
+static struct tftp_conn *tftp_accept(const char *root, int sock, char *req, int len,
+                                     struct sockaddr_in *peer, struct cache *cache,
+                                     const struct tftp_params *params)
+{
+    struct cache_file *file = NULL;
+    struct tftp_params sp = *params;
+    struct tftp_conn *tc;
+    int opcode = ntohs(((struct tftp_msg *) req)->opcode);
+    char *end = req + len;
+    char *fname = req + TFTP_RRQ_HDR_LEN;
+    char *mode, *p;
+    char path[4096];
+    int blksize = 0, windowsize = 0, timeout = 0; /* 0 if not asked for */
+    int multicast = 0;
+    int compress = 0;
+    off_t offset = 0; /* 0 if not asked for */
+    off_t tsize = -1; /* -1 if not asked for */
+    FILE *fp;
+
+    if (len < (int) TFTP_RRQ_HDR_LEN || (opcode != OPCODE_RRQ && opcode != OPCODE_WRQ)) {
+        tftp_reject(sock, peer, 4);
+        return NULL;
+    }
+
+    /* File name and mode must both be terminated */
+    if (!(mode = memchr(fname, '\0', end - fname)) || ++mode >= end ||
+        !memchr(mode, '\0', end - mode)) {
+        tftp_reject(sock, peer, 4);
+        return NULL;
+    }
+
+    for (p = mode + strlen(mode) + 1; p < end; ) {
+        char *name = p;
+        char *val = memchr(p, '\0', end - p);
+        int v;
+
+        if (!val || ++val >= end || !memchr(val, '\0', end - val))
+            break;
+
+        p = val + strlen(val) + 1;
+        v = atoi(val);
+
+        /* Options we don't know or can't use are left out */
+        if (!strcasecmp(name, OPT_BLKSIZE) && v >= TFTP_BLKSIZE_MIN)
+            blksize = v < params->blksize ? v : params->blksize;
+        else if (!strcasecmp(name, OPT_WINDOWSIZE) && v >= 1)
+            windowsize = v < params->windowsize ? v : params->windowsize;
+        else if (!strcasecmp(name, OPT_TIMEOUT) && v >= 1 && v <= 255)
+            timeout = v;
+        else if (!strcasecmp(name, OPT_MULTICAST))
+            multicast = 1;
+        else if (!strcasecmp(name, OPT_OFFSET) && strtoll(val, NULL, 10) > 0)
+            offset = strtoll(val, NULL, 10);
+        else if (!strcasecmp(name, OPT_COMPRESS) && !strcasecmp(val, TFTP_LZ_NAME))
+            compress = 1;
+        else if (!strcasecmp(name, OPT_TSIZE) && strtoll(val, NULL, 10) >= 0)
+            tsize = strtoll(val, NULL, 10);
+    }
+
+    if (!strcasecmp(mode, MODE_NETASCII))
+        mode = MODE_NETASCII;
+    else if (!strcasecmp(mode, MODE_OCTET))
+        mode = MODE_OCTET;
+    else {
+        tftp_reject(sock, peer, 4);
+        return NULL;
+    }
+
+    /* Stay inside the root */
+    if (strstr(fname, "..") ||
+        snprintf(path, sizeof(path), "%s/%s", root, fname) >= (int) sizeof(path)) {
+        tftp_reject(sock, peer, 2);
+        return NULL;
+    }
+
+    if (opcode == OPCODE_RRQ && cache && (file = cache_get(cache, path))) {
+        fp = NULL;
+    } else if (!(fp = fopen(path, opcode == OPCODE_RRQ ? "rb" : "wb"))) {
+        log_info("%s: %s\n", path, strerror(errno));
+        tftp_reject(sock, peer, opcode == OPCODE_RRQ ? 1 : 2);
+        return NULL;
+    }
+
+    /* Buffers for what was granted only */
+    sp.blksize = blksize ? blksize : TFTP_BLOCK_SIZE;
+    sp.windowsize = windowsize ? windowsize : 1;
+
+    /* Not a thread per session, files come from the cache */
+    sp.ioq = 0;
+
+    tc = tftp_conn_new(opcode == OPCODE_RRQ ? TFTP_TYPE_PUT : TFTP_TYPE_GET,
+                       strdup(path), mode, fp, &sp);
+
+    if (!tc) {
+        if (file)
+            cache_put(cache, file);
+        tftp_reject(sock, peer, 0);
+        return NULL;
+    }
+
+    tc->server = 1;
+    tc->tid_locked = 1;
+    tc->cache = cache;
+    tc->file = file;
+
+    /* Whether it becomes a multicast transfer is up to
+     * tftp_mcast_attach() */
+    tc->mc_req = multicast && opcode == OPCODE_RRQ && tc->read_block == tftp_read_octet &&
+        params->mcast_group.sin_port;
+
+    /* Resume a get where the client's copy ends, if that is inside
+     * the file. Octet only, and then not for a multicast group. */
+    if (offset && (opcode != OPCODE_RRQ || tc->read_block != tftp_read_octet))
+        offset = 0;
+
+    if (offset && file) {
+        if ((size_t) offset > file->size)
+            offset = 0;
+        tc->file_pos = offset;
+    } else if (offset) {
+        struct stat st;
+
+        if (fstat(fileno(fp), &st) < 0 || offset > st.st_size ||
+            fseeko(fp, offset, SEEK_SET) < 0)
+            offset = 0;
+    }
+
+    if (offset) {
+        tc->offset = offset;
+        tc->mc_req = 0;
+    }
+
+    /* Tell the client the size of the file it gets, except in
+     * netascii where it is not known up front, or make room for the
+     * one it puts */
+    if (tsize >= 0 && opcode == OPCODE_RRQ) {
+        struct stat st;
+
+        if (tc->read_block != tftp_read_octet)
+            tsize = -1;
+        else if (file)
+            tsize = file->size;
+        else if (fstat(fileno(fp), &st) == 0)
+            tsize = st.st_size;
+        else
+            tsize = -1;
+    } else if (tsize >= 0) {
+        tc->tsize = tsize;
+        tftp_prealloc(tc);
+    }
+
+    /* Octet only, as the frames are of the file as it is. The blocks
+     * are then no longer pieces of the file, so neither go out to a
+     * group nor straight from the cache. */
+    if (compress && tc->read_block == tftp_read_octet) {
+        if (tftp_lz_start(tc) < 0) {
+            fprintf(stderr, "Out of memory!\n");
+            tftp_reject(sock, peer, 0);
+            tftp_close(tc);
+            return NULL;
+        }
+        tc->mc_req = 0;
+    } else {
+        compress = 0;
+    }
+
+    /* Octet blocks go out straight from the cached file */
+    if (file && tc->read_block == tftp_read_octet)
+        tc->window_data = calloc(sp.windowsize, sizeof(char *));
+
+    if (!tc->fname || (file && tc->read_block == tftp_read_octet && !tc->window_data)) {
+        fprintf(stderr, "Out of memory!\n");
+        tftp_reject(sock, peer, 0);
+        tftp_close(tc);
+        return NULL;
+    }
+
+    tc->blksize = sp.blksize;
+    tc->windowsize = sp.windowsize;
+    memcpy(&tc->peer_addr, peer, sizeof(tc->peer_addr));
+
+    /* The client's timeout is where our estimate starts */
+    if (timeout)
+        tc->rto = timeout * 1000000ULL;
+
+    if (blksize || windowsize || timeout || offset || compress || tsize >= 0) {
+        struct tftp_oack *oack = (struct tftp_oack *) tc->msgbuf;
+
+        p = oack->opts;
+        oack->opcode = htons(OPCODE_OACK);
+
+        if (blksize)
+            p += tftp_put_opt(p, OPT_BLKSIZE, blksize);
+        if (windowsize)
+            p += tftp_put_opt(p, OPT_WINDOWSIZE, windowsize);
+        if (timeout)
+            p += tftp_put_opt(p, OPT_TIMEOUT, timeout);
+        if (offset)
+            p += tftp_put_opt(p, OPT_OFFSET, offset);
+        if (compress)
+            p += tftp_put_optstr(p, OPT_COMPRESS, TFTP_LZ_NAME);
+        if (tsize >= 0)
+            p += tftp_put_opt(p, OPT_TSIZE, tsize);
+
+        tc->msglen = p - tc->msgbuf;
+    }
+
+    return tc;
+}
+
+/*
+  Connect the socket to the peer's TID. Sends then skip the address
+  and route lookup, and the kernel drops datagrams from anyone else
+  before they reach us. Not for multicast server sessions, which
+  hear from all clients of the group.
+ */
+static void tftp_connect_peer(struct tftp_conn *tc)
+{
+    if (connect(tc->sock, (struct sockaddr *) &tc->peer_addr, sizeof(tc->peer_addr)) == 0)
+        tc->connected = 1;
+    else
+        log_debug("connect: %s\n", strerror(errno));
+}
+
+/* Undo tftp_connect_peer(), to send a new request */
+static void tftp_disconnect_peer(struct tftp_conn *tc)
+{
+    struct sockaddr sa;
+
+    if (!tc->connected)
+        return;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_family = AF_UNSPEC;
+    connect(tc->sock, &sa, sizeof(sa));
+    tc->connected = 0;
+}
+
+/*
+  Size the buffers of 'sock' for TFTP_SOCKBUF_WINDOWS windows of the
+  negotiated block size, so a window arriving or leaving in a burst
+  is not dropped while the defaults are full. They are only grown,
+  and the kernel caps them at net.core.rmem_max and wmem_max.
+ */
+static void tftp_size_bufs(struct tftp_conn *tc, int sock)
+{
+    static const int opts[] = { SO_RCVBUF, SO_SNDBUF };
+    int want = TFTP_SOCKBUF_WINDOWS * tc->windowsize * MSGBUF_SIZE(tc->blksize);
+    unsigned int i;
+
+    for (i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+        int size;
+        socklen_t len = sizeof(size);
+
+        /* Linux reports twice what was set, the rest is overhead */
+        if (getsockopt(sock, SOL_SOCKET, opts[i], &size, &len) == 0 && size < want)
+            setsockopt(sock, SOL_SOCKET, opts[i], &want, sizeof(want));
+    }
+}
+
+#ifdef SO_RXQ_OVFL
+/* Note the drop counter the kernel handed us with a datagram from
+ * 'sock', it counts since the socket was opened */
+static inline void tftp_note_drops(struct tftp_conn *tc, int sock, struct cmsghdr *cm)
+{
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+        if (sock == tc->sock)
+            memcpy(&tc->sock_drops, CMSG_DATA(cm), sizeof(u_int32_t));
+        else
+            memcpy(&tc->mc_drops, CMSG_DATA(cm), sizeof(u_int32_t));
+    }
+}
+#endif
+
+/* Where a message goes: data blocks of a multicast transfer to the
+ * group, everything else to the peer, or NULL if the socket is
+ * connected to it */
+static inline struct sockaddr_in *tftp_dest(struct tftp_conn *tc, const void *msg)
+{
+    if (tc->mc && ntohs(((const struct tftp_msg *) msg)->opcode) == OPCODE_DATA)
+        return &tc->mc->group;
+
+    return tc->connected ? NULL : &tc->peer_addr;
+}
+
+/*
+  Send all queued messages, as few at a time as sendmmsg allows.
+  Returns negative on error.
+ */
+static int tftp_flush(struct tftp_conn *tc)
+{
+#ifdef OS_LINUX
+    int sent = 0;
+    int i, j;
+
+    while (sent < tc->txq_len) {
+        struct msghdr *mh = &tc->txq[sent].msg_hdr;
+
+        if (!tc->gso && tc->txsegs[sent] > 1) {
+            /* Coalesced before GSO turned out not to work, send
+             * the blocks one by one */
+            struct msghdr one = *mh;
+
+            one.msg_iovlen = mh->msg_iovlen / tc->txsegs[sent];
+            one.msg_control = NULL;
+            one.msg_controllen = 0;
+
+            for (j = 0; j < (int) mh->msg_iovlen; j += one.msg_iovlen) {
+                one.msg_iov = mh->msg_iov + j;
+                sendmsg(tc->sock, &one, 0);
+                tc->tx_calls++;
+                tc->tx_msgs++;
+            }
+            sent++;
+            continue;
+        }
+
+        int n = sendmmsg(tc->sock, tc->txq + sent, tc->txq_len - sent, 0);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (tc->txsegs[sent] > 1) {
+                /* The socket option was fine but the route or device
+                 * can't do it, e.g. EIO without checksum offload */
+                fprintf(stderr, "UDP GSO send failed, falling back\n");
+                tc->gso = 0;
+                continue;
+            }
+
+            tc->txq_len = 0;
+            return -1;
+        }
+
+        tc->tx_calls++;
+
+        for (i = sent; i < sent + n; i++) {
+            int segs = tc->txsegs[i];
+
+            tc->tx_msgs += segs;
+
+            if (segs > 1) {
+                tc->gso_sends++;
+                tc->gso_segs += segs;
+            }
+        }
+
+        sent += n;
+    }
+
+    tc->txq_len = 0;
+#endif
+    return 0;
+}
+
+/*
+  Put a message on the wire. All messages are built in place, in
+  msgbuf or a window slot, so this is the only thing left to do. The
+  data of a block sent from the cache follows the header from where
+  it is, 'data' is NULL otherwise. The message is queued and goes out
+  with the rest of the batch at the next tftp_flush(), so it must
+  stay put until then. Returns the number of bytes queued, or
+  negative on error.
+ */
+static int tftp_xmit_data(struct tftp_conn *tc, void *msg, int len,
+                          const char *data, int datalen)
+{
+    int iovs = data ? 2 : 1; /* Per block */
+#ifdef OS_LINUX
+    struct msghdr *mh;
+    int i;
+#else
+    struct msghdr mh;
+    struct iovec iov[2];
+#endif
+
+    print_message((struct tftp_msg *) msg, len + datalen, 0);
+    tftp_event(tc, LOG_EV_SENT, msg, len + datalen);
+
+#ifdef OS_LINUX
+
+    /* A newer message built in msgbuf replaces a queued one */
+    for (i = 0; i < tc->txq_len; i++) {
+        mh = &tc->txq[i].msg_hdr;
+
+        if (mh->msg_iov[0].iov_base == msg && !data) {
+            mh->msg_iov[0].iov_len = len;
+            return len;
+        }
+    }
+
+    if (tc->gso && tc->txq_len > 0 &&
+        ntohs(((struct tftp_msg *) msg)->opcode) == OPCODE_DATA) {
+        /* Data blocks follow each other in the window. Add this one
+         * to the previous datagram if that is a run of full blocks,
+         * the kernel splits it again at the block boundaries. Only
+         * the last block in a run may be short. */
+        int seg = MSGBUF_SIZE(tc->blksize);
+        int segs = tc->txsegs[tc->txq_len - 1];
+        size_t last;
+
+        mh = &tc->txq[tc->txq_len - 1].msg_hdr;
+        last = mh->msg_iov[mh->msg_iovlen - 1].iov_len;
+        if (iovs == 2)
+            last += mh->msg_iov[mh->msg_iovlen - 2].iov_len;
+
+        if (ntohs(((struct tftp_msg *) mh->msg_iov[0].iov_base)->opcode) == OPCODE_DATA &&
+            (int) mh->msg_iovlen == segs * iovs && last == (size_t) seg &&
+            segs < TFTP_GSO_MAX_SEGS && (segs + 1) * seg <= TFTP_GSO_MAX_BYTES) {
+
+            if (segs == 1) {
+                struct cmsghdr *cm;
+
+                mh->msg_control = tc->txctl + (tc->txq_len - 1) * CMSG_SPACE(sizeof(u_int16_t));
+                mh->msg_controllen = CMSG_SPACE(sizeof(u_int16_t));
+                cm = CMSG_FIRSTHDR(mh);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+                *(u_int16_t *) CMSG_DATA(cm) = seg;
+            }
+
+            mh->msg_iov[mh->msg_iovlen].iov_base = msg;
+            mh->msg_iov[mh->msg_iovlen].iov_len = len;
+            if (data) {
+                mh->msg_iov[mh->msg_iovlen + 1].iov_base = (char *) data;
+                mh->msg_iov[mh->msg_iovlen + 1].iov_len = datalen;
+            }
+            mh->msg_iovlen += iovs;
+            tc->txsegs[tc->txq_len - 1]++;
+
+            return len + datalen;
+        }
+    }
+
+    if (tc->txq_len == tc->batch && tftp_flush(tc) < 0)
+        return -1;
+
+    tc->txsegs[tc->txq_len] = 1;
+    mh = &tc->txq[tc->txq_len++].msg_hdr;
+    mh->msg_iov[0].iov_base = msg;
+    mh->msg_iov[0].iov_len = len;
+    if (data) {
+        mh->msg_iov[1].iov_base = (char *) data;
+        mh->msg_iov[1].iov_len = datalen;
+    }
+    mh->msg_iovlen = iovs;
+    mh->msg_control = NULL;
+    mh->msg_controllen = 0;
+    mh->msg_name = tftp_dest(tc, msg);
+    mh->msg_namelen = mh->msg_name ? tc->addrlen : 0;
+
+    return len + datalen;
+#else
+    tc->tx_calls++;
+    tc->tx_msgs++;
+
+    iov[0].iov_base = msg;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (char *) data;
+    iov[1].iov_len = datalen;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = tftp_dest(tc, msg);
+    mh.msg_namelen = mh.msg_name ? tc->addrlen : 0;
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovs;
+
+    return sendmsg(tc->sock, &mh, 0);
+#endif
+}
+
+#define tftp_xmit(tc, msg, len) tftp_xmit_data(tc, msg, len, NULL, 0)
+
+/* Put the data block in window slot 'slot' on the wire */
+static int tftp_xmit_block(struct tftp_conn *tc, int slot)
+{
+    char *msg = tc->window + slot * tc->msgbuf_size;
+
+    if (tc->window_data)
+        return tftp_xmit_data(tc, msg, TFTP_DATA_HDR_LEN, tc->window_data[slot],
+                              tc->window_len[slot] - TFTP_DATA_HDR_LEN);
+
+    return tftp_xmit(tc, msg, tc->window_len[slot]);
+}
+
+/*
+  Send a read request to the server.
+  1. Format message.
+  2. Send the request using the connection handle.
+  3. Return the number of bytes sent, or negative on error.
+ */
+int tftp_send_rrq(struct tftp_conn *tc)
+{
+    int reqlen = TFTP_RRQ_LEN(tc->fname, tc->mode) + tftp_opts_len(tc);
+
+    /* Built right in the msgbuffer so a resend is just a send */
+    struct tftp_rrq *rrq = (struct tftp_rrq *) tc->msgbuf;
+
+    if (reqlen > tc->msgbuf_size) {
+        fprintf(stderr, "Request too long\n");
+        return -1;
+    }
+
+    rrq->opcode = htons(OPCODE_RRQ);
+
+    strcpy (&rrq->req[0], tc->fname);
+    strcpy (&rrq->req[strlen(tc->fname) + 1], tc->mode);
+    tftp_put_opts(tc, (char *) rrq + TFTP_RRQ_LEN(tc->fname, tc->mode));
+
+    tc->msglen = reqlen;
+
+    return tftp_xmit(tc, tc->msgbuf, reqlen);
+}
+/*
+
+  Send a write request to the server.
+  1. Format message.
+  2. Send the request using the connection handle.
+  3. Return the number of bytes sent, or negative on error.
+ */
+int tftp_send_wrq(struct tftp_conn *tc)
+{
+    int reqlen = TFTP_WRQ_LEN(tc->fname, tc->mode) + tftp_opts_len(tc);
+
+    /* Built right in the msgbuffer so a resend is just a send */
+    struct tftp_wrq *wrq = (struct tftp_wrq *) tc->msgbuf;
+
+    if (reqlen > tc->msgbuf_size) {
+        fprintf(stderr, "Request too long\n");
+        return -1;
+    }
+
+    wrq->opcode = htons(OPCODE_WRQ);
+
+    strcpy (&wrq->req[0], tc->fname);
+    strcpy (&wrq->req[strlen(tc->fname) + 1], tc->mode);
+    tftp_put_opts(tc, (char *) wrq + TFTP_WRQ_LEN(tc->fname, tc->mode));
+
+    tc->msglen = reqlen;
+
+    return tftp_xmit(tc, tc->msgbuf, reqlen);
+}
+
+
+/*
+  Acknowledge reception of a block.
+  1. Format message.
+  2. Send the acknowledgement using the connection handle.
+  3. Return the number of bytes sent, or negative on error.
+ */
+int tftp_send_ack(struct tftp_conn *tc)
+{
+    struct tftp_ack *ack = (struct tftp_ack *) tc->msgbuf;
+
+    ack->opcode = htons(OPCODE_ACK);
+    ack->blocknr = htons((u_int16_t) tc->blocknr);
+
+    tc->msglen = TFTP_ACK_HDR_LEN;
+    tc->ack_sent = tc->blocknr;
+
+    return tftp_xmit(tc, tc->msgbuf, TFTP_ACK_HDR_LEN);
+}
+
+/*
+  Tell the server where we are after a gap (RFC 7440), once per gap.
+  An ack for a block we had not acked yet goes out only once, so it is
+  timed like any fresh packet. Otherwise a windowed get with loss
+  would never sample the RTT after a backoff.
+ */
+static void tftp_send_gap_ack(struct tftp_conn *tc)
+{
+    int fresh = tc->blocknr != tc->ack_sent;
+
+    tftp_send_ack(tc);
+    if (!fresh)
+        tc->stats.retrans++;
+    tftp_timer_arm(tc, fresh);
+    tc->gap_acked = 1;
+    tc->winpos = 0;
+}
+
+#ifdef OS_LINUX
+/* Whether the message at 'msg' is queued and not yet sent */
+static int tftp_queued(struct tftp_conn *tc, const char *msg)
+{
+    int i, j;
+
+    for (i = 0; i < tc->txq_len; i++) {
+        struct msghdr *mh = &tc->txq[i].msg_hdr;
+
+        for (j = 0; j < (int) mh->msg_iovlen; j++) {
+            if (mh->msg_iov[j].iov_base == msg)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+/*
+  Send a data block to the other side.
+  1. Format message.
+  2. Add data block to message according to length argument.
+  3. Send the data block message using the connection handle.
+  4. Return the number of bytes sent, or negative on error.
+
+  The message is built right in its window slot, with the file read
+  straight into it, and stays there until the server has
+  acknowledged it, see tftp_resend_data().
+ */
+int tftp_send_data(struct tftp_conn *tc, int length)
+{
+    //TODO: Det hr borde snyggas upp, ska length vara med eller utan headern?
+    int length_real = length;
+    int	dataplen;
+    int slot = (tc->blocknr + 1) % tc->windowsize;
+    struct tftp_data *tdata = (struct tftp_data *) (tc->window + slot * tc->msgbuf_size);
+
+#ifdef OS_LINUX
+    /* A resend of the block that had the slot before may still be
+     * queued, with the length and cached data of that block. Get it
+     * out before the slot is overwritten. */
+    if (tftp_queued(tc, (char *) tdata) && tftp_flush(tc) < 0)
+        return -1;
+#endif
+
+    /* Create new data block */
+    tc->blocknr++;
+
+    tdata->opcode = htons(OPCODE_DATA);
+    tdata->blocknr = htons((u_int16_t) tc->blocknr);
+
+#ifdef OS_LINUX
+    if (tc->slot_busy) {
+        /* Read and sent by io_uring, by offset */
+        off_t left = tc->file_size - tc->file_off;
+
+        if (length_real > left)
+            length_real = left;
+        tc->window_len[slot] = TFTP_DATA_HDR_LEN + length_real;
+
+        tc->stats.blocks++;
+        tc->stats.bytes += length_real;
+
+        print_message((struct tftp_msg *) tdata, TFTP_DATA_HDR_LEN + length_real, 0);
+        tftp_event(tc, LOG_EV_SENT, tdata, TFTP_DATA_HDR_LEN + length_real);
+
+        return tftp_uring_send_block(tc, slot, length_real);
+    }
+#endif
+
+    if (tc->window_data) {
+        /* Sent from the cache as it is, nothing to read */
+        size_t left = tc->file->size - tc->file_pos;
+
+        if ((size_t) length_real > left)
+            length_real = left;
+        tc->window_data[slot] = tc->file->data + tc->file_pos;
+        tc->file_pos += length_real;
+    } else if ((length_real = tc->read_block(tc, tdata->data, length_real)) < 0) {
+        /* Read the file, translated to the transfer mode, straight
+         * into the message */
+        return -1;
+    }
+
+    /* Recalculate the package length in case we only was able to
+     * read less than 'length_real' bytes from the file */
+    dataplen = TFTP_DATA_HDR_LEN + length_real;
+    tc->window_len[slot] = dataplen;
+
+    tc->stats.blocks++;
+    tc->stats.bytes += length_real;
+
+    return tftp_xmit_block(tc, slot);
+}
+
+/*
+  Resend a data block that is still in the window, i.e. has been sent
+  but not yet acknowledged.
+ */
+int tftp_resend_data(struct tftp_conn *tc, int64_t blocknr)
+{
+    int slot = blocknr % tc->windowsize;
+    char *msg = tc->window + slot * tc->msgbuf_size;
+
+#ifdef OS_LINUX
+    /* Still being read and sent by io_uring */
+    if (tc->slot_busy && tc->slot_busy[slot])
+        return tc->window_len[slot];
+
+    /* Already on its way, e.g. a repeated ack came in the same
+     * batch as the first one */
+    if (tftp_queued(tc, msg))
+        return tc->window_len[slot];
+#endif
+
+    log_trace("Resending block %lld\n", (long long) blocknr);
+    tc->stats.retrans++;
+    tc->window_time[slot] = 0;
+
+    return tftp_xmit_block(tc, slot);
+}
+
+
+/*
+  Fill the window starting at the block after the last acknowledged
+  one. Blocks already in the window are resent, the rest are read
+  from the file. Returns negative on error.
+ */
+static int tftp_send_window(struct tftp_conn *tc)
+{
+    int64_t nr;
+
+    tc->window_sent = tftp_now();
+
+    for (nr = tc->blocknr_acked + 1; nr <= tc->blocknr_acked + tc->windowsize; nr++) {
+        if (nr <= tc->blocknr) {
+            if (tftp_resend_data(tc, nr) < 0)
+                return -1;
+            continue;
+        }
+
+        /* Don't read past the final block */
+        if (tc->blocknr_last >= 0)
+            break;
+
+        int len = tftp_send_data(tc, tc->blksize);
+
+        if (len < 0)
+            return -1;
+
+        if (len < MSGBUF_SIZE(tc->blksize))
+            tc->blocknr_last = tc->blocknr;
+        tc->window_time[tc->blocknr % tc->windowsize] = tc->window_sent;
+    }
+
+    return 0;
+}
+
+int tftp_send_error(struct tftp_conn *tc, int errcode)
+{
+
+    struct tftp_err *err = (struct tftp_err *) tc->msgbuf;
+
+    char * errmsg = tftp_err_to_str(errcode);
+
+    int errlen = TFTP_ERR_HDR_LEN + strlen(errmsg) + 1;
+
+    err->opcode = htons(OPCODE_ERR);
+    err->errcode = htons(errcode);
+    strcpy(&err->errmsg[0],errmsg);
+
+    tc->msglen = errlen;
+
+    return tftp_xmit(tc, tc->msgbuf, errlen);
+
+}
+
+/* Ports of the multicast groups in use, shared by all workers */
+static pthread_mutex_t tftp_mcast_lock = PTHREAD_MUTEX_INITIALIZER;
+static char tftp_mcast_busy[TFTP_MCAST_GROUPS];
+
+static int tftp_same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+/*
+  Set up a multicast group on a free port for a file with 'last'
+  blocks, with 'master' as its master client. Returns NULL if all
+  groups are taken.
+ */
+static struct tftp_mcast *tftp_mcast_new(const struct tftp_params *params,
+                                         const struct sockaddr_in *master, int last)
+{
+    struct tftp_mcast *mc = calloc(1, sizeof(*mc));
+    int slot;
+
+    if (!mc || !(mc->clients = malloc(8 * sizeof(*mc->clients)))) {
+        free(mc);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&tftp_mcast_lock);
+    for (slot = 0; slot < TFTP_MCAST_GROUPS && tftp_mcast_busy[slot]; slot++)
+        ;
+    if (slot < TFTP_MCAST_GROUPS)
+        tftp_mcast_busy[slot] = 1;
+    pthread_mutex_unlock(&tftp_mcast_lock);
+
+    if (slot == TFTP_MCAST_GROUPS) {
+        free(mc->clients);
+        free(mc);
+        return NULL;
+    }
+
+    mc->group = params->mcast_group;
+    mc->group.sin_port = htons(ntohs(params->mcast_group.sin_port) + slot);
+    mc->slot = slot;
+    mc->last = last;
+    mc->clients[0] = *master;
+    mc->nclients = 1;
+    mc->maxclients = 8;
+
+    return mc;
+}
+
+static void tftp_mcast_free(struct tftp_mcast *mc)
+{
+    pthread_mutex_lock(&tftp_mcast_lock);
+    tftp_mcast_busy[mc->slot] = 0;
+    pthread_mutex_unlock(&tftp_mcast_lock);
+
+    free(mc->clients);
+    free(mc);
+}
+
+/*
+  Add the multicast option for a client of group 'mc' to the OACK in
+  msgbuf, making one if there is none. 'master' tells the client
+  whether it is the master client.
+ */
+static void tftp_mcast_opt(struct tftp_conn *tc, struct tftp_mcast *mc, int master)
+{
+    struct tftp_oack *oack = (struct tftp_oack *) tc->msgbuf;
+    char addr[INET_ADDRSTRLEN];
+    char val[INET_ADDRSTRLEN + 16];
+
+    if (!tc->msglen) {
+        oack->opcode = htons(OPCODE_OACK);
+        tc->msglen = TFTP_OACK_HDR_LEN;
+    }
+
+    inet_ntop(AF_INET, &mc->group.sin_addr, addr, sizeof(addr));
+    snprintf(val, sizeof(val), "%s,%d,%d", addr, ntohs(mc->group.sin_port), master);
+
+    tc->msglen += tftp_put_optstr(tc->msgbuf + tc->msglen, OPT_MULTICAST, val);
+}
+
+/*
+  Make a new session of a client that asked for multicast part of a
+  multicast transfer. If one of the same file with the same block
+  and window size is running among the 'active' sessions, the client
+  joins it and 'tc' is closed. Otherwise 'tc' starts a new one with
+  the client as its master, or stays unicast if all groups are taken
+  or the file has more blocks than there are block numbers. Returns
+  1 if 'tc' was closed, 0 if it is to be started.
+ */
+static int tftp_mcast_attach(struct tftp_conn *tc, struct tftp_conn **active, int nactive,
+                             const struct tftp_params *params)
+{
+    struct tftp_mcast *mc;
+    struct in_addr ifaddr;
+    struct stat st;
+    off_t size;
+    int i;
+
+    for (i = 0; i < nactive; i++) {
+        struct tftp_conn *s = active[i];
+
+        if (s->mc && s->state != TFTP_STATE_DONE && s->blksize == tc->blksize &&
+            s->windowsize == tc->windowsize && !strcmp(s->fname, tc->fname))
+            break;
+    }
+
+    if (i < nactive) {
+        struct tftp_conn *s = active[i];
+        int j;
+
+        mc = s->mc;
+
+        /* A client that resent its request is already on the list */
+        for (j = 0; j < mc->nclients && !tftp_same_addr(&mc->clients[j], &tc->peer_addr); j++)
+            ;
+
+        if (j == mc->nclients) {
+            if (mc->nclients == mc->maxclients) {
+                struct sockaddr_in *c = realloc(mc->clients, 2 * mc->maxclients * sizeof(*c));
+
+                if (!c) {
+                    tc->mc_req = 0;
+                    return 0;
+                }
+                mc->clients = c;
+                mc->maxclients *= 2;
+            }
+            mc->clients[mc->nclients++] = tc->peer_addr;
+        }
+
+        /* Answered from the session of the group, that is the TID
+         * of the transfer */
+        tftp_mcast_opt(tc, mc, j == 0);
+        if (sendto(s->sock, tc->msgbuf, tc->msglen, 0, (struct sockaddr *) &tc->peer_addr,
+                   sizeof(tc->peer_addr)) >= 0) {
+            s->tx_calls++;
+            s->tx_msgs++;
+        }
+
+        log_debug("%s:%d joined %s\n", inet_ntoa(tc->peer_addr.sin_addr),
+                  ntohs(tc->peer_addr.sin_port), tc->fname);
+        tftp_close(tc);
+        return 1;
+    }
+
+    if (tc->file)
+        size = tc->file->size;
+    else if (fstat(fileno(tc->fp), &st) == 0)
+        size = st.st_size;
+    else
+        size = (off_t) TFTP_MCAST_BLOCKS * tc->blksize;
+
+    /* Blocks go out on the interface the client is reached through */
+    if (size / tc->blksize + 1 > TFTP_MCAST_BLOCKS ||
+        tftp_local_addr(&tc->peer_addr, &ifaddr) < 0 ||
+        setsockopt(tc->sock, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) < 0 ||
+        !(mc = tftp_mcast_new(params, &tc->peer_addr, size / tc->blksize + 1))) {
+        tc->mc_req = 0;
+        return 0;
+    }
+
+    tc->mc = mc;
+    tftp_mcast_opt(tc, mc, 1);
+
+    return 0;
+}
+
+/*
+  A message to a multicast session from a client other than the
+  master. An ack of the final block says the client has the whole
+  file and an error that it gives up, either way it is off the list.
+  Anything else is none of its business.
+ */
+static void tftp_mcast_other(struct tftp_conn *tc, const struct sockaddr_in *from,
+                             char *buf, int len)
+{
+    struct tftp_mcast *mc = tc->mc;
+    int opcode;
+    int i;
+
+    if (len < (int) TFTP_ACK_HDR_LEN)
+        return;
+
+    print_message((struct tftp_msg *) buf, len, 1);
+    tftp_event(tc, LOG_EV_RECV, buf, len);
+
+    opcode = ntohs(((struct tftp_msg *) buf)->opcode);
+
+    if (opcode != OPCODE_ERR &&
+        (opcode != OPCODE_ACK || ntohs(((struct tftp_ack *) buf)->blocknr) != mc->last))
+        return;
+
+    for (i = 1; i < mc->nclients; i++) {
+        if (tftp_same_addr(&mc->clients[i], from)) {
+            log_debug("%s:%d %s %s\n", inet_ntoa(from->sin_addr), ntohs(from->sin_port),
+                      tc->fname, opcode == OPCODE_ACK ? "done" : "failed");
+            mc->nclients--;
+            memmove(&mc->clients[i], &mc->clients[i + 1],
+                    (mc->nclients - i) * sizeof(*mc->clients));
+            break;
+        }
+    }
+}
+
+/*
+  Go on sending a multicast transfer after block 'blocknr', where its
+  master client has everything up to. Returns negative if there is no
+  such block.
+ */
+static int tftp_mcast_seek(struct tftp_conn *tc, int64_t blocknr)
+{
+    off_t off = (off_t) blocknr * tc->blksize;
+
+    if (blocknr > tc->mc->last)
+        return -1;
+
+    if (tc->file)
+        tc->file_pos = off;
+    else if (fseeko(tc->fp, off, SEEK_SET) < 0)
+        return -1;
+
+    tc->blocknr = blocknr;
+    tc->blocknr_acked = blocknr;
+    tc->blocknr_last = blocknr == tc->mc->last ? blocknr : -1;
+    tc->mc->rewind = 0;
+
+    return 0;
+}
+
+/*
+  The master client of a multicast transfer is done, or gone if
+  'retval' is negative. Make the next client master, telling it with
+  an OACK, and wait for its ack to say where to go on from. Returns
+  negative if there is none, i.e. the transfer is over.
+ */
+static int tftp_mcast_next(struct tftp_conn *tc, int retval)
+{
+    struct tftp_mcast *mc = tc->mc;
+
+    log_debug("%s:%d %s %s\n", inet_ntoa(tc->peer_addr.sin_addr),
+              ntohs(tc->peer_addr.sin_port), tc->fname, retval < 0 ? "failed" : "done");
+
+    mc->nclients--;
+    memmove(mc->clients, mc->clients + 1, mc->nclients * sizeof(*mc->clients));
+
+    if (mc->nclients == 0 || tftp_stop)
+        return -1;
+
+    /* A new client, a new path to it */
+    memcpy(&tc->peer_addr, &mc->clients[0], sizeof(tc->peer_addr));
+    tc->rto = TFTP_TIMEOUT * 1000000;
+    tc->srtt = 0;
+    tc->rttvar = 0;
+    tc->retries = 0;
+
+    tc->blocknr = 0;
+    tc->blocknr_acked = 0;
+    tc->blocknr_last = -1;
+    mc->rewind = 1;
+
+    tc->msglen = 0;
+    tftp_mcast_opt(tc, mc, 1);
+
+    if (tftp_xmit(tc, tc->msgbuf, tc->msglen) < 0 || tftp_flush(tc) < 0)
+        return -1;
+
+    tftp_timer_arm(tc, 1);
+    tc->state = TFTP_STATE_XFER;
+
+    return 0;
+}
+
+/*
+  All the data is through: work out its digest, if we keep one, and
+  compare it with the one expected. Returns negative on a mismatch.
+ */
+static int tftp_digest_check(struct tftp_conn *tc)
+{
+    unsigned char md[DIGEST_MAX_LEN];
+
+    if (tc->digest.alg == DIGEST_NONE)
+        return 0;
+
+    digest_final(&tc->digest, md);
+    digest_hex(md, digest_len(tc->digest.alg), tc->digest_hex);
+    log_info("%s  %s\n", tc->digest_hex, tc->fname);
+
+    if (tc->digest_expect[0] && strcmp(tc->digest_hex, tc->digest_expect) != 0) {
+        fprintf(stderr, "\n%s: %s is %s, expected %s\n", tc->fname,
+                digest_name(tc->digest.alg), tc->digest_hex, tc->digest_expect);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Tell the caller the transfer is complete, once */
+static void tftp_complete(struct tftp_conn *tc, int status)
+{
+    if (tc->done && !tc->done_called) {
+        tc->done_called = 1;
+        tc->done(tc, status, tc->done_arg);
+    }
+}
+
+/*
+  Finish a transfer, successfully or not. The file is closed right
+  away so it is complete on disk even if the handle lives on.
+  Returns 'retval' for convenience.
+ */
+static int tftp_finish(struct tftp_conn *tc, int retval)
+{
+    /* A server has too many sessions to go on about each one */
+    int level = tc->server ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO;
+
+    /* Whatever we still had to say, e.g. an error */
+    tftp_flush(tc);
+
+    /* A multicast transfer goes on with the next client */
+    if (tc->mc && tftp_mcast_next(tc, retval) == 0)
+        return 0;
+
+    if (!tc->stats.end)
+        tc->stats.end = tftp_now();
+    tc->stats.transfers = 1;
+    tc->stats.failed = retval < 0;
+    tc->stats.packets = tc->tx_msgs + tc->rx_msgs;
+#ifdef OS_LINUX
+    /* Count what GRO coalesced one by one */
+    tc->stats.packets += tc->gro_segs - tc->gro_recvs;
+    tc->stats.drops = tc->sock_drops + tc->mc_drops;
+#endif
+    if (tc->lz_frame)
+        tc->stats.lz_bytes = tc->stats.bytes;
+
+    if (retval < 0)
+        log_ring_dump(&tc->ring, stderr, tc->fname);
+
+    if (tc->tx_calls && tc->rx_calls)
+        log_at(level, "Sent %lu datagrams in %lu calls (%.1f per call), "
+               "received %lu in %lu (%.1f per call)\n",
+               tc->tx_msgs, tc->tx_calls, (double) tc->tx_msgs / tc->tx_calls,
+               tc->rx_msgs, tc->rx_calls, (double) tc->rx_msgs / tc->rx_calls);
+
+#ifdef OS_LINUX
+    if (tc->gso_sends || tc->gro_recvs)
+        log_at(level, "GSO: %lu blocks in %lu sends, GRO: %lu blocks in %lu receives\n",
+               tc->gso_segs, tc->gso_sends, tc->gro_segs, tc->gro_recvs);
+#endif
+
+    tftp_close_file(tc);
+
+    tc->state = TFTP_STATE_DONE;
+    tc->retval = retval;
+    tftp_complete(tc, retval);
+
+    return retval;
+}
+
+/*
+  Start a transfer by sending a read or write request depending on
+  whether we are getting or putting a file. The rest of the transfer
+  is driven by tftp_recv() and tftp_timeout(). Returns negative on
+  error.
+ */
+int tftp_start(struct tftp_conn *tc)
+{
+    int size;
+
+    /* Sanity check */
+    if (!tc)
+        return -1;
+
+    tc->stats.start = tftp_now();
+
+    /* Check if we are putting a file or getting a file and send
+     * the corresponding request. A server answers the request with
+     * the OACK, or goes ahead with the first block or ack 0. */
+
+    if (tc->server) {
+        /* The client's TID is known and the options are settled */
+        if (!tc->mc)
+            tftp_connect_peer(tc);
+        tftp_size_bufs(tc, tc->sock);
+
+        if (tc->msglen)
+            size = tftp_xmit(tc, tc->msgbuf, tc->msglen);
+        else if (tc->type == TFTP_TYPE_PUT)
+            size = tftp_send_window(tc);
+        else
+            size = tftp_send_ack(tc);
+    } else if (tc->type == TFTP_TYPE_GET) {
+        /* Send read request */
+        size = tftp_send_rrq(tc);
+    } else if (tc->type == TFTP_TYPE_PUT) {
+        /* Send write request */
+        size = tftp_send_wrq(tc);
+    } else {
+        return tftp_finish(tc, -1);
+    }
+
+    if (size < 0) {
+        fprintf(stderr, "Failed to send request\n");
+        return tftp_finish(tc, -1);
+    }
+
+    if (tftp_flush(tc) < 0) {
+        fprintf(stderr, "Failed to send request\n");
+        return tftp_finish(tc, -1);
+    }
+
+    /* Set a timeout for resending data. */
+    tftp_timer_arm(tc, 1);
+    tc->state = TFTP_STATE_XFER;
+
+    return 0;
+}
+
+/*
+  The retransmission deadline passed without an answer from the
+  server. Resend the last block or ack depending on whether we are in
+  put or get mode. Returns negative if the transfer failed.
+ */
+int tftp_timeout(struct tftp_conn *tc)
+{
+    /* Nobody resent the last data block, so our final ack made it */
+    if (tc->state == TFTP_STATE_LINGER)
+        return tftp_finish(tc, 0);
+
+    log_debug("Timeout after %d ms\n", (int) (tc->rto / 1000));
+    tc->stats.timeouts++;
+
+    if (tftp_timer_expired(tc) < 0) {
+        fprintf(stderr, "\nNo answer from %s after %d retries, giving up\n",
+                tc->server ? "client" : "server", TFTP_MAX_RETRIES);
+        tftp_send_error(tc, 0);
+        return tftp_finish(tc, -1);
+    }
+
+    tftp_timer_arm(tc, 0);
+
+    /* Not the master client, there is nothing of ours to resend.
+     * Wait for our turn for as long as the group is busy. */
+    if (tc->mc_sock >= 0 && !tc->mc_master)
+        return 0;
+
+    /* Data in flight, go back to the last acked block */
+    if (tc->type == TFTP_TYPE_PUT && tc->blocknr > 0) {
+        tftp_send_window(tc);
+        tftp_flush(tc);
+        return 0;
+    }
+
+    /* The last request, OACK or ack is still in msgbuf, send it as
+     * is. Nested switch-case statemens are awesome! */
+    switch (ntohs(((u_int16_t*) tc->msgbuf)[0])) {
+    case OPCODE_RRQ:
+    case OPCODE_WRQ:
+    case OPCODE_OACK:
+    case OPCODE_ACK:
+        tftp_xmit(tc, tc->msgbuf, tc->msglen);
+        tc->stats.retrans++;
+        break;
+    case OPCODE_ERR:
+        //TODO: Vilka error-medelanden ska skickas om, om ngra?
+        break;
+    default:
+        fprintf(stderr, "\nThis shouldn't happend\n");
+        return tftp_finish(tc, -1);
+    }
+
+    tftp_flush(tc);
+
+    return 0;
+}
+
+
+/* Do we have block 'nr' of a multicast transfer? */
+#define tftp_mcast_have(tc, nr) ((tc)->mc_have[(nr) / 8] & (1 << (nr) % 8))
+
+/*
+  Take a data block of a multicast transfer. They come from the group,
+  for whichever client is master, so in any order and more than once.
+  Each one is written where it belongs and tc->blocknr is how far we
+  have them all, which the master client acks as in a unicast
+  transfer. Returns 1 once the file is complete, 0 if it is not yet,
+  or negative on error.
+ */
+static int tftp_mcast_data(struct tftp_conn *tc, char *recbuf, int reclen)
+{
+    int nr = ntohs(((struct tftp_data *) recbuf)->blocknr);
+    int len = reclen - TFTP_DATA_HDR_LEN;
+    int64_t from = tc->blocknr;
+
+    if (nr == 0 || (tc->mc_last && nr > tc->mc_last) || tftp_mcast_have(tc, nr)) {
+        tc->stats.dups++;
+    } else {
+        /* Where the block goes, zeros left out before it are a hole
+         * already */
+        tc->write_pos = (off_t) (nr - 1) * tc->blksize;
+        tc->hole = 0;
+
+        if (fseeko(tc->fp, tc->write_pos, SEEK_SET) < 0 ||
+            tc->write_block(tc, recbuf + TFTP_DATA_HDR_LEN, len) < 0) {
+            fprintf(stderr, "\nFailed to write %s\n", tc->fname);
+            tftp_send_error(tc, 3);
+            return -1;
+        }
+
+        tc->mc_have[nr / 8] |= 1 << nr % 8;
+        tc->stats.blocks++;
+        tc->stats.bytes += len;
+
+        if (len < tc->blksize)
+            tc->mc_last = nr;
+    }
+
+    while (tc->blocknr < TFTP_MCAST_BLOCKS && tftp_mcast_have(tc, tc->blocknr + 1))
+        tc->blocknr++;
+
+    /* Master or not, the server wants to know we are done */
+    if (tc->mc_last && tc->blocknr == tc->mc_last) {
+        tftp_send_ack(tc);
+        return 1;
+    }
+
+    if (!tc->mc_master) {
+        /* Not our turn yet, but the server is still there */
+        tftp_timer_progress(tc);
+        return 0;
+    }
+
+    if (nr == from + 1) {
+        tc->gap_acked = 0;
+        tftp_timer_progress(tc);
+
+        /* Ack at the end of the window, or right away if we had
+         * the blocks that follow already so they are skipped */
+        if (++tc->winpos >= tc->windowsize || tc->blocknr > nr) {
+            tftp_send_ack(tc);
+            tftp_timer_arm(tc, 1);
+            tc->winpos = 0;
+        }
+    } else if (!tc->gap_acked) {
+        /* A gap or a block from before, once per gap as in
+         * tftp_handle() */
+        tftp_send_gap_ack(tc);
+    }
+
+    return 0;
+}
+
+/*
+  Take the necessary action for a message from the server. Returns
+  negative if the transfer failed.
+ */
+static int tftp_handle(struct tftp_conn *tc, char *recbuf, int reclen)
+{
+    int terminate = 0;
+
+    if (reclen < (int) TFTP_ACK_HDR_LEN) {
+        /* Runt */
+        return 0;
+    }
+
+    print_message((struct tftp_msg *) recbuf, reclen, 1);
+    tftp_event(tc, LOG_EV_RECV, recbuf, reclen);
+
+    if (tc->state == TFTP_STATE_LINGER) {
+        /* The last ack might have been lost. If we see the last data
+         * block again, or are made master of a multicast transfer,
+         * send the ack one more time */
+        if ((ntohs(((u_int16_t *) recbuf)[0]) == OPCODE_DATA
+             && ntohs(((u_int16_t*) recbuf)[1]) == (u_int16_t) tc->blocknr) ||
+            (ntohs(((u_int16_t *) recbuf)[0]) == OPCODE_OACK && tc->mc_sock >= 0)) {
+            tftp_send_ack(tc);
+            tc->stats.retrans++;
+        }
+        if (ntohs(((u_int16_t *) recbuf)[0]) == OPCODE_DATA)
+            tc->stats.stale_data++;
+        tc->stats.dups++;
+        return 0;
+    }
+
+    /* Check the message type and take the necessary action. */
+    switch (ntohs(((u_int16_t*) recbuf)[0])) {
+    case OPCODE_OACK:
+        if (tc->mc_sock >= 0) {
+            /* The multicast server telling us whether we are the
+             * master client now. If so, say how far we are. */
+            if (tftp_parse_oack(tc, (struct tftp_oack *) recbuf, reclen) < 0) {
+                fprintf(stderr, "\nBad option acknowledgement\n");
+                tftp_send_error(tc, ERR_OPTNEG);
+                return tftp_finish(tc, -1);
+            }
+
+            if (tc->mc_master) {
+                tftp_send_ack(tc);
+                tftp_timer_arm(tc, 1);
+                tc->winpos = 0;
+                tc->gap_acked = 0;
+            }
+            break;
+        }
+
+        /* The server accepted (some of) our options. Only valid
+         * as the reply to our request, anything later is a
+         * duplicate. A client has no business sending one. */
+        if (tc->blocknr != 0 || tc->server) {
+            tc->stats.dups++;
+            break;
+        }
+
+        if (tftp_parse_oack(tc, (struct tftp_oack *) recbuf, reclen) < 0) {
+            fprintf(stderr, "\nBad option acknowledgement\n");
+            tftp_send_error(tc, ERR_OPTNEG);
+            return tftp_finish(tc, -1);
+        }
+
+        tftp_timer_progress(tc);
+
+        log_info("Negotiated block size %d, window size %d\n",
+               tc->blksize, tc->windowsize);
+
+        tftp_size_bufs(tc, tc->sock);
+        if (tc->mc_sock >= 0)
+            tftp_size_bufs(tc, tc->mc_sock);
+
+        if (tc->type == TFTP_TYPE_GET) {
+            /* A resumed file is cut first, see tftp_resume() */
+            if (!tc->resume)
+                tftp_prealloc(tc);
+
+            /* Acknowledge the OACK with block 0, unless another
+             * client of the multicast group is master */
+            if (tc->mc_sock < 0 || tc->mc_master)
+                tftp_send_ack(tc);
+        } else {
+            tftp_send_window(tc);
+        }
+        tftp_timer_arm(tc, 1);
+        break;
+    case OPCODE_DATA:
+
+        /* Received data block, send ack */
+        if (tc->type == TFTP_TYPE_PUT) {
+            fprintf(stderr, "\nExpected ack, got data\n");
+            return tftp_finish(tc, -1);
+        }
+
+        if (tc->mc_sock >= 0) {
+            if ((terminate = tftp_mcast_data(tc, recbuf, reclen)) < 0)
+                return tftp_finish(tc, -1);
+            break;
+        }
+        int64_t nr = tftp_blocknr(ntohs(((u_int16_t*) recbuf)[1]), tc->blocknr + 1);
+
+        log_trace("We expect block number %lld, got %lld\n",
+                  (long long) tc->blocknr + 1, (long long) nr);
+
+        if (nr != tc->blocknr + 1) {
+            /* A gap or a duplicate. Tell the server where we are
+             * so it restarts the window from there (RFC 7440),
+             * but only once per gap or we would have it resend
+             * the window for every block still in flight. */
+            tc->stats.dups++;
+
+            if (nr <= tc->blocknr) {
+                /* A block we already have. In lock-step the ack
+                 * for it may have been lost (RFC 1350). In a window
+                 * an ack would read as a gap and have the server
+                 * resend what is in flight, and then again for
+                 * each of those blocks, so leave lost acks to our
+                 * timer. */
+                tc->stats.stale_data++;
+                if (tc->windowsize > 1)
+                    break;
+            }
+
+            if (!tc->gap_acked)
+                tftp_send_gap_ack(tc);
+            break;
+        }
+
+        tc->blocknr++;
+        tc->gap_acked = 0;
+        tftp_timer_progress(tc);
+
+        if (tc->blocknr == 1 && tc->resume && tftp_resume(tc) < 0) {
+            fprintf(stderr, "\nFailed to resume %s\n", tc->fname);
+            tftp_send_error(tc, 3);
+            return tftp_finish(tc, -1);
+        }
+
+        tc->stats.blocks++;
+        tc->stats.bytes += reclen - TFTP_DATA_HDR_LEN;
+
+        if (tc->write_block(tc, &recbuf[TFTP_DATA_HDR_LEN], reclen - TFTP_DATA_HDR_LEN) < 0) {
+            fprintf(stderr, "\nFailed to write %s\n", tc->fname);
+            tftp_send_error(tc, 3);
+            return tftp_finish(tc, -1);
+        }
+
+        /* If we are getting and recieved a data package with
+         * a block of < blksize, we want to terminate the loop
+         * after getting sending an ack. A server ignoring our
+         * options goes straight to block 1 and 512 byte blocks. */
+        if (reclen < MSGBUF_SIZE(tc->blksize))
+            terminate = 1;
+
+        /* Only the last block of each window is acknowledged */
+        if (terminate || ++tc->winpos >= tc->windowsize) {
+            tftp_send_ack(tc); //TODO: Kolla returvrdet
+            tftp_timer_arm(tc, 1);
+            tc->winpos = 0;
+        }
+
+        break;
+    case OPCODE_ACK:
+        if (tc->type == TFTP_TYPE_GET) {
+            fprintf(stderr, "\nExpected data, got ack\n");
+            return tftp_finish(tc, -1);
+        }
+
+        /* Multicast transfers stay below TFTP_MCAST_BLOCKS and the
+         * master client may ack from anywhere in one */
+        int64_t acked = tc->mc ? ntohs(((struct tftp_ack *) recbuf)->blocknr) :
+            tftp_blocknr(ntohs(((struct tftp_ack *) recbuf)->blocknr), tc->blocknr_acked);
+
+        if (tc->mc && (tc->mc->rewind || acked > tc->blocknr)) {
+            /* The master client of a multicast transfer says where
+             * it wants the blocks from: a new one from wherever it
+             * is, the current one past blocks it had already */
+            if (tftp_mcast_seek(tc, acked) < 0) {
+                tc->stats.dups++;
+                break;
+            }
+        } else if (acked < tc->blocknr_acked || acked > tc->blocknr) {
+            /* Ignore acks for blocks we have not sent or that are
+             * already covered by a later ack */
+            tc->stats.dups++;
+            break;
+        } else if (acked == tc->blocknr_acked && tc->blocknr > acked) {
+            /* A repeated ack. In a window it can mean the peer
+             * missed what followed (RFC 7440), but not in lock-step,
+             * nor if it comes sooner than a round trip after the
+             * window it would have resent, by the smoothed RTT or
+             * the timeout until there is one. Resending for those
+             * doubles the traffic for the rest of the transfer, the
+             * Sorcerer's Apprentice bug. Lost blocks are resent on
+             * timeout. */
+            tc->stats.dups++;
+
+            u_int64_t rtt = tc->srtt ? tc->srtt : tc->rto;
+
+            if (tc->windowsize == 1 || tftp_now() - tc->window_sent < rtt) {
+                tc->stats.dup_acks++;
+                break;
+            }
+        }
+
+        /* Time the ack by the block it acknowledges, if that went
+         * out only once (Karn). After a loss most acks are for part
+         * of a window, and without samples from those the timeout
+         * would stay backed off. A repeated ack answers no copy in
+         * particular. */
+        if (!tc->mc && tc->blocknr > 0)
+            tc->rtt_sent = acked > tc->blocknr_acked ?
+                tc->window_time[acked % tc->windowsize] : 0;
+
+        tc->blocknr_acked = acked;
+        tftp_timer_progress(tc);
+
+        /* If we are putting and the final short block has been
+         * acknowledged, we want to terminate the loop */
+        if (acked == tc->blocknr_last) {
+            terminate = 1;
+            log_debug("We're done sending, let's terminate\n");
+        } else {
+            /* Continue with the window after the acked block.
+             * Blocks the server missed are resent from it, in
+             * which case the answer can't be timed. */
+            int fresh = (tc->blocknr == tc->blocknr_acked);
+
+            tftp_send_window(tc);
+            tftp_timer_arm(tc, fresh);
+        }
+
+        break;
+    case OPCODE_ERR:
+        if (ntohs(((struct tftp_err *) recbuf)->errcode) == ERR_OPTNEG &&
+            tc->blocknr == 0 && tc->use_opts && !tc->server) {
+            /* The server refuses our options, ask again without
+             * them and live with 512 byte blocks */
+            log_info("Server refused options, retrying without\n");
+            tc->use_opts = 0;
+            tc->blksize = TFTP_BLOCK_SIZE;
+
+            /* The new request gets a new TID */
+            tftp_disconnect_peer(tc);
+            memcpy(&tc->peer_addr, &tc->server_addr, sizeof(tc->peer_addr));
+            tc->tid_locked = 0;
+
+            if (tc->type == TFTP_TYPE_GET)
+                tftp_send_rrq(tc);
+            else
+                tftp_send_wrq(tc);
+            tftp_timer_arm(tc, 1);
+            break;
+
+        }
+
+        /* The message need not be terminated */
+        log_error("The transfer was terminated with an error "
+                  "and the pitiful excuse given by the %s was: %.*s\n",
+                  tc->server ? "client" : "server",
+                  reclen - (int) TFTP_ERR_HDR_LEN, ((struct tftp_err*) recbuf)->errmsg);
+        return tftp_finish(tc, -1);
+    default:
+        fprintf(stderr, "\nUnknown message type\n");
+        return tftp_finish(tc, -1);
+
+    }
+
+    if (!terminate)
+        return 0;
+
+    if (tc->type == TFTP_TYPE_GET) {
+        /* The transfer is complete but the last ack might have been
+         * lost. Linger for a while and answer a duplicate of the
+         * last data block with the ack one more time */
+        tc->state = TFTP_STATE_LINGER;
+        tc->stats.end = tftp_now();
+        tc->deadline = tc->stats.end + TFTP_TIMEOUT * 1000000;
+
+        /* The last frame of a compressed file must be whole */
+        if (tc->lz_frame && tc->lz_pos) {
+            fprintf(stderr, "\nCompressed data of %s cut short\n", tc->fname);
+            return tftp_finish(tc, -1);
+        }
+
+        /* A CR ending the file in netascii mode */
+        if (tc->xlatbuf)
+            tftp_write_octet(tc, tc->xlatbuf, netascii_decode_finish(&tc->na, tc->xlatbuf));
+
+        /* Nothing more is written, let the file be complete now */
+        if (tftp_close_file(tc) < 0 ||
+            (tc->mc_sock >= 0 && tc->digest.alg != DIGEST_NONE && tftp_digest_file(tc) < 0)) {
+            fprintf(stderr, "\nFailed to write %s\n", tc->fname);
+            return tftp_finish(tc, -1);
+        }
+
+        /* Our last ack may still be lost, but the file is wrong
+         * whatever the server says */
+        if (tftp_digest_check(tc) < 0)
+            return tftp_finish(tc, -1);
+
+        tftp_complete(tc, 0);
+        return 0;
+    }
+
+    if (tftp_digest_check(tc) < 0)
+        return tftp_finish(tc, -1);
+
+    return tftp_finish(tc, 0);
+}
+
+/*
+  Whether a datagram from 'from' is part of the transfer. The first
+  reply to our request fixes the server's TID, its address and port,
+  for the rest of the transfer (RFC 1350). Datagrams from anywhere
+  else are counted and dropped, and answered with error 5 on 'sock'
+  unless it is -1, without disturbing the transfer.
+ */
+static int tftp_check_tid(struct tftp_conn *tc, const struct sockaddr_in *from,
+                          const char *msg, int len, int sock)
+{
+    if (!tc->tid_locked) {
+        memcpy(&tc->peer_addr, from, sizeof(tc->peer_addr));
+        tc->tid_locked = 1;
+        tftp_connect_peer(tc);
+        return 1;
+    }
+
+    if (tftp_same_addr(from, &tc->peer_addr))
+        return 1;
+
+    tc->stats.foreign++;
+    log_debug("Datagram from unknown TID %s:%d\n", inet_ntoa(from->sin_addr),
+              ntohs(from->sin_port));
+
+    /* Never answer an error with one */
+    if (sock >= 0 && len >= 2 && ntohs(((const struct tftp_msg *) msg)->opcode) != OPCODE_ERR)
+        tftp_reject(sock, from, 5);
+
+    return 0;
+}
+
+/*
+  Read messages from the server on 'sock' and take the necessary
+  action. The socket is drained in batches of up to 'batch' datagrams
+  and whatever we send in response goes out together after each
+  batch.
+ */
+static void tftp_recv_sock(struct tftp_conn *tc, int sock)
+{
+    /* Only the peer gets through a connected socket */
+    int filtered = tc->connected && sock == tc->sock;
+
+#ifdef OS_LINUX
+    int n, i;
+
+    do {
+        for (i = 0; i < tc->batch; i++) {
+            tc->rxq[i].msg_hdr.msg_name = filtered ? NULL : &tc->rxaddr[i];
+            tc->rxq[i].msg_hdr.msg_namelen = filtered ? 0 : sizeof(struct sockaddr_in);
+            tc->rxq[i].msg_hdr.msg_control = tc->rxctl + i * TFTP_RXCTL_SIZE;
+            tc->rxq[i].msg_hdr.msg_controllen = TFTP_RXCTL_SIZE;
+        }
+
+        /* Nothing more waiting, or an error such as ICMP port
+         * unreachable, which the retransmission timer deals with */
+        if ((n = recvmmsg(sock, tc->rxq, tc->batch, MSG_DONTWAIT, NULL)) <= 0)
+            break;
+
+        tc->rx_calls++;
+        tc->rx_msgs += n;
+
+        for (i = 0; i < n && tc->state != TFTP_STATE_DONE; i++) {
+            char *buf = tc->rxiov[i].iov_base;
+            int len = tc->rxq[i].msg_len;
+            int seg = len;
+            struct cmsghdr *cm;
+
+            /* With GRO this may be several data blocks in one go,
+             * each but the last one 'seg' bytes long */
+            for (cm = CMSG_FIRSTHDR(&tc->rxq[i].msg_hdr); cm;
+                 cm = CMSG_NXTHDR(&tc->rxq[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                    seg = *(int *) CMSG_DATA(cm);
+#ifdef SO_RXQ_OVFL
+                tftp_note_drops(tc, sock, cm);
+#endif
+            }
+
+            /* A multicast transfer only takes orders from its
+             * master client */
+            if (tc->mc && !tftp_same_addr(&tc->rxaddr[i], &tc->peer_addr)) {
+                tftp_mcast_other(tc, &tc->rxaddr[i], buf, len);
+                continue;
+            }
+
+            /* Group sockets can't answer strays */
+            if (!filtered && !tftp_check_tid(tc, &tc->rxaddr[i], buf, len,
+                                             sock == tc->sock ? sock : -1))
+                continue;
+
+            if (seg > 0 && seg < len) {
+                tc->gro_recvs++;
+                tc->gro_segs += (len + seg - 1) / seg;
+            } else {
+                seg = len;
+            }
+
+            for (; len > 0 && tc->state != TFTP_STATE_DONE; buf += seg, len -= seg)
+                tftp_handle(tc, buf, len < seg ? len : seg);
+        }
+
+        tftp_flush(tc);
+    } while (n == tc->batch && tc->state != TFTP_STATE_DONE);
+#else
+    /* Save the recieved bytes in 'rec_len' so we
+     * can check if we should terminate the transfer */
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    int reclen;
+
+    if (filtered)
+        reclen = recv(sock, tc->recbuf, tc->msgbuf_size, MSG_DONTWAIT);
+    else
+        reclen = recvfrom(sock, tc->recbuf, tc->msgbuf_size, MSG_DONTWAIT,
+                          (struct sockaddr *) &from, &fromlen);
+
+    if (reclen >= 0) {
+        tc->rx_calls++;
+        tc->rx_msgs++;
+        if (filtered || tftp_check_tid(tc, &from, tc->recbuf, reclen,
+                                       sock == tc->sock ? sock : -1))
+            tftp_handle(tc, tc->recbuf, reclen);
+    }
+#endif
+}
+
+/*
+  Read messages from the server and take the necessary action. Call
+  when the socket, or that of the multicast group, is readable.
+  Returns negative if the transfer failed.
+ */
+int tftp_recv(struct tftp_conn *tc)
+{
+    tftp_recv_sock(tc, tc->sock);
+
+    if (tc->mc_sock >= 0 && tc->state != TFTP_STATE_DONE)
+        tftp_recv_sock(tc, tc->mc_sock);
+
+    return tc->state == TFTP_STATE_DONE ? tc->retval : 0;
+}
+
+/*
+  Transfer a file to or from the server.
+
+ */
+int tftp_transfer(struct tftp_conn *tc)
+{
+    struct timeval timeout;
+    u_int64_t now;
+    fd_set sfd;
+    int maxfd;
+
+    if (tftp_start(tc) < 0)
+        return -1;
+
+    /*
+      Put or get the file, block by block, in a loop.
+     */
+    while (tc->state != TFTP_STATE_DONE) {
+        /* Wait for something from the server (using 'select')
+         * until the retransmission deadline. */
+        log_trace("Waiting for response...\n");
+
+        FD_ZERO(&sfd);
+        FD_SET(tc->sock, &sfd);
+        maxfd = tc->sock;
+
+        /* Blocks of a multicast transfer come from the group */
+        if (tc->mc_sock >= 0) {
+            FD_SET(tc->mc_sock, &sfd);
+            if (tc->mc_sock > maxfd)
+                maxfd = tc->mc_sock;
+        }
+
+        now = tftp_now();
+        if (now > tc->deadline)
+            now = tc->deadline;
+        timeout.tv_sec = (tc->deadline - now) / 1000000;
+        timeout.tv_usec = (tc->deadline - now) % 1000000;
+
+        switch (select(maxfd + 1, &sfd, NULL, NULL, &timeout)) {
+        case (-1):
+            if (errno == EINTR)
+                break;
+            fprintf(stderr, "\nselect()\n");
+            return tftp_finish(tc, -1);
+        case (0):
+            tftp_timeout(tc);
+            break;
+        default:
+            tftp_recv(tc);
+            break;
+        }
+    }
+
+    return tc->retval;
+}
+
+int tftp_fd(const struct tftp_conn *tc)
+{
+    return tc->sock;
+}
+
+int tftp_timeout_ms(const struct tftp_conn *tc)
+{
+    u_int64_t now = tftp_now();
+
+    if (tc->state == TFTP_STATE_DONE)
+        return -1;
+
+    return tc->deadline > now ? (tc->deadline - now + 999) / 1000 : 0;
+}
+
+/*
+  Step a transfer started with tftp_start() along from the caller's
+  event loop, when tftp_fd() is readable or tftp_timeout_ms() has
+  passed. Never blocks.
+ */
+int tftp_step(struct tftp_conn *tc)
+{
+    if (tc->state != TFTP_STATE_DONE)
+        tftp_recv(tc);
+
+    if (tc->state != TFTP_STATE_DONE && tftp_now() >= tc->deadline)
+        tftp_timeout(tc);
+
+    if (tc->state != TFTP_STATE_DONE)
+        return 1;
+
+    return tc->retval;
+}
+
+const struct tftp_stats *tftp_get_stats(const struct tftp_conn *tc)
+{
+    return &tc->stats;
+}
+
+#ifdef OS_LINUX
+/* What a completion is for, in the upper half of its user_data. The
+ * lower half is the window slot of a read or send. */
+#define TFTP_URING_RECV 1
+#define TFTP_URING_SEND 2
+#define TFTP_URING_READ 3
+
+#define TFTP_URING_BGID 0
+
+/*
+  Set up io_uring for a transfer: a multishot receive into provided
+  buffers and, when putting in octet mode, the window registered for
+  fixed reads, so every block is a read linked to a send. Returns
+  negative if io_uring can't be used.
+ */
+static int tftp_uring_init(struct tftp_conn *tc)
+{
+    struct uring *u;
+    unsigned int entries = 16;
+    unsigned int nbufs = 16;
+    /* Reads by offset need a file, callbacks are called in line. A
+     * digest needs the blocks in order, as tftp_read_octet() has them. */
+    int octet_put = tc->type == TFTP_TYPE_PUT && tc->read_block == tftp_read_octet && tc->fp &&
+        tc->digest.alg == DIGEST_NONE && !tc->lz_req;
+    struct stat st;
+
+    /* A read and a send for every block in the window, plus resends */
+    while (entries < 2 * (unsigned int) tc->windowsize_req + 16)
+        entries <<= 1;
+    while (nbufs < (unsigned int) tc->batch)
+        nbufs <<= 1;
+
+    /* The ring only receives on the unicast socket */
+    if (tc->mc_req) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (!(u = calloc(1, sizeof(*u))))
+        return -1;
+
+    if (uring_init(u, entries) < 0) {
+        free(u);
+        return -1;
+    }
 
-    struct tftp_rrq *rrq;
+    tc->uring = u;
 
-    if((rrq = malloc(reqlen)) == NULL)
+    if (uring_bufs_init(u, TFTP_URING_BGID, nbufs, sizeof(struct io_uring_recvmsg_out) +
+                        sizeof(struct sockaddr_in) + TFTP_RXCTL_SIZE + tc->msgbuf_size) < 0)
         return -1;
 
-    rrq->opcode = htons(OPCODE_RRQ);
-
-    strcpy (&rrq->req[0], tc->fname);
-    strcpy (&rrq->req[strlen(tc->fname) + 1], tc->mode);
+    if (octet_put) {
+        struct iovec iov;
 
-    // Save the message in the msgbuffer
-    memcpy(tc->msgbuf, rrq, reqlen);
+        iov.iov_base = tc->window;
+        iov.iov_len = tc->windowsize_req * tc->msgbuf_size;
 
-    size_t size = sendto(tc->sock, rrq, reqlen, 0, (struct sockaddr *) &tc->peer_addr, tc->addrlen);
+        if (fstat(fileno(tc->fp), &st) < 0 || uring_register_buffers(u, &iov, 1) < 0)
+            return -1;
 
-    free(rrq);
+        tc->file_size = st.st_size;
+        tc->slot_msg = calloc(tc->windowsize_req, sizeof(struct msghdr));
+        tc->slot_iov = calloc(tc->windowsize_req, sizeof(struct iovec));
+        tc->slot_busy = calloc(tc->windowsize_req, 1);
 
-    print_message((struct tftp_msg *) tc->msgbuf, 0);
+        if (!tc->slot_msg || !tc->slot_iov || !tc->slot_busy)
+            return -1;
+    }
 
-    return size;
+    return 0;
 }
-/*
 
-  Send a write request to the server.
-  1. Format message.
-  2. Send the request using the connection handle.
-  3. Return the number of bytes sent, or negative on error.
- */
-int tftp_send_wrq(struct tftp_conn *tc)
+/* Tear down what tftp_uring_init() set up, if anything */
+static void tftp_uring_free(struct tftp_conn *tc)
 {
+    if (tc->uring) {
+        uring_free(tc->uring);
+        free(tc->uring);
+        tc->uring = NULL;
+    }
+    free(tc->slot_msg);
+    free(tc->slot_iov);
+    free(tc->slot_busy);
+    tc->slot_msg = NULL;
+    tc->slot_iov = NULL;
+    tc->slot_busy = NULL;
+}
 
-    int reqlen = TFTP_WRQ_LEN(tc->fname, tc->mode);
-
-    struct tftp_wrq *wrq;
-    if((wrq = malloc(reqlen)) == NULL)
-        return -1;
-
-    wrq->opcode = htons(OPCODE_WRQ);
+/* A submission, making room by submitting what is queued if need be */
+static struct io_uring_sqe *tftp_uring_sqe(struct tftp_conn *tc)
+{
+    struct io_uring_sqe *sqe = uring_sqe(tc->uring);
 
-    strcpy (&wrq->req[0], tc->fname);
-    strcpy (&wrq->req[strlen(tc->fname) + 1], tc->mode);
+    if (!sqe && uring_submit(tc->uring) >= 0)
+        sqe = uring_sqe(tc->uring);
 
-    // Save the message in the msgbuffer
-    memcpy(tc->msgbuf, wrq, reqlen);
+    return sqe;
+}
 
-    size_t size = sendto(tc->sock, wrq, reqlen, 0, (struct sockaddr *) &tc->peer_addr, tc->addrlen);
+/* (Re)arm the multishot receive */
+static int tftp_uring_recv(struct tftp_conn *tc)
+{
+    struct io_uring_sqe *sqe = tftp_uring_sqe(tc);
 
-    printf("SENT WRQ\n");
+    if (!sqe)
+        return -1;
 
-    free(wrq);
+    tc->uring_rxmsg.msg_namelen = sizeof(struct sockaddr_in);
+    tc->uring_rxmsg.msg_controllen = TFTP_RXCTL_SIZE;
 
-    print_message((struct tftp_msg *) tc->msgbuf, 0);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = tc->sock;
+    sqe->addr = (unsigned long) &tc->uring_rxmsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TFTP_URING_BGID;
+    sqe->user_data = (u_int64_t) TFTP_URING_RECV << 32;
 
-    return size;
+    return 0;
 }
 
-
 /*
-  Acknowledge reception of a block.
-  1. Format message.
-  2. Send the acknowledgement using the connection handle.
-  3. Return the number of bytes sent, or negative on error.
+  Queue the data block in window slot 'slot', its header already
+  there: a fixed read of 'len' bytes of the file right behind the
+  header, linked to the send of the whole message. Nothing passes
+  through our hands but the header.
  */
-int tftp_send_ack(struct tftp_conn *tc)
+static int tftp_uring_send_block(struct tftp_conn *tc, int slot, int len)
 {
-    struct tftp_ack *ack;
-    if((ack = malloc(TFTP_ACK_HDR_LEN)) == NULL)
+    char *msg = tc->window + slot * tc->msgbuf_size;
+    struct msghdr *mh = &tc->slot_msg[slot];
+    struct io_uring_sqe *sqe;
+
+    if (len > 0) {
+        if (!(sqe = tftp_uring_sqe(tc)))
+            return -1;
+
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = fileno(tc->fp);
+        sqe->addr = (unsigned long) (msg + TFTP_DATA_HDR_LEN);
+        sqe->len = len;
+        sqe->off = tc->file_off;
+        sqe->buf_index = 0;
+        /* Only a failed read is worth a completion. A short one
+         * breaks the link too. */
+        sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = (u_int64_t) TFTP_URING_READ << 32 | slot;
+    }
+
+    if (!(sqe = tftp_uring_sqe(tc)))
         return -1;
 
-    ack->opcode = htons(OPCODE_ACK);
-    ack->blocknr = htons(tc->blocknr);
+    tc->slot_iov[slot].iov_base = msg;
+    tc->slot_iov[slot].iov_len = TFTP_DATA_HDR_LEN + len;
+    mh->msg_name = tc->connected ? NULL : &tc->peer_addr;
+    mh->msg_namelen = tc->connected ? 0 : tc->addrlen;
+    mh->msg_iov = &tc->slot_iov[slot];
+    mh->msg_iovlen = 1;
 
-    memcpy(tc->msgbuf, ack, TFTP_ACK_HDR_LEN);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = tc->sock;
+    sqe->addr = (unsigned long) mh;
+    sqe->len = 1;
+    sqe->user_data = (u_int64_t) TFTP_URING_SEND << 32 | slot;
 
-    size_t size = sendto(tc->sock, ack, TFTP_ACK_HDR_LEN, 0, (struct sockaddr *) &tc->peer_addr, tc->addrlen);
+    tc->file_off += len;
+    tc->slot_busy[slot] = 1;
+    tc->uring_sends++;
 
-    free(ack);
+    return TFTP_DATA_HDR_LEN + len;
+}
 
-    print_message((struct tftp_msg *) tc->msgbuf, 0);
+/* Take a received datagram out of provided buffer 'bid' */
+static void tftp_uring_handle(struct tftp_conn *tc, unsigned int bid, int res)
+{
+    char *buf = uring_buf(tc->uring, bid);
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+    char *payload = buf + sizeof(*out) + tc->uring_rxmsg.msg_namelen +
+        tc->uring_rxmsg.msg_controllen;
+
+    tc->rx_msgs++;
+
+    if (res >= (int) sizeof(*out) && !(out->flags & MSG_TRUNC) &&
+        tc->state != TFTP_STATE_DONE) {
+#ifdef SO_RXQ_OVFL
+        struct msghdr mh;
+        struct cmsghdr *cm;
+
+        /* Just enough of a header to walk the control messages */
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = buf + sizeof(*out) + tc->uring_rxmsg.msg_namelen;
+        mh.msg_controllen = out->controllen;
+
+        for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+            tftp_note_drops(tc, tc->sock, cm);
+#endif
+
+        if (out->namelen >= sizeof(tc->peer_addr) &&
+            tftp_check_tid(tc, (struct sockaddr_in *) (buf + sizeof(*out)), payload,
+                           out->payloadlen, tc->sock))
+            tftp_handle(tc, payload, out->payloadlen);
+    }
 
-    return size;
+    uring_buf_recycle(tc->uring, bid);
 }
 
 /*
-  Send a data block to the other side.
-  1. Format message.
-  2. Add data block to message according to length argument.
-  3. Send the data block message using the connection handle.
-  4. Return the number of bytes sent, or negative on error.
-
-  TIP: You need to be able to resend data in case of a timeout. When
-  resending, the old message should be sent again and therefore no
-  new message should be created. This can, for example, be handled by
-  passing a negative length indicating that the creation of a new
-  message should be skipped.
+  Transfer a file to or from the server like tftp_transfer(), with
+  io_uring instead of select(). Datagrams come in through a multishot
+  receive and blocks go out as linked reads and sends, so a window
+  costs about one system call. Falls back to tftp_transfer() if
+  io_uring is not available.
  */
-int tftp_send_data(struct tftp_conn *tc, int length)
+int tftp_transfer_uring(struct tftp_conn *tc)
 {
-    //TODO: Det hr borde snyggas upp, ska length vara med eller utan headern?
-    struct tftp_data *tdata;
-    int length_real = abs(length);
-    int	dataplen = TFTP_DATA_HDR_LEN + BLOCK_SIZE;
+    struct io_uring_cqe *cqe;
 
-    if((tdata = malloc(dataplen)) == NULL)
+    if (tftp_uring_init(tc) < 0) {
+        log_info("io_uring not available (%s), using select\n", strerror(errno));
+        tftp_uring_free(tc);
+        return tftp_transfer(tc);
+    }
+
+    if (tftp_start(tc) < 0)
         return -1;
 
-    if (length < 0) {
+    if (tftp_uring_recv(tc) < 0)
+        return tftp_finish(tc, -1);
 
-        dataplen = length_real;
+    while (tc->state != TFTP_STATE_DONE) {
+        int rx = 0;
 
-        /* Resend old data block */
-        printf("Resending .. \n");
-        memcpy(tdata, tc->msgbuf, dataplen);
+        if (tc->uring_sends)
+            tc->tx_calls++;
+        tc->uring_sends = 0;
 
-    } else {
+        if (uring_enter(tc->uring, (long long) tc->deadline - (long long) tftp_now()) < 0 &&
+            errno != EINTR) {
+            fprintf(stderr, "\nio_uring_enter()\n");
+            return tftp_finish(tc, -1);
+        }
 
-        int i = 0;
-        int hnllen = sizeof(HOST_NEWLINE_STYLE) - 1;
-        int nanllen = sizeof(NETASCII_NEWLINE_STYLE) - 1;
+        while ((cqe = uring_cqe(tc->uring)) != NULL) {
+            int kind = cqe->user_data >> 32;
+            int slot = cqe->user_data & 0xffffffff;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
 
-        /* Create new data block */
-        printf("Not resending.. \n");
-        tc->blocknr++;
+            uring_cqe_seen(tc->uring);
 
-        tdata->opcode = htons(OPCODE_DATA);
-        tdata->blocknr = htons(tc->blocknr);
+            switch (kind) {
+            case TFTP_URING_RECV:
+                if (flags & IORING_CQE_F_BUFFER) {
+                    tftp_uring_handle(tc, flags >> IORING_CQE_BUFFER_SHIFT, res);
+                    rx = 1;
+                }
 
-        if (!strcmp(tc->mode, MODE_NETASCII)) {
-            while ((fread(&tdata->data[i], 1, 1, tc->fp)) && i <= length_real) {
+                /* Out of buffers or some such, start over */
+                if (!(flags & IORING_CQE_F_MORE) && tc->state != TFTP_STATE_DONE &&
+                    tftp_uring_recv(tc) < 0)
+                    return tftp_finish(tc, -1);
+                break;
+            case TFTP_URING_SEND:
+                tc->slot_busy[slot] = 0;
+                if (res >= 0)
+                    tc->tx_msgs++;
+                break;
+            case TFTP_URING_READ:
+                fprintf(stderr, "\nFailed to read %s\n", tc->fname);
+                tftp_send_error(tc, 0);
+                return tftp_finish(tc, -1);
+            }
+        }
 
-                if (i >= hnllen) {
-                    if (!strncmp(&tdata->data[i - hnllen + 1], HOST_NEWLINE_STYLE, hnllen)) {
-                        /* Host newline found, update to netascii newline
-                         * and update i acordingly */
+        if (rx)
+            tc->rx_calls++;
 
-                        if (i == BLOCK_SIZE && (nanllen - hnllen) == 1) {
+        tftp_flush(tc);
 
-                            /* Corner case, the buffer is full but we would
-                             * still like to but another char in it, put it
-                             * in the stream instead */
-                            tdata->data[i] = NETASCII_NEWLINE_STYLE[0];
-                            ungetc(NETASCII_NEWLINE_STYLE[1], tc->fp);
+        if (tc->state != TFTP_STATE_DONE && tftp_now() >= tc->deadline)
+            tftp_timeout(tc);
+    }
 
-                        } else {
+    return tc->retval;
+}
+#endif
 
-                            strncpy(&tdata->data[i - hnllen + 1], NETASCII_NEWLINE_STYLE, nanllen);
-                            i = i + (nanllen - hnllen);
+/* Allow as many descriptors as we may, we use one per transfer */
+static void tftp_raise_nofile(void)
+{
+    struct rlimit rl;
 
-                        }
-                    }
-                }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
 
-                i++;
-            }
+#ifdef OS_LINUX
+/*
+  The transfers or sessions of an event loop, in a binary heap by
+  their retransmission deadline, the nearest first. A wakeup then
+  only looks at those that are due. Each knows its place in the heap,
+  which is fixed up after anything that may have moved its deadline.
+ */
+struct tftp_timers {
+    struct tftp_conn **heap;
+    int n;
+    int max;
+};
 
-            /* set length_real to i in case we read < the wanted bytes */
-            length_real = i;
+static void tftp_timers_set(struct tftp_timers *t, int i, struct tftp_conn *tc)
+{
+    t->heap[i] = tc;
+    tc->timer_pos = i;
+}
 
-        } else {
-            length_real = fread(tdata->data, 1, length_real, tc->fp);
-        }
+/* Move 'tc' to its place after its deadline changed */
+static void tftp_timers_update(struct tftp_timers *t, struct tftp_conn *tc)
+{
+    int i = tc->timer_pos;
 
+    while (i > 0 && tc->deadline < t->heap[(i - 1) / 2]->deadline) {
+        tftp_timers_set(t, i, t->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
 
+    for (;;) {
+        int c = 2 * i + 1;
 
-        //tdata->data[length_real] = '\0';
+        if (c >= t->n)
+            break;
+        if (c + 1 < t->n && t->heap[c + 1]->deadline < t->heap[c]->deadline)
+            c++;
+        if (tc->deadline <= t->heap[c]->deadline)
+            break;
+        tftp_timers_set(t, i, t->heap[c]);
+        i = c;
+    }
 
-        printf("Extracted data %s \n", tdata->data);
+    tftp_timers_set(t, i, tc);
+}
 
-        /* Recalculate the package length in case we only was able to
-         * read less than 'length_real' bytes from the file */
-        dataplen = TFTP_DATA_HDR_LEN + length_real;
-        memcpy((struct tftp_msg *) tc->msgbuf, tdata, dataplen);
-        printf("This is our packet: %s \n",tc->msgbuf);
+/* Returns negative if out of memory */
+static int tftp_timers_add(struct tftp_timers *t, struct tftp_conn *tc)
+{
+    if (t->n == t->max) {
+        int max = t->max ? 2 * t->max : 64;
+        struct tftp_conn **heap = realloc(t->heap, max * sizeof(*heap));
+
+        if (!heap)
+            return -1;
+        t->heap = heap;
+        t->max = max;
     }
 
-    size_t size = sendto(tc->sock, tdata, dataplen, 0, (struct sockaddr *) &tc->peer_addr, tc->addrlen);
+    tftp_timers_set(t, t->n++, tc);
+    tftp_timers_update(t, tc);
+
+    return 0;
+}
+
+static void tftp_timers_del(struct tftp_timers *t, struct tftp_conn *tc)
+{
+    int i = tc->timer_pos;
+
+    if (i < --t->n) {
+        tftp_timers_set(t, i, t->heap[t->n]);
+        tftp_timers_update(t, t->heap[i]);
+    }
+}
 
-    printf("Sent %zu bytes of data \n",size);
+/* Milliseconds until the nearest deadline, for epoll_wait() */
+static int tftp_timers_wait(const struct tftp_timers *t)
+{
+    u_int64_t now;
 
-    free(tdata);
+    if (t->n == 0)
+        return -1;
 
-    print_message((struct tftp_msg *)tc->msgbuf, 0);
+    now = tftp_now();
 
-    return size;
+    return t->heap[0]->deadline > now ? (t->heap[0]->deadline - now + 999) / 1000 : 0;
 }
 
-int tftp_send_error(struct tftp_conn *tc, int errcode)
+/*
+  A transfer of tftp_batch() handled a message or a timeout. Close it
+  if it is done, or move its timer. Returns 1 if it was closed.
+ */
+static int tftp_batch_check(struct tftp_timers *t, int epfd, struct tftp_conn *tc,
+                            struct tftp_stats *stats, int *failed)
 {
+    if (tc->state != TFTP_STATE_DONE) {
+        tftp_timers_update(t, tc);
+        return 0;
+    }
 
-    struct tftp_err *err;
+    if (tc->retval < 0) {
+        fprintf(stderr, "%s: file transfer failed!\n", tc->fname);
+        (*failed)++;
+    } else {
+        log_info("%s: done\n", tc->fname);
+    }
 
-    char * errmsg = tftp_err_to_str(errcode);
+    tftp_stats_add(stats, &tc->stats);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, tc->sock, NULL);
+    tftp_timers_del(t, tc);
+    tftp_close(tc);
 
-    size_t errlen = TFTP_ERR_HDR_LEN + strlen(errmsg) + 1;
+    return 1;
+}
 
-    if((err = malloc(errlen)) == NULL)
-        return -1;
+/*
+  Run many transfers concurrently in one process. At most
+  'concurrency' transfers are in progress at any time, each with its
+  own socket and retransmission timer, all waited on with one
+  epoll set. Connections are only opened when a transfer is started
+  so the number of descriptors in use stays bounded. A get that is
+  only lingering for a lost final ack is complete and makes room for
+  the next transfer, but keeps its socket until it is done. The statistics
+  of all transfers are added to 'stats'. Returns the number of failed
+  transfers.
+ */
+int tftp_batch(struct tftp_job *jobs, int njobs, int concurrency,
+               char *mode, const struct tftp_params *params,
+               struct tftp_stats *stats)
+{
+    struct tftp_timers timers = { NULL, 0, 0 };
+    struct epoll_event *events;
+    int nbusy = 0; /* Of the active ones, those not lingering */
+    int next = 0;
+    int failed = 0;
+    int epfd;
+    int i;
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "Could not create epoll instance!\n");
+        return njobs;
+    }
 
-    err->opcode = htons(OPCODE_ERR);
-    err->errcode = htons(errcode);
-    strcpy(&err->errmsg[0],errmsg);
+    tftp_raise_nofile();
 
-    memcpy(tc->msgbuf, err, errlen);
+    events = calloc(concurrency, sizeof(struct epoll_event));
 
-    size_t size = sendto(tc->sock, err, errlen, 0, (struct sockaddr *) &tc->peer_addr, tc->addrlen);
+    if (!events) {
+        fprintf(stderr, "Out of memory!\n");
+        close(epfd);
+        return njobs;
+    }
 
-    free(err);
+    while (next < njobs || timers.n > 0) {
+        u_int64_t now;
+        int nev;
 
-    print_message((struct tftp_msg *) tc->msgbuf, 0);
+        /* Start new transfers up to the concurrency limit */
+        while (nbusy < concurrency && next < njobs) {
+            struct tftp_job *job = &jobs[next++];
+            struct epoll_event ev;
+            struct tftp_conn *tc;
 
-    return size;
+            tc = tftp_connect(job->type, job->fname, mode,
+                              job->hostname, params);
 
-}
+            if (tc && job->digest && tftp_expect_digest(tc, job->digest) < 0) {
+                tftp_close(tc);
+                tc = NULL;
+            }
 
-/*
-  Transfer a file to or from the server.
+            if (!tc) {
+                fprintf(stderr, "%s: failed to connect!\n", job->fname);
+                stats->transfers++;
+                stats->failed++;
+                failed++;
+                continue;
+            }
 
- */
-int tftp_transfer(struct tftp_conn *tc)
-{
-    int retval = 0;
-    int len;
-    int reclen;
-    int totlen = 0;
-    int terminate = 0;
+            ev.events = EPOLLIN;
+            ev.data.ptr = tc;
 
-    struct timeval timeout;
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, tc->sock, &ev) < 0 ||
+                tftp_start(tc) < 0 || tftp_timers_add(&timers, tc) < 0) {
+                fprintf(stderr, "%s: failed to start transfer!\n", job->fname);
+                tftp_stats_add(stats, &tc->stats);
+                failed++;
+                tftp_close(tc);
+                continue;
+            }
 
+            nbusy++;
+        }
 
-    /* Sanity check */
-    if (!tc)
-        return -1;
+        if (timers.n == 0)
+            continue;
 
+        /* Sleep until something arrives or the nearest
+         * retransmission deadline */
+        nev = epoll_wait(epfd, events, concurrency, tftp_timers_wait(&timers));
 
-    fd_set sfd;
-    char recbuf[MSGBUF_SIZE];
+        if (nev < 0 && errno != EINTR) {
+            fprintf(stderr, "\nepoll_wait()\n");
+            break;
+        }
 
-    FD_ZERO(&sfd);
-    FD_SET(tc->sock, &sfd);
+        for (i = 0; i < nev; i++) {
+            struct tftp_conn *tc = events[i].data.ptr;
+            int busy = tc->state == TFTP_STATE_XFER;
 
+            tftp_recv(tc);
 
+            if (busy && tc->state != TFTP_STATE_XFER)
+                nbusy--;
+            tftp_batch_check(&timers, epfd, tc, stats, &failed);
+        }
 
-    len = BLOCK_SIZE + TFTP_DATA_HDR_LEN;
-    reclen = 0;
+        /* Fire expired timers, each session's next deadline lies
+         * ahead of 'now' */
+        now = tftp_now();
 
-    /* After the connection request we should start receiving data
-     * immediately */
+        while (timers.n > 0 && now >= timers.heap[0]->deadline) {
+            struct tftp_conn *tc = timers.heap[0];
+            int busy = tc->state == TFTP_STATE_XFER;
 
-    /* Set a timeout for resending data. */
+            tftp_timeout(tc);
 
-    timeout.tv_sec = TFTP_TIMEOUT;
-    timeout.tv_usec = 0;
+            if (busy && tc->state != TFTP_STATE_XFER)
+                nbusy--;
+            tftp_batch_check(&timers, epfd, tc, stats, &failed);
+        }
+    }
 
-    /* Check if we are putting a file or getting a file and send
-     * the corresponding request. */
+    /* Only left over if epoll failed */
+    for (i = 0; i < timers.n; i++) {
+        failed++;
+        tftp_close(timers.heap[i]);
+    }
 
-    if (tc->type == TFTP_TYPE_GET) {
-        /* Send read request */
-        if(tftp_send_rrq(tc) < 0)
-            fprintf(stderr,"FAIL TO SEND RRQ\n");
+    stats->transfers += timers.n + (njobs - next);
+    stats->failed += timers.n + (njobs - next);
 
-    } else if (tc->type == TFTP_TYPE_PUT) {
-        /* Send write request */
-        if(tftp_send_wrq(tc) < 0)
-            fprintf(stderr,"FAIL TO SEND WRQ\n");
+    free(timers.heap);
+    free(events);
+    close(epfd);
 
-    } else {
-        return -1;
+    return failed + (njobs - next);
+}
+#else
+/* No epoll, run the transfers one at a time */
+int tftp_batch(struct tftp_job *jobs, int njobs, int concurrency,
+               char *mode, const struct tftp_params *params,
+               struct tftp_stats *stats)
+{
+    int failed = 0;
+    int i;
+
+    for (i = 0; i < njobs; i++) {
+        struct tftp_conn *tc = tftp_connect(jobs[i].type, jobs[i].fname, mode,
+                                            jobs[i].hostname, params);
+
+        if (!tc || (jobs[i].digest && tftp_expect_digest(tc, jobs[i].digest) < 0) ||
+            tftp_transfer(tc) < 0) {
+            fprintf(stderr, "%s: file transfer failed!\n", jobs[i].fname);
+            failed++;
+        }
+
+        if (tc) {
+            tftp_stats_add(stats, &tc->stats);
+            tftp_close(tc);
+        } else {
+            stats->transfers++;
+            stats->failed++;
+        }
     }
 
+    return failed;
+}
+#endif
 
-    /*
-      Put or get the file, block by block, in a loop.
-     */
-    do {
-        /* 1. Wait for something from the server (using
-         * 'select'). If a timeout occurs, resend last block
-         * or ack depending on whether we are in put or get
-         * mode. */
+#ifdef OS_LINUX
+/*
+  The sessions of a worker by client address and port, so a request
+  finds the session of its client without looking at the others.
+  Chained, with as many buckets as sessions at least.
+ */
+struct tftp_peers {
+    struct tftp_conn **table;
+    unsigned int size; /* Buckets, a power of two */
+    unsigned int n;
+};
 
-        /* ... */
-        printf("Waiting for response... \n");
+static u_int64_t tftp_peer_key(const struct sockaddr_in *peer)
+{
+    return (u_int64_t) peer->sin_addr.s_addr << 16 | peer->sin_port;
+}
 
-        FD_ZERO(&sfd);
-        FD_SET(tc->sock, &sfd);
+/* Fibonacci hashing, the upper half of the product is well mixed */
+static unsigned int tftp_peer_bucket(u_int64_t key, unsigned int size)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> 32 & (size - 1);
+}
 
-        switch (select(tc->sock + 1, &sfd, NULL, NULL, &timeout)) {
-        case (-1):
-            fprintf(stderr, "\nselect()\n");
-            break;
-        case (0):
-            /* Timeout, reinit the counter and do a resend.
-             * Nested switch-case statemens are awesome! */
+/* The session of a client, if it has one */
+static struct tftp_conn *tftp_peers_find(const struct tftp_peers *p,
+                                         const struct sockaddr_in *peer)
+{
+    u_int64_t key = tftp_peer_key(peer);
+    struct tftp_conn *tc;
 
-            printf("**** TIMEOUT *****\n");
-            timeout.tv_sec = TFTP_TIMEOUT;
-            timeout.tv_usec = 0;
+    if (p->n == 0)
+        return NULL;
 
-            switch (ntohs(((u_int16_t*) tc->msgbuf)[0])) {
-            case OPCODE_RRQ:
-                tftp_send_rrq(tc);
-                continue;
-            case OPCODE_WRQ:
-                tftp_send_wrq(tc);
-                continue;
-            case OPCODE_DATA:
-                tftp_send_data(tc, -len);
-                continue;
-            case OPCODE_ACK:
-                tftp_send_ack(tc);
-                continue;
-            case OPCODE_ERR:
-                //TODO: Vilka error-medelanden ska skickas om, om ngra?
-                continue;
-            default:
-                fprintf(stderr, "\nThis shouldn't happend\n");
-                goto out;
-                //continue;
-            }
-            break;
-        default:
-            //TODO: Anvnda recvfrom() istllet och kolla efter felaktig source port.
+    for (tc = p->table[tftp_peer_bucket(key, p->size)]; tc && tc->peer_key != key; tc = tc->hnext)
+        ;
 
-            /* Save the recieved bytes in 'rec_len' so we
-             * can check if we should terminate the transfer */
+    return tc;
+}
 
-            printf("GOT SOMETHING!!!!\n");
-            reclen = recvfrom(tc->sock, recbuf, MSGBUF_SIZE,0, (struct sockaddr *)  &tc->peer_addr, &tc->addrlen);
-            print_message((struct tftp_msg *)recbuf, 1);
-            //printf("%d\n", ntohs(((u_int16_t*) recbuf)[0]));
-            break;
-        }
+/* Returns negative if out of memory */
+static int tftp_peers_add(struct tftp_peers *p, struct tftp_conn *tc)
+{
+    unsigned int b;
 
-        /* 2. Check the message type and take the necessary
-         * action. */
-        switch (ntohs(((u_int16_t*) recbuf)[0])) {
-        case OPCODE_DATA:
+    if (p->n == p->size) {
+        unsigned int size = p->size ? 2 * p->size : 64;
+        struct tftp_conn **table = calloc(size, sizeof(*table));
+        unsigned int i;
 
-            /* Received data block, send ack */
-            //TODO: Skriv datan till en fil
-            printf("Received data\n");
-            tc->blocknr++;
-            if (tc->type == TFTP_TYPE_PUT) {
-                fprintf(stderr, "\nExpected ack, got data\n");
-                goto out;
-            }
-            printf("We expect block number %d\n", tc->blocknr);
-            printf("We got block number %d\n",ntohs(((u_int16_t*) recbuf)[1]));
+        if (!table)
+            return -1;
+
+        for (i = 0; i < p->size; i++) {
+            while (p->table[i]) {
+                struct tftp_conn *c = p->table[i];
 
-            if (ntohs(((u_int16_t*) recbuf)[1]) != tc->blocknr) {
-                fprintf(stderr, "\nGot unexpected data block nr\n");
-                goto out;
+                p->table[i] = c->hnext;
+                b = tftp_peer_bucket(c->peer_key, size);
+                c->hnext = table[b];
+                table[b] = c;
             }
+        }
 
+        free(p->table);
+        p->table = table;
+        p->size = size;
+    }
 
-            /* If we are getting and recieved a data package with
-             * a block of < 512, we want to terminate the loop
-             * after getting sending an ack */
-            if (reclen < (TFTP_DATA_HDR_LEN + BLOCK_SIZE))
-                terminate = 1;
+    tc->peer_key = tftp_peer_key(&tc->peer_addr);
+    b = tftp_peer_bucket(tc->peer_key, p->size);
+    tc->hnext = p->table[b];
+    p->table[b] = tc;
+    p->n++;
 
-            tftp_send_ack(tc); //TODO: Kolla returvrdet
+    return 0;
+}
+
+static void tftp_peers_del(struct tftp_peers *p, struct tftp_conn *tc)
+{
+    struct tftp_conn **pp = &p->table[tftp_peer_bucket(tc->peer_key, p->size)];
+
+    while (*pp != tc)
+        pp = &(*pp)->hnext;
+    *pp = tc->hnext;
+    p->n--;
+}
+
+/* One server thread with a listening socket and sessions of its own */
+struct tftp_worker {
+    pthread_t thread;
+    int id;
+    int cpu; /* CPU to run on, or -1 for any */
+    int sock; /* Listening socket, one of the SO_REUSEPORT group */
+    int wakefd; /* Readable once the server is stopping */
+    int epfd;
+    const char *root;
+    struct cache *cache; /* Shared by all workers, or NULL */
+    const struct tftp_params *params;
+    struct tftp_timers timers; /* Its sessions by deadline */
+    struct tftp_peers peers; /* And by client */
+    struct tftp_stats stats; /* Of this worker's sessions */
+};
+
+/* Returns negative if out of memory */
+static int tftp_worker_add(struct tftp_worker *w, struct tftp_conn *tc)
+{
+    if (tftp_timers_add(&w->timers, tc) < 0)
+        return -1;
+
+    if (tftp_peers_add(&w->peers, tc) < 0) {
+        tftp_timers_del(&w->timers, tc);
+        return -1;
+    }
 
-            int i = 0;
+    return 0;
+}
 
-            int hnllen = sizeof(HOST_NEWLINE_STYLE) - 1;
-            int nanllen = sizeof(NETASCII_NEWLINE_STYLE) - 1;
+/*
+  A session of a worker handled a message or a timeout. Close it if it
+  is done, otherwise move its timer, and its entry if a multicast
+  transfer went on with the next client.
+ */
+static void tftp_worker_check(struct tftp_worker *w, struct tftp_conn *tc)
+{
+    if (tc->state != TFTP_STATE_DONE) {
+        tftp_timers_update(&w->timers, tc);
 
-            if (!strcmp(tc->mode, MODE_NETASCII)) {
-                do {
+        if (tc->peer_key != tftp_peer_key(&tc->peer_addr)) {
+            tftp_peers_del(&w->peers, tc);
+            tftp_peers_add(&w->peers, tc);
+        }
+        return;
+    }
 
-                    if (!strncmp(&recbuf[TFTP_DATA_HDR_LEN + i], NETASCII_NEWLINE_STYLE, nanllen)) {
-                        fwrite(HOST_NEWLINE_STYLE, 1, hnllen, tc->fp);
+    log_info("%s:%d %s %s %s\n", inet_ntoa(tc->peer_addr.sin_addr),
+             ntohs(tc->peer_addr.sin_port),
+             tc->type == TFTP_TYPE_PUT ? "get" : "put", tc->fname,
+             tc->retval < 0 ? "failed" : "done");
 
-                        i += nanllen;
+    tftp_stats_add(&w->stats, &tc->stats);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, tc->sock, NULL);
+    tftp_timers_del(&w->timers, tc);
+    tftp_peers_del(&w->peers, tc);
+    tftp_close(tc);
+}
 
-                    } else {
+/*
+  Run one worker until the server stops. Requests come in on the
+  worker's own listening socket and every session gets a socket of
+  its own, an ephemeral port being the server's TID for it. All
+  sessions are driven by the same tftp_recv() and tftp_timeout() as
+  our own transfers, from one epoll loop as in tftp_batch(). Nothing
+  but the file cache is shared with other workers.
+ */
+static void *tftp_worker_run(void *arg)
+{
+    struct tftp_worker *w = arg;
+    struct epoll_event events[TFTP_SERVE_EVENTS];
+    struct epoll_event ev;
+    char req[MSGBUF_SIZE(TFTP_BLOCK_SIZE)];
+    int i;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        if (w->cpu < CPU_SETSIZE)
+            CPU_SET(w->cpu, &set);
+        if (w->cpu >= CPU_SETSIZE ||
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            fprintf(stderr, "Could not pin worker %d to CPU %d\n", w->id, w->cpu);
+    }
 
-                        fwrite(&recbuf[TFTP_DATA_HDR_LEN + i], 1, 1,tc->fp);
-                        i++;
+    if ((w->epfd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "Could not create epoll instance!\n");
+        return NULL;
+    }
 
-                    }
+    /* The listening socket is the one without a session and the
+     * wakeup the one with the worker */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->sock, &ev);
+    ev.data.ptr = w;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev);
 
-                } while(i < reclen - TFTP_DATA_HDR_LEN);
+    while (!tftp_stop) {
+        u_int64_t now;
+        int nev;
 
-            } else {
-                fwrite(&recbuf[TFTP_DATA_HDR_LEN],1,reclen - TFTP_DATA_HDR_LEN,tc->fp);
-            }
+        /* Sleep until something arrives or the nearest
+         * retransmission deadline */
+        nev = epoll_wait(w->epfd, events, TFTP_SERVE_EVENTS, tftp_timers_wait(&w->timers));
 
+        if (nev < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "\nepoll_wait()\n");
             break;
-        case OPCODE_ACK:
-            printf("Received ACK, send next block\n");
+        }
 
-            if (tc->type == TFTP_TYPE_GET) {
-                fprintf(stderr, "\nExpected data, got ack\n");
-                goto out;
-            }
+        for (i = 0; i < nev; i++) {
+            struct tftp_conn *tc = events[i].data.ptr;
+            struct sockaddr_in peer;
+            socklen_t peerlen = sizeof(peer);
+            int len;
 
-            /* If we are putting and sent a data package with
-             * a block of < 512 bytes last time, we want to
-             * terminate the loop after getting the final ack */
-            if (len < (TFTP_DATA_HDR_LEN + BLOCK_SIZE)) {
-                terminate = 1;
-                printf("We're done sending, let's terminate\n");
-            } else {
-                /* Save the numer of sent bytes in 'len' in case
-                * it's < 512 and the package has to be resent. */
-                len = tftp_send_data(tc, BLOCK_SIZE);
-                printf("We sent a packet of length %d\n",len);
-            }
+            if (events[i].data.ptr == w)
+                continue;
 
-            break;
-        case OPCODE_ERR:
-            printf("The transfer was terminated with an error ");
-            printf("and the pitiful excuse given by the server was: ");
-            printf("%s\n", ((struct tftp_err*) &recbuf)->errmsg);
-            break;
-        default:
-            fprintf(stderr, "\nUnknown message type\n");
-            goto out;
+            if (tc) {
+                tftp_recv(tc);
+                tftp_worker_check(w, tc);
+                continue;
+            }
 
+            /* New requests, as many as are waiting */
+            while ((len = recvfrom(w->sock, req, sizeof(req), MSG_DONTWAIT,
+                                   (struct sockaddr *) &peer, &peerlen)) >= 0) {
+                peerlen = sizeof(peer);
+
+                /* The client resent its request, its session
+                 * answers that when the timer goes off. The kernel
+                 * hands a client's datagrams to the same worker
+                 * every time. */
+                if (tftp_peers_find(&w->peers, &peer))
+                    continue;
+
+                if (!(tc = tftp_accept(w->root, w->sock, req, len, &peer,
+                                       w->cache, w->params)))
+                    continue;
+
+                /* Groups are per worker, clients of a file that land
+                 * on different workers get a group each */
+                if (tc->mc_req &&
+                    tftp_mcast_attach(tc, w->timers.heap, w->timers.n, w->params) > 0)
+                    continue;
+
+                ev.events = EPOLLIN;
+                ev.data.ptr = tc;
+
+                if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, tc->sock, &ev) < 0 ||
+                    tftp_start(tc) < 0 || tftp_worker_add(w, tc) < 0) {
+                    fprintf(stderr, "%s: failed to start session!\n", tc->fname);
+                    tftp_stats_add(&w->stats, &tc->stats);
+                    tftp_close(tc);
+                    continue;
+                }
+            }
         }
 
-        totlen += (len + reclen);
+        /* Fire expired timers, each session's next deadline lies
+         * ahead of 'now' */
+        now = tftp_now();
 
-    } while (!terminate);
+        while (w->timers.n > 0 && now >= w->timers.heap[0]->deadline) {
+            struct tftp_conn *tc = w->timers.heap[0];
 
+            tftp_timeout(tc);
+            tftp_worker_check(w, tc);
+        }
+    }
 
-    if (tc->type == TFTP_TYPE_GET && terminate) {
-        /* The loop terminated succesfully but the last ack might
-         * have been lost. Wait for a possible duplicate data
-         * package and in that case send the ack one more time */
-        timeout.tv_sec = TFTP_TIMEOUT;
-        timeout.tv_usec = 0;
+    /* Sessions cut short, unless all that was left was to linger */
+    for (i = 0; i < w->timers.n; i++) {
+        struct tftp_conn *tc = w->timers.heap[i];
 
-        if (select(1, &sfd, NULL, NULL, &timeout) > 0) {
-            read(tc->sock, tc->msgbuf, MSGBUF_SIZE);
-            if (ntohs(((u_int16_t *) tc->msgbuf)[0]) == OPCODE_DATA
-                && ntohs(((u_int16_t*) tc->msgbuf)[1]) == tc->blocknr) {
-                tftp_send_ack(tc);
-            }
+        if (tc->state == TFTP_STATE_LINGER) {
+            tftp_finish(tc, 0);
+        } else {
+            tftp_send_error(tc, 0);
+            tftp_finish(tc, -1);
         }
-    }
 
+        tftp_stats_add(&w->stats, &tc->stats);
+        tftp_close(tc);
+    }
 
+    free(w->timers.heap);
+    free(w->peers.table);
+    close(w->epfd);
 
-    printf("\nTotal data bytes sent/received: %d.\n", totlen);
-out:
-    fclose(tc->fp);
-    return retval;
+    return NULL;
 }
 
-int main (int argc, char **argv)
+/*
+  Serve the files below 'root' on params->port until SIGINT or
+  SIGTERM, with 'nworkers' threads. Each has a listening socket of
+  its own in one SO_REUSEPORT group, so the kernel spreads clients
+  over them. Worker i runs on cpus[i % ncpus] if CPUs are given.
+  Files sent are cached, using up to 'cache_size' bytes. The
+  statistics of all sessions are added to 'stats'. Returns negative
+  if the server could not be started.
+ */
+int tftp_serve(const char *root, size_t cache_size, int nworkers,
+               const int *cpus, int ncpus,
+               const struct tftp_params *params, struct tftp_stats *stats)
 {
+    struct tftp_worker *workers;
+    struct sockaddr_in addr;
+    struct cache cache;
+    sigset_t sigs, oldsigs;
+    u_int64_t one = 1;
+    int wakefd;
+    int started = 0;
+    int on = 1;
+    int sig;
+    int i;
+
+    /* Every session takes a descriptor */
+    tftp_raise_nofile();
+
+    if (!(workers = calloc(nworkers, sizeof(*workers)))) {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
 
-    char *fname = NULL;
-    char *hostname = NULL;
-    char *progname = argv[0];
-    int retval = -1;
-    int type = -1;
-    struct tftp_conn *tc;
+    if ((wakefd = eventfd(0, 0)) < 0) {
+        fprintf(stderr, "Could not create eventfd!\n");
+        free(workers);
+        return -1;
+    }
 
-    /* Check whether the user wants to put or get a file. */
-    while (argc > 0) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(params->port);
+
+    for (i = 0; i < nworkers; i++) {
+        struct tftp_worker *w = &workers[i];
+
+        if ((w->sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+            setsockopt(w->sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+            bind(w->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Could not bind to port %d!\n", params->port);
+            if (w->sock >= 0)
+                close(w->sock);
+            while (i-- > 0)
+                close(workers[i].sock);
+            close(wakefd);
+            free(workers);
+            return -1;
+        }
+    }
 
-        if (strcmp("-g", argv[0]) == 0) {
-            fname = argv[1];
-            hostname = argv[2];
+    cache_init(&cache, cache_size);
 
-            type = TFTP_TYPE_GET;
-            break;
-        } else if (strcmp("-p", argv[0]) == 0) {
-            fname = argv[1];
-            hostname = argv[2];
+    /* Only this thread takes the signals, the workers inherit the
+     * mask */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
 
-            type = TFTP_TYPE_PUT;
-            break;
+    for (i = 0; i < nworkers; i++) {
+        struct tftp_worker *w = &workers[i];
+
+        w->id = i;
+        w->cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+        w->wakefd = wakefd;
+        w->root = root;
+        w->cache = cache_size ? &cache : NULL;
+        w->params = params;
 
+        if (pthread_create(&w->thread, NULL, tftp_worker_run, w)) {
+            fprintf(stderr, "Could not start worker %d!\n", i);
+            break;
         }
-        argc--;
-        argv++;
+        started++;
     }
 
-    /* Print usage message */
-    if (!fname || !hostname) {
-        fprintf(stderr, "Usage: %s [-g|-p] FILE HOST\n",
-                progname);
-        return -1;
+    if (started == nworkers) {
+        log_info("Serving %s on port %d with %d worker%s\n", root, params->port,
+                 nworkers, nworkers > 1 ? "s" : "");
+        sigwait(&sigs, &sig);
     }
 
-    /* Connect to the remote server */
-    tc = tftp_connect(type, fname, MODE_OCTET, hostname);
+    tftp_stop = 1;
+    if (write(wakefd, &one, sizeof(one)) < 0)
+        fprintf(stderr, "Could not wake the workers!\n");
 
-    if (!tc) {
-        fprintf(stderr, "Failed to connect!\n");
-        return -1;
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        tftp_stats_add(stats, &workers[i].stats);
     }
 
-    /* Transfer the file to or from the server */
-    retval = tftp_transfer(tc);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
 
-    if (retval < 0) {
-        fprintf(stderr, "File transfer failed!\n");
-    }
+    if (cache_size)
+        log_info("Cache: %lu hits, %lu misses, %lu evictions, %lu of %lu bytes in use\n",
+                 cache.hits, cache.misses, cache.evictions,
+                 (unsigned long) cache.used, (unsigned long) cache.budget);
 
-    /* We are done. Cleanup our state. */
-    tftp_close(tc);
+    for (i = 0; i < nworkers; i++)
+        close(workers[i].sock);
 
-    return retval;
+    cache_free(&cache);
+    close(wakefd);
+    free(workers);
+
+    return started == nworkers ? 0 : -1;
+}
+#else
+int tftp_serve(const char *root, size_t cache_size, int nworkers,
+               const int *cpus, int ncpus,
+               const struct tftp_params *params, struct tftp_stats *stats)
+{
+    fprintf(stderr, "Server mode needs epoll, only available on Linux\n");
+    return -1;
 }
+#endif
@@ -15,25 +15,58 @@ typedef char u_int8_t;
 #error "Unsupported operating system"
 #endif 
 
-#define BLOCK_SIZE 512
+/* The RFC 1350 block size. Not BLOCK_SIZE, which linux/fs.h defines
+ * as 1024 behind the back of linux/io_uring.h. */
+#define TFTP_BLOCK_SIZE 512
+
+/* Block size limits from RFC 2348 */
+#define TFTP_BLKSIZE_MIN 8
+#define TFTP_BLKSIZE_MAX 65464
 
 #define OPCODE_RRQ   1
 #define OPCODE_WRQ   2
 #define OPCODE_DATA  3
 #define OPCODE_ACK   4
 #define OPCODE_ERR   5
+#define OPCODE_OACK  6
 
 
 #define MODE_NETASCII "netascii"
 #define MODE_OCTET    "octet"
 #define MODE_MAIL     "mail"
 
+/* Option names (RFC 2347 and friends) */
+#define OPT_BLKSIZE    "blksize"
+#define OPT_WINDOWSIZE "windowsize"
+#define OPT_TIMEOUT    "timeout"
+#define OPT_MULTICAST  "multicast"
+#define OPT_TSIZE      "tsize"
+/* Not a standard option: the byte a read starts at, to resume a get */
+#define OPT_OFFSET     "offset"
+/* Not a standard option either: data blocks compressed with the codec
+ * named, only TFTP_LZ_NAME */
+#define OPT_COMPRESS   "compress"
+#define TFTP_LZ_NAME   "lz"
+
 #define TFTP_PORT 6969
 
-/* Timeout in seconds */
+/* First port of the multicast groups a server hands out (RFC 2090) */
+#define TFTP_MCAST_PORT 1758
+
+/* Initial retransmission timeout in seconds, used until we have an
+   RTT estimate */
 #define TFTP_TIMEOUT 2
 
-static char *err_codes[8] = {
+/* Bounds for the adaptive retransmission timeout in milliseconds */
+#define TFTP_RTO_MIN 20
+#define TFTP_RTO_MAX 16000
+
+/* Give up after this many consecutive timeouts */
+#define TFTP_MAX_RETRIES 8
+
+#define ERR_OPTNEG 8
+
+static char *err_codes[9] = {
 	"Undef",
 	"File not found",
 	"Access violation",
@@ -41,7 +74,8 @@ static char *err_codes[8] = {
 	"Illegal TFTP operation",
 	"Unknown transfer ID",
 	"File already exists",
-	"No such user"
+	"No such user",
+	"Option negotiation failed"
 };
 
 /*
@@ -106,9 +140,20 @@ struct tftp_err {
 
 #define TFTP_ERR_HDR_LEN sizeof(struct tftp_err)
 
+/*
+  A TFTP option acknowledgement (RFC 2347). The option list is a
+  sequence of NUL terminated name/value pairs.
+ */
+struct tftp_oack {
+	u_int16_t opcode;
+	char opts[0];
+};
+
+#define TFTP_OACK_HDR_LEN sizeof(struct tftp_oack)
+
 static inline char *tftp_err_to_str(int err)
 {
-	if (err < 0 || err > 7)
+	if (err < 0 || err > ERR_OPTNEG)
 		return NULL;
 	
 	return err_codes[err];
@@ -0,0 +1,592 @@
+/* A minimal TFTP server, the reference the client is benchmarked
+   against on loopback. Each transfer is served by a process of its
+   own, on a socket of its own, one window at a time. Supports the
+   blksize, windowsize and timeout options and both transfer modes.
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "tftp.h"
+#include "netascii.h"
+
+/* Retransmission timeout unless the client asks for another one */
+#define TFTPD_TIMEOUT 1
+
+#define TFTPD_WINDOWSIZE_MAX 1024
+
+/* Timeouts to linger for a resent final block after a put */
+#define TFTPD_LINGER 3
+
+/* Windows the socket buffers hold, see tftpd_size_bufs() */
+#define TFTPD_SOCKBUF_WINDOWS 4
+
+/* Chunk of the file translated at a time in netascii mode */
+#define TFTPD_XLAT_SIZE 65536
+
+/* Message buffer size needed for a given block size */
+#define MSGBUF_SIZE(blksize) (TFTP_DATA_HDR_LEN + (blksize))
+
+/* One transfer */
+struct tftpd_session {
+    int sock; /* Connected to the client */
+    FILE *fp;
+    int netascii; /* Translate newlines? */
+    struct netascii na;
+    char *xlatbuf; /* Netascii translation buffer, TFTPD_XLAT_SIZE bytes */
+    int xlat_pos; /* Next byte in xlatbuf to translate when sending */
+    int xlat_len; /* Bytes in xlatbuf when sending */
+    int xlat_eof; /* Whole file read into xlatbuf? */
+    int blksize;
+    int windowsize;
+    int timeout; /* Retransmission timeout (s), doubled for each retry in a row */
+    char *buf; /* Receive buffer, blksize + header + 1 bytes */
+    char *window; /* Blocks sent but not acknowledged, blksize + header each */
+    int *window_len; /* Length of each message in window */
+    unsigned int ack_sent; /* Block number of the last ack sent */
+};
+
+static int tftpd_send_error(struct tftpd_session *s, int errcode)
+{
+    char msg[64];
+    struct tftp_err *err = (struct tftp_err *) msg;
+    int len = TFTP_ERR_HDR_LEN + strlen(tftp_err_to_str(errcode)) + 1;
+
+    err->opcode = htons(OPCODE_ERR);
+    err->errcode = htons(errcode);
+    strcpy(err->errmsg, tftp_err_to_str(errcode));
+
+    return send(s->sock, msg, len, 0);
+}
+
+static int tftpd_send_ack(struct tftpd_session *s, unsigned int blocknr)
+{
+    struct tftp_ack ack;
+
+    ack.opcode = htons(OPCODE_ACK);
+    ack.blocknr = htons(blocknr);
+    s->ack_sent = blocknr;
+
+    return send(s->sock, &ack, sizeof(ack), 0);
+}
+
+/*
+  Make the socket buffers hold a few windows, so a window of large
+  blocks is not dropped by the kernel before we read it
+ */
+static void tftpd_size_bufs(struct tftpd_session *s)
+{
+    static const int opts[] = { SO_RCVBUF, SO_SNDBUF };
+    int want = TFTPD_SOCKBUF_WINDOWS * s->windowsize * MSGBUF_SIZE(s->blksize);
+    unsigned int i;
+
+    for (i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+        int size;
+        socklen_t len = sizeof(size);
+
+        /* Linux reports twice what was set, the rest is overhead */
+        if (getsockopt(s->sock, SOL_SOCKET, opts[i], &size, &len) == 0 && size < want)
+            setsockopt(s->sock, SOL_SOCKET, opts[i], &want, sizeof(want));
+    }
+}
+
+/*
+  Wait for a message from the client for at most the retransmission
+  timeout, backed off after 'retries' timeouts in a row up to
+  TFTP_RTO_MAX as the client does. Otherwise a client that has backed
+  off further than our retries reach finds us gone. Returns its
+  length, 0 on timeout or negative on error.
+ */
+static int tftpd_wait(struct tftpd_session *s, int retries)
+{
+    struct pollfd pfd = { s->sock, POLLIN, 0 };
+    int ms = s->timeout * 1000;
+    int max = ms > TFTP_RTO_MAX ? ms : TFTP_RTO_MAX;
+    int n;
+
+    for (; retries > 0 && ms < max; retries--)
+        ms *= 2;
+
+    switch (poll(&pfd, 1, ms < max ? ms : max)) {
+    case -1:
+        return errno == EINTR ? 0 : -1;
+    case 0:
+        return 0;
+    }
+
+    n = recv(s->sock, s->buf, MSGBUF_SIZE(s->blksize) + 1, 0);
+
+    /* Runts are as good as nothing */
+    if (n >= 0 && n < (int) TFTP_ACK_HDR_LEN)
+        return 0;
+
+    return n;
+}
+
+/* Read the next block of the file, translated to the transfer mode */
+static int tftpd_read_block(struct tftpd_session *s, char *buf, int len)
+{
+    int out = 0;
+
+    if (!s->netascii) {
+        len = fread(buf, 1, len, s->fp);
+        return ferror(s->fp) ? -1 : len;
+    }
+
+    while (out < len) {
+        size_t n;
+
+        if (s->xlat_pos == s->xlat_len && !s->xlat_eof) {
+            s->xlat_len = fread(s->xlatbuf, 1, TFTPD_XLAT_SIZE, s->fp);
+            s->xlat_pos = 0;
+
+            if (ferror(s->fp))
+                return -1;
+            if (s->xlat_len < TFTPD_XLAT_SIZE)
+                s->xlat_eof = 1;
+        }
+
+        if (s->xlat_pos == s->xlat_len && s->na.pending < 0)
+            break;
+
+        n = s->xlat_len - s->xlat_pos;
+        out += netascii_encode(&s->na, buf + out, len - out,
+                               s->xlatbuf + s->xlat_pos, &n);
+        s->xlat_pos += n;
+    }
+
+    return out;
+}
+
+/* Write a received block to the file */
+static int tftpd_write_block(struct tftpd_session *s, const char *buf, int len)
+{
+    if (s->netascii) {
+        len = netascii_decode(&s->na, s->xlatbuf, buf, len);
+        buf = s->xlatbuf;
+    }
+
+    return fwrite(buf, 1, len, s->fp) == (size_t) len ? 0 : -1;
+}
+
+/*
+  The full number of the block 'nr16' refers to, taking the one
+  closest to 'ref' so block numbers may wrap.
+ */
+static unsigned int tftpd_blocknr(unsigned int ref, u_int16_t nr16)
+{
+    return ref + (short) (nr16 - (u_int16_t) ref);
+}
+
+/*
+  Send a file. 'oack' is the length of an option acknowledgement
+  already in the window buffer, which must be acknowledged with block
+  0 first, or 0 if there is none. Returns negative on failure.
+ */
+static int tftpd_get(struct tftpd_session *s, int oack)
+{
+    int msgsize = MSGBUF_SIZE(s->blksize);
+    unsigned int acked = 0; /* Last block acknowledged */
+    unsigned int sent = 0; /* Last block sent */
+    unsigned int last = 0; /* The final block, 0 until read */
+    unsigned int nr;
+    int resend = 0;
+    int retries = 0;
+    int n;
+
+    if (oack && send(s->sock, s->window, oack, 0) < 0)
+        return -1;
+
+    for (;;) {
+        if (!oack) {
+            /* Resend what is in flight, or send what the window
+             * has room for */
+            for (nr = resend ? acked + 1 : sent + 1; nr <= acked + s->windowsize; nr++) {
+                int slot = nr % s->windowsize;
+                struct tftp_data *data = (struct tftp_data *) (s->window + slot * msgsize);
+
+                if (nr > sent) {
+                    if (last)
+                        break;
+
+                    if ((n = tftpd_read_block(s, data->data, s->blksize)) < 0) {
+                        tftpd_send_error(s, 0);
+                        return -1;
+                    }
+
+                    data->opcode = htons(OPCODE_DATA);
+                    data->blocknr = htons(nr);
+                    s->window_len[slot] = TFTP_DATA_HDR_LEN + n;
+                    sent = nr;
+
+                    if (n < s->blksize)
+                        last = nr;
+                }
+
+                if (send(s->sock, data, s->window_len[slot], 0) < 0 &&
+                    errno != ECONNREFUSED)
+                    return -1;
+            }
+        }
+
+        resend = 0;
+
+        if ((n = tftpd_wait(s, retries)) < 0)
+            return -1;
+
+        if (n == 0) {
+            if (++retries > TFTP_MAX_RETRIES)
+                return -1;
+
+            if (oack)
+                send(s->sock, s->window, oack, 0);
+            resend = 1;
+            continue;
+        }
+
+        switch (ntohs(((struct tftp_msg *) s->buf)->opcode)) {
+        case OPCODE_ACK:
+            nr = tftpd_blocknr(acked, ntohs(((struct tftp_ack *) s->buf)->blocknr));
+
+            if (nr < acked || nr > sent)
+                break;
+
+            /* An ack short of what was sent means the client missed
+             * the rest, resend from after it (RFC 7440) */
+            if (nr < sent && !oack)
+                resend = 1;
+
+            retries = 0;
+            oack = 0;
+            acked = nr;
+
+            if (last && acked == last)
+                return 0;
+            break;
+        case OPCODE_ERR:
+            return -1;
+        default:
+            tftpd_send_error(s, 4);
+            return -1;
+        }
+    }
+}
+
+/*
+  Receive a file. 'oack' is the length of an option acknowledgement
+  in the window buffer to answer the request with, or 0 to answer
+  with ack 0. Returns negative on failure.
+ */
+static int tftpd_put(struct tftpd_session *s, int oack)
+{
+    unsigned int blocknr = 0; /* Last block received in order */
+    unsigned int nr;
+    int winpos = 0; /* Blocks received since our last ack */
+    int gap_acked = 0; /* Already re-acked the current gap? */
+    int retries = 0;
+    int done = 0;
+    int n;
+
+    if (oack)
+        send(s->sock, s->window, oack, 0);
+    else
+        tftpd_send_ack(s, 0);
+
+    for (;;) {
+        if ((n = tftpd_wait(s, done ? 0 : retries)) < 0)
+            return -1;
+
+        if (n == 0) {
+            /* Nothing more after our last ack for TFTPD_LINGER
+             * timeouts, the client is done */
+            if (done) {
+                if (++retries >= TFTPD_LINGER)
+                    return 0;
+                continue;
+            }
+
+            if (++retries > TFTP_MAX_RETRIES)
+                return -1;
+
+            if (oack && blocknr == 0)
+                send(s->sock, s->window, oack, 0);
+            else
+                tftpd_send_ack(s, blocknr);
+            continue;
+        }
+
+        switch (ntohs(((struct tftp_msg *) s->buf)->opcode)) {
+        case OPCODE_DATA:
+            nr = tftpd_blocknr(blocknr, ntohs(((struct tftp_data *) s->buf)->blocknr));
+
+            if (nr <= blocknr) {
+                /* A block we have. The client resends when it has
+                 * no ack for what we have, so tell it if we have not
+                 * yet, or if the block we acked last came again and
+                 * our ack was lost. Older copies may have crossed
+                 * our ack, an ack repeated for those would read as a
+                 * gap and have the client resend all it has in
+                 * flight. */
+                if (s->ack_sent != blocknr || nr == blocknr) {
+                    tftpd_send_ack(s, blocknr);
+                    winpos = 0;
+                }
+                break;
+            }
+
+            if (nr != blocknr + 1) {
+                /* A gap, tell the client where we are once */
+                if (!gap_acked) {
+                    tftpd_send_ack(s, blocknr);
+                    gap_acked = 1;
+                    winpos = 0;
+                }
+                break;
+            }
+
+            if (done)
+                break;
+
+            if (tftpd_write_block(s, s->buf + TFTP_DATA_HDR_LEN,
+                                  n - TFTP_DATA_HDR_LEN) < 0) {
+                tftpd_send_error(s, 3);
+                return -1;
+            }
+
+            blocknr++;
+            retries = 0;
+            gap_acked = 0;
+
+            if (n < MSGBUF_SIZE(s->blksize)) {
+                /* The final block. Finish the file now and linger
+                 * for a retransmission in case our ack is lost. */
+                if (s->netascii && netascii_decode_finish(&s->na, s->xlatbuf))
+                    fwrite(s->xlatbuf, 1, 1, s->fp);
+                if (fflush(s->fp) != 0) {
+                    tftpd_send_error(s, 3);
+                    return -1;
+                }
+                done = 1;
+            }
+
+            if (done || ++winpos >= s->windowsize) {
+                tftpd_send_ack(s, blocknr);
+                winpos = 0;
+            }
+            break;
+        case OPCODE_ERR:
+            return -1;
+        default:
+            tftpd_send_error(s, 4);
+            return -1;
+        }
+    }
+}
+
+/*
+  Parse the options of a request and build the option
+  acknowledgement in 'oack'. Returns its length, or 0 if no options
+  were accepted.
+ */
+static int tftpd_parse_opts(struct tftpd_session *s, char *p, char *end, char *oack)
+{
+    char *q = oack + TFTP_OACK_HDR_LEN;
+
+    ((struct tftp_oack *) oack)->opcode = htons(OPCODE_OACK);
+
+    while (p < end) {
+        char *name = p;
+        char *val = memchr(p, '\0', end - p);
+        int v;
+
+        if (!val || ++val >= end || !memchr(val, '\0', end - val))
+            break;
+
+        p = val + strlen(val) + 1;
+        v = atoi(val);
+
+        if (!strcasecmp(name, OPT_BLKSIZE) && v >= TFTP_BLKSIZE_MIN) {
+            s->blksize = v < TFTP_BLKSIZE_MAX ? v : TFTP_BLKSIZE_MAX;
+            v = s->blksize;
+        } else if (!strcasecmp(name, OPT_WINDOWSIZE) && v >= 1) {
+            s->windowsize = v < TFTPD_WINDOWSIZE_MAX ? v : TFTPD_WINDOWSIZE_MAX;
+            v = s->windowsize;
+        } else if (!strcasecmp(name, OPT_TIMEOUT) && v >= 1 && v <= 255) {
+            s->timeout = v;
+        } else {
+            /* Options we don't know are left out */
+            continue;
+        }
+
+        q += sprintf(q, "%s", name) + 1;
+        q += sprintf(q, "%d", v) + 1;
+    }
+
+    return q - (oack + TFTP_OACK_HDR_LEN) > 0 ? q - oack : 0;
+}
+
+/*
+  Serve one request from 'peer'. Runs in a process of its own.
+  Returns negative on failure.
+ */
+static int tftpd_session(const char *root, char *req, int len,
+                         struct sockaddr_in *peer)
+{
+    struct tftpd_session s;
+    int opcode = ntohs(((struct tftp_msg *) req)->opcode);
+    char *end = req + len;
+    char *fname = req + 2;
+    char *mode;
+    char path[4096];
+    char oack[512];
+    int oacklen;
+    int retval;
+
+    memset(&s, 0, sizeof(s));
+    s.blksize = TFTP_BLOCK_SIZE;
+    s.windowsize = 1;
+    s.timeout = TFTPD_TIMEOUT;
+    netascii_init(&s.na);
+
+    if ((s.sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        connect(s.sock, (struct sockaddr *) peer, sizeof(*peer)) < 0) {
+        fprintf(stderr, "Could not create socket!\n");
+        return -1;
+    }
+
+    /* File name and mode must both be terminated */
+    if (!(mode = memchr(fname, '\0', end - fname)) || ++mode >= end ||
+        !memchr(mode, '\0', end - mode)) {
+        tftpd_send_error(&s, 4);
+        return -1;
+    }
+
+    s.netascii = !strcasecmp(mode, MODE_NETASCII);
+
+    if (!s.netascii && strcasecmp(mode, MODE_OCTET)) {
+        tftpd_send_error(&s, 4);
+        return -1;
+    }
+
+    oacklen = tftpd_parse_opts(&s, mode + strlen(mode) + 1, end, oack);
+    tftpd_size_bufs(&s);
+
+    /* Stay inside the root */
+    if (strstr(fname, "..") ||
+        snprintf(path, sizeof(path), "%s/%s", root, fname) >= (int) sizeof(path)) {
+        tftpd_send_error(&s, 2);
+        return -1;
+    }
+
+    if (!(s.fp = fopen(path, opcode == OPCODE_RRQ ? "rb" : "wb"))) {
+        tftpd_send_error(&s, opcode == OPCODE_RRQ ? 1 : 2);
+        return -1;
+    }
+
+    s.buf = malloc(MSGBUF_SIZE(s.blksize) + 1);
+    s.window = malloc(s.windowsize * MSGBUF_SIZE(s.blksize) + sizeof(oack));
+    s.window_len = calloc(s.windowsize, sizeof(int));
+    s.xlatbuf = malloc(TFTPD_XLAT_SIZE);
+
+    if (!s.buf || !s.window || !s.window_len || !s.xlatbuf) {
+        fprintf(stderr, "Out of memory!\n");
+        tftpd_send_error(&s, 0);
+        return -1;
+    }
+
+    /* Sent from the window buffer so it can be resent */
+    memcpy(s.window, oack, oacklen);
+
+    if (opcode == OPCODE_RRQ)
+        retval = tftpd_get(&s, oacklen);
+    else
+        retval = tftpd_put(&s, oacklen);
+
+    if (fclose(s.fp) != 0)
+        retval = -1;
+
+    return retval;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr;
+    int port = TFTP_PORT;
+    char *root = NULL;
+    char *req;
+    int sock;
+    int one = 1;
+
+    for (argc--, argv++; argc > 0; argc--, argv++) {
+        if (strcmp("-p", argv[0]) == 0 && argc > 1) {
+            port = atoi(argv[1]);
+            argc--;
+            argv++;
+        } else if (argv[0][0] == '-' || root) {
+            root = NULL;
+            break;
+        } else {
+            root = argv[0];
+        }
+    }
+
+    if (!root) {
+        fprintf(stderr, "Usage: tftpd [-p PORT] ROOTDIR\n");
+        return -1;
+    }
+
+    /* Let children reap themselves */
+    signal(SIGCHLD, SIG_IGN);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Could not bind to port %d!\n", port);
+        return -1;
+    }
+
+    if (!(req = malloc(MSGBUF_SIZE(TFTP_BLKSIZE_MAX)))) {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+
+    for (;;) {
+        struct sockaddr_in peer;
+        socklen_t peerlen = sizeof(peer);
+        int len = recvfrom(sock, req, MSGBUF_SIZE(TFTP_BLKSIZE_MAX), 0,
+                           (struct sockaddr *) &peer, &peerlen);
+        int opcode;
+
+        if (len < (int) TFTP_RRQ_HDR_LEN)
+            continue;
+
+        opcode = ntohs(((struct tftp_msg *) req)->opcode);
+
+        /* Anything but a request belongs to a session we don't
+         * have */
+        if (opcode != OPCODE_RRQ && opcode != OPCODE_WRQ)
+            continue;
+
+        switch (fork()) {
+        case -1:
+            fprintf(stderr, "fork() failed\n");
+            break;
+        case 0:
+            close(sock);
+            return tftpd_session(root, req, len, &peer) < 0 ? 1 : 0;
+        }
+    }
+}
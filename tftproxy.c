@@ -0,0 +1,548 @@
+/* A UDP proxy that sits between a TFTP client and server and makes
+   the network worse: it drops, duplicates, reorders and delays
+   datagrams. All decisions come from a seeded PRNG, so a run can be
+   repeated exactly, packet for packet.
+
+   The client sends its requests to the proxy's port, which forwards
+   them to the server's well-known port from a socket of its own per
+   client. Each port the server answers from, i.e. each TID, gets a
+   route: a port of the proxy's own that the answers come to the
+   client from, and that the client's datagrams to it go on from to
+   the server's TID. So the client sees the server's TIDs as distinct
+   TIDs of the proxy, and a session started by a duplicated request
+   looks to it like a foreign TID, as it would without the proxy.
+*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
+
+#include "tftp.h"
+
+/* Clients served at once */
+#define PROXY_MAX_CLIENTS 64
+
+/* Server TIDs per client at once, the oldest is dropped for a new one */
+#define PROXY_MAX_ROUTES 8
+
+/* Datagrams held back at once for delay or reordering */
+#define PROXY_MAX_HELD 65536
+
+/* Extra time a reordered datagram is held back, so that the ones
+   behind it overtake it */
+#define PROXY_REORDER_DELAY_MS 5
+
+#define PROXY_BUF_SIZE 65536
+
+#define TO_SERVER 0
+#define TO_CLIENT 1
+
+/* A server TID of a client and the proxy's port standing in for it */
+struct proxy_route {
+    struct sockaddr_in server; /* The server's TID */
+    int sock; /* Towards the client */
+};
+
+/* One client, its socket towards the server and its routes back */
+struct proxy_client {
+    struct sockaddr_in addr; /* The client */
+    int sock; /* Towards the server */
+    struct proxy_route routes[PROXY_MAX_ROUTES];
+    int nroutes;
+    int next_route; /* Slot to reuse once all are taken */
+};
+
+/* A datagram held back until 'due' */
+struct proxy_held {
+    u_int64_t due; /* When to send it (us) */
+    unsigned long seq; /* Order of arrival, for equal 'due' */
+    int client; /* Index in clients, negative once the client is gone */
+    int route; /* Index in its routes, to send to the client from */
+    int dir; /* TO_SERVER or TO_CLIENT */
+    struct sockaddr_in to; /* Where it goes, as decided when it arrived */
+    int len;
+    char *data;
+};
+
+/* How bad the network is, probabilities in 0..1 */
+struct proxy_conf {
+    double drop;
+    double dup;
+    double reorder;
+    int delay_ms; /* Added to every datagram */
+    int jitter_ms; /* Random extra delay up to this */
+};
+
+/* What was done, per direction */
+struct proxy_stats {
+    unsigned long received[2];
+    unsigned long sent[2];
+    unsigned long dropped[2];
+    unsigned long duplicated[2];
+    unsigned long reordered[2];
+};
+
+static struct proxy_client clients[PROXY_MAX_CLIENTS];
+static int nclients;
+static struct proxy_held *held; /* Binary heap ordered by due, seq */
+static int nheld;
+static unsigned long seq;
+static u_int64_t rng_state;
+static volatile sig_atomic_t quit;
+
+static u_int64_t proxy_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (u_int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, plenty for deciding the fate of datagrams */
+static u_int64_t proxy_rand(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Uniform in [0, 1) */
+static double proxy_rand_unit(void)
+{
+    return (proxy_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int proxy_held_before(struct proxy_held *a, struct proxy_held *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void proxy_held_swap(int i, int j)
+{
+    struct proxy_held tmp = held[i];
+
+    held[i] = held[j];
+    held[j] = tmp;
+}
+
+/* Hold back a copy of a datagram. Returns negative if there is no
+   room. */
+static int proxy_hold(int client, int route, int dir, const struct sockaddr_in *to,
+                      const char *data, int len, u_int64_t due)
+{
+    int i = nheld;
+
+    if (nheld == PROXY_MAX_HELD || !(held[i].data = malloc(len)))
+        return -1;
+
+    memcpy(held[i].data, data, len);
+    held[i].len = len;
+    held[i].client = client;
+    held[i].route = route;
+    held[i].dir = dir;
+    held[i].to = *to;
+    held[i].due = due;
+    held[i].seq = seq++;
+    nheld++;
+
+    for (; i > 0 && proxy_held_before(&held[i], &held[(i - 1) / 2]); i = (i - 1) / 2)
+        proxy_held_swap(i, (i - 1) / 2);
+
+    return 0;
+}
+
+/* Remove the earliest held datagram, which the caller now owns */
+static struct proxy_held proxy_unhold(void)
+{
+    struct proxy_held first = held[0];
+    int i = 0;
+
+    held[0] = held[--nheld];
+
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, min = i;
+
+        if (l < nheld && proxy_held_before(&held[l], &held[min]))
+            min = l;
+        if (r < nheld && proxy_held_before(&held[r], &held[min]))
+            min = r;
+        if (min == i)
+            break;
+
+        proxy_held_swap(i, min);
+        i = min;
+    }
+
+    return first;
+}
+
+/* Send to the server from the client's socket, or to the client from
+   the port of the route */
+static int proxy_send(int client, int route, int dir, const struct sockaddr_in *to,
+                      const char *data, int len, struct proxy_stats *st)
+{
+    struct proxy_client *c = &clients[client];
+    int sock = dir == TO_SERVER ? c->sock : c->routes[route].sock;
+    int n = sendto(sock, data, len, 0, (struct sockaddr *) to, sizeof(*to));
+
+    if (n >= 0)
+        st->sent[dir]++;
+
+    return n;
+}
+
+/*
+  Decide what happens to a datagram that just arrived. It goes to 'to'
+  even if held back while the routes change.
+ */
+static void proxy_forward(int client, int route, int dir, const struct sockaddr_in *to,
+                          const char *data, int len,
+                          const struct proxy_conf *conf, struct proxy_stats *st)
+{
+    int copies = 1;
+    int i;
+
+    st->received[dir]++;
+
+    if (proxy_rand_unit() < conf->drop) {
+        st->dropped[dir]++;
+        return;
+    }
+
+    if (proxy_rand_unit() < conf->dup) {
+        st->duplicated[dir]++;
+        copies = 2;
+    }
+
+    for (i = 0; i < copies; i++) {
+        u_int64_t delay = conf->delay_ms * 1000;
+
+        if (conf->jitter_ms)
+            delay += proxy_rand() % (conf->jitter_ms * 1000);
+
+        if (proxy_rand_unit() < conf->reorder) {
+            st->reordered[dir]++;
+            delay += PROXY_REORDER_DELAY_MS * 1000;
+        }
+
+        /* Straight through if nothing is waiting to go first */
+        if (delay == 0 && nheld == 0) {
+            proxy_send(client, route, dir, to, data, len, st);
+            continue;
+        }
+
+        if (proxy_hold(client, route, dir, to, data, len, proxy_now() + delay) < 0)
+            st->dropped[dir]++;
+    }
+}
+
+/* A UDP socket on a port of its own, or negative */
+static int proxy_socket(void)
+{
+    struct sockaddr_in any;
+    int sock;
+
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+    if (bind(sock, (struct sockaddr *) &any, sizeof(any)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static void proxy_client_close(struct proxy_client *c)
+{
+    int i;
+
+    close(c->sock);
+    for (i = 0; i < c->nroutes; i++)
+        close(c->routes[i].sock);
+}
+
+/* The client with address 'addr', added if it is new. Returns its
+   index or negative. */
+static int proxy_client(struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < nclients; i++) {
+        if (clients[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            clients[i].addr.sin_port == addr->sin_port)
+            return i;
+    }
+
+    if (nclients == PROXY_MAX_CLIENTS) {
+        /* Recycle the oldest */
+        proxy_client_close(&clients[0]);
+        memmove(&clients[0], &clients[1], (nclients - 1) * sizeof(clients[0]));
+        nclients--;
+
+        for (i = 0; i < nheld; i++)
+            held[i].client--;
+    }
+
+    i = nclients;
+    memset(&clients[i], 0, sizeof(clients[i]));
+    clients[i].addr = *addr;
+
+    if ((clients[i].sock = proxy_socket()) < 0) {
+        fprintf(stderr, "Could not create socket!\n");
+        return -1;
+    }
+
+    return nclients++;
+}
+
+/* The route of client 'client' for the server TID 'server', added if
+   it is new. Returns its index or negative. */
+static int proxy_route(int client, struct sockaddr_in *server)
+{
+    struct proxy_client *c = &clients[client];
+    int sock;
+    int i, j;
+
+    for (i = 0; i < c->nroutes; i++) {
+        if (c->routes[i].server.sin_addr.s_addr == server->sin_addr.s_addr &&
+            c->routes[i].server.sin_port == server->sin_port)
+            return i;
+    }
+
+    if ((sock = proxy_socket()) < 0) {
+        fprintf(stderr, "Could not create socket!\n");
+        return -1;
+    }
+
+    if (c->nroutes < PROXY_MAX_ROUTES) {
+        i = c->nroutes++;
+    } else {
+        /* Reuse the oldest. What is held for it is dropped, its port
+         * is gone. */
+        i = c->next_route;
+        c->next_route = (i + 1) % PROXY_MAX_ROUTES;
+        close(c->routes[i].sock);
+
+        for (j = 0; j < nheld; j++) {
+            if (held[j].client == client && held[j].dir == TO_CLIENT && held[j].route == i)
+                held[j].client = -1;
+        }
+    }
+
+    c->routes[i].server = *server;
+    c->routes[i].sock = sock;
+
+    return i;
+}
+
+static void proxy_quit(int sig)
+{
+    quit = 1;
+}
+
+static void proxy_print_stats(struct proxy_stats *st)
+{
+    const char *name[2] = { "to server", "to client" };
+    int dir;
+
+    for (dir = 0; dir < 2; dir++)
+        fprintf(stderr, "%s: %lu received, %lu sent, %lu dropped, "
+                "%lu duplicated, %lu reordered\n", name[dir],
+                st->received[dir], st->sent[dir], st->dropped[dir],
+                st->duplicated[dir], st->reordered[dir]);
+}
+
+int main(int argc, char **argv)
+{
+    struct proxy_conf conf = { 0, 0, 0, 0, 0 };
+    struct proxy_stats st;
+    struct sockaddr_in addr, server;
+    struct pollfd pfd[1 + PROXY_MAX_CLIENTS * (1 + PROXY_MAX_ROUTES)];
+    int pclient[1 + PROXY_MAX_CLIENTS * (1 + PROXY_MAX_ROUTES)]; /* Whose socket each is */
+    int proute[1 + PROXY_MAX_CLIENTS * (1 + PROXY_MAX_ROUTES)]; /* Which route, -1 towards the server */
+    int npfd;
+    int port = TFTP_PORT;
+    int server_port = TFTP_PORT + 1;
+    char *server_host = "127.0.0.1";
+    u_int64_t seed = 1;
+    char *buf;
+    int lsock;
+    int i, r;
+
+    for (argc--, argv++; argc > 1; argc -= 2, argv += 2) {
+        if (strcmp("-l", argv[0]) == 0) {
+            port = atoi(argv[1]);
+        } else if (strcmp("-s", argv[0]) == 0) {
+            server_host = argv[1];
+        } else if (strcmp("-p", argv[0]) == 0) {
+            server_port = atoi(argv[1]);
+        } else if (strcmp("-L", argv[0]) == 0) {
+            conf.drop = atof(argv[1]) / 100;
+        } else if (strcmp("-D", argv[0]) == 0) {
+            conf.dup = atof(argv[1]) / 100;
+        } else if (strcmp("-R", argv[0]) == 0) {
+            conf.reorder = atof(argv[1]) / 100;
+        } else if (strcmp("-d", argv[0]) == 0) {
+            conf.delay_ms = atoi(argv[1]);
+        } else if (strcmp("-j", argv[0]) == 0) {
+            conf.jitter_ms = atoi(argv[1]);
+        } else if (strcmp("-S", argv[0]) == 0) {
+            seed = strtoull(argv[1], NULL, 0);
+        } else {
+            break;
+        }
+    }
+
+    if (argc != 0) {
+        fprintf(stderr, "Usage: tftproxy [-l PORT] [-s SERVER] [-p SERVER_PORT] [-S SEED]\n"
+                "       [-L LOSS%%] [-D DUP%%] [-R REORDER%%] [-d DELAY_MS] [-j JITTER_MS]\n");
+        return -1;
+    }
+
+    /* xorshift must not start at 0 */
+    rng_state = seed ? seed : 1;
+
+    memset(&st, 0, sizeof(st));
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(server_port);
+
+    if (inet_pton(AF_INET, server_host, &server.sin_addr) != 1) {
+        fprintf(stderr, "Bad server address %s\n", server_host);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if ((lsock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+        bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Could not bind to port %d!\n", port);
+        return -1;
+    }
+
+    buf = malloc(PROXY_BUF_SIZE);
+    held = calloc(PROXY_MAX_HELD, sizeof(struct proxy_held));
+
+    if (!buf || !held) {
+        fprintf(stderr, "Out of memory!\n");
+        return -1;
+    }
+
+    signal(SIGINT, proxy_quit);
+    signal(SIGTERM, proxy_quit);
+
+    while (!quit) {
+        int timeout = -1;
+        u_int64_t now;
+
+        if (nheld > 0) {
+            now = proxy_now();
+            timeout = held[0].due > now ? (held[0].due - now + 999) / 1000 : 0;
+        }
+
+        pfd[0].fd = lsock;
+        pfd[0].events = POLLIN;
+        npfd = 1;
+        for (i = 0; i < nclients; i++) {
+            for (r = -1; r < clients[i].nroutes; r++) {
+                pfd[npfd].fd = r < 0 ? clients[i].sock : clients[i].routes[r].sock;
+                pfd[npfd].events = POLLIN;
+                pclient[npfd] = i;
+                proute[npfd] = r;
+                npfd++;
+            }
+        }
+
+        if (poll(pfd, npfd, timeout) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll()\n");
+            break;
+        }
+
+        /* From the client to a server TID first, then from the
+         * server, which may add routes, and requests last, which
+         * may recycle clients, so the indices stay valid */
+        for (i = 1; i < npfd; i++) {
+            struct proxy_client *c = &clients[pclient[i]];
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            int len;
+
+            if (proute[i] < 0 || !(pfd[i].revents & POLLIN))
+                continue;
+
+            len = recvfrom(pfd[i].fd, buf, PROXY_BUF_SIZE, MSG_DONTWAIT,
+                           (struct sockaddr *) &from, &fromlen);
+
+            /* Only the client knows the port */
+            if (len < 0 || from.sin_addr.s_addr != c->addr.sin_addr.s_addr ||
+                from.sin_port != c->addr.sin_port)
+                continue;
+
+            proxy_forward(pclient[i], proute[i], TO_SERVER, &c->routes[proute[i]].server,
+                          buf, len, &conf, &st);
+        }
+
+        for (i = 1; i < npfd; i++) {
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            int len;
+
+            if (proute[i] >= 0 || !(pfd[i].revents & POLLIN))
+                continue;
+
+            len = recvfrom(pfd[i].fd, buf, PROXY_BUF_SIZE, MSG_DONTWAIT,
+                           (struct sockaddr *) &from, &fromlen);
+
+            /* Back to the client from the port standing in for the
+             * TID it came from */
+            if (len >= 0 && (r = proxy_route(pclient[i], &from)) >= 0)
+                proxy_forward(pclient[i], r, TO_CLIENT, &clients[pclient[i]].addr,
+                              buf, len, &conf, &st);
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            struct sockaddr_in from;
+            socklen_t fromlen = sizeof(from);
+            int len = recvfrom(lsock, buf, PROXY_BUF_SIZE, MSG_DONTWAIT,
+                               (struct sockaddr *) &from, &fromlen);
+            int c;
+
+            /* A new transfer starts at the well-known port */
+            if (len >= 2 && (c = proxy_client(&from)) >= 0)
+                proxy_forward(c, -1, TO_SERVER, &server, buf, len, &conf, &st);
+        }
+
+        /* Whatever is due */
+        now = proxy_now();
+
+        while (nheld > 0 && held[0].due <= now) {
+            struct proxy_held h = proxy_unhold();
+
+            if (h.client >= 0)
+                proxy_send(h.client, h.route, h.dir, &h.to, h.data, h.len, &st);
+            free(h.data);
+        }
+    }
+
+    proxy_print_stats(&st);
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/* A minimal io_uring on top of the raw system calls. */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "tftp.h"
+
+#ifdef OS_LINUX
+#include "uring.h"
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned int op, void *arg, unsigned int n)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_init(struct uring *u, unsigned int entries)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *ring;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+
+    if ((u->fd = uring_setup(entries, &p)) < 0)
+        return -1;
+
+    /* One mapping for both rings, waiting with a timeout and
+     * completions skipped for linked reads */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_CQE_SKIP)) {
+        close(u->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->ring = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->ring != MAP_FAILED)
+            munmap(u->ring, u->ring_len);
+        if (u->sqes != MAP_FAILED)
+            munmap(u->sqes, u->sqes_len);
+        close(u->fd);
+        return -1;
+    }
+
+    ring = u->ring;
+    u->sq_head = (unsigned int *) (ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *) (ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *) (ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int *) (ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned int *) (ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *) (ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *) (ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+
+    return 0;
+}
+
+void uring_free(struct uring *u)
+{
+    if (u->br)
+        munmap(u->br, u->br_entries * sizeof(struct io_uring_buf));
+    free(u->bufs);
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->ring, u->ring_len);
+    close(u->fd);
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+    unsigned int tail = *u->sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+        return NULL;
+
+    sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    /* Slots are used in order, the array is the identity */
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+
+    return sqe;
+}
+
+int uring_submit(struct uring *u)
+{
+    int n = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, 0, 0, NULL, 0);
+
+    if (n > 0)
+        u->sq_pending -= n;
+
+    return n;
+}
+
+int uring_enter(struct uring *u, long long timeout_us)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int n;
+
+    if (timeout_us < 0)
+        timeout_us = 0;
+
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long) &ts;
+
+    /* Don't wait if there is something to take already */
+    n = syscall(__NR_io_uring_enter, u->fd, u->sq_pending,
+                uring_cqe(u) ? 0 : 1,
+                IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg));
+
+    if (n < 0)
+        return errno == ETIME ? 0 : -1;
+
+    u->sq_pending -= n;
+
+    return n;
+}
+
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned int n)
+{
+    return uring_register(u->fd, IORING_REGISTER_BUFFERS, (void *) iov, n);
+}
+
+int uring_bufs_init(struct uring *u, unsigned short bgid, unsigned int n, size_t size)
+{
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+
+    /* The ring must be page aligned */
+    u->br = mmap(NULL, n * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        return -1;
+    }
+
+    u->br_entries = n;
+    u->buf_size = size;
+    u->bgid = bgid;
+
+    if (!(u->bufs = malloc(n * size)))
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) u->br;
+    reg.ring_entries = n;
+    reg.bgid = bgid;
+
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (i = 0; i < n; i++)
+        uring_buf_recycle(u, i);
+
+    return 0;
+}
+#endif
@@ -0,0 +1,103 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/*
+  A minimal io_uring, set up and driven with the raw system calls.
+  Submissions are queued with uring_sqe() and go to the kernel with
+  the next uring_enter(), completions are taken with uring_cqe() and
+  uring_cqe_seen().
+ */
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_pending; /* Queued since the last uring_enter() */
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *ring; /* The SQ and CQ rings, one mapping */
+	size_t ring_len;
+	size_t sqes_len;
+	/* Provided buffers, see uring_bufs_init() */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	size_t buf_size;
+	unsigned int br_entries;
+	unsigned short br_tail;
+	unsigned short bgid;
+};
+
+/*
+  Set up a ring with room for 'entries' submissions. Returns negative
+  if io_uring is missing or lacks a feature we rely on.
+ */
+int uring_init(struct uring *u, unsigned int entries);
+void uring_free(struct uring *u);
+
+/* The next free submission, zeroed, or NULL if the queue is full */
+struct io_uring_sqe *uring_sqe(struct uring *u);
+
+/* Submit what was queued without waiting. Returns the number of
+ * submissions taken, or negative on error. */
+int uring_submit(struct uring *u);
+
+/*
+  Submit what was queued and wait until at least one completion is
+  there or 'timeout_us' microseconds have passed. Returns the number
+  of submissions taken, or negative with errno set on error.
+ */
+int uring_enter(struct uring *u, long long timeout_us);
+
+/* The next completion, or NULL if there is none */
+static inline struct io_uring_cqe *uring_cqe(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &u->cqes[head & *u->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Register 'n' buffers for fixed reads and writes */
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned int n);
+
+/*
+  Provide 'n' receive buffers of 'size' bytes each as buffer group
+  'bgid', for the kernel to pick from (IOSQE_BUFFER_SELECT). Returns
+  negative on error.
+ */
+int uring_bufs_init(struct uring *u, unsigned short bgid, unsigned int n, size_t size);
+
+/* A provided buffer by ID */
+static inline char *uring_buf(struct uring *u, unsigned int bid)
+{
+	return u->bufs + bid * u->buf_size;
+}
+
+/* Give a provided buffer back to the kernel */
+static inline void uring_buf_recycle(struct uring *u, unsigned int bid)
+{
+	struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->br_entries - 1)];
+
+	b->addr = (unsigned long) uring_buf(u, bid);
+	b->len = u->buf_size;
+	b->bid = bid;
+	__atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif /* _URING_H */